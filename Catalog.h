@@ -0,0 +1,36 @@
+#ifndef CATALOG_INCLUDED
+#define CATALOG_INCLUDED
+
+#include <memory>
+#include <cstdint>
+#include "UserDatabase.h"
+#include "MovieDatabase.h"
+#include "NeighborIndex.h"
+#include "MinHashIndex.h"
+#include "EmbeddingIndex.h"
+#include "SearchIndex.h"
+#include "Recommender.h"
+#include "Rcu.h"
+
+// One generation of everything requests are answered from: both databases, the indices built
+// from them and a Recommender bound to them. A generation is not changed once it has been
+// published in a LiveCatalog. Reloading the data files builds a whole new generation next to
+// the one being served and publishes it; requests that started on the old generation finish on
+// it, and it is freed once the last of them has.
+struct Catalog
+{
+    UserDatabase users;
+    MovieDatabase movies;
+    NeighborIndex neighbors; // only used by the recommender if use_neighbors
+    bool use_neighbors = false;
+    MinHashIndex similar_users; // answers the recommender's SIMILAR_USERS requests
+    EmbeddingIndex embeddings; // answers its EMBEDDING requests, if use_embeddings
+    bool use_embeddings = false;
+    SearchIndex search;
+    std::unique_ptr<Recommender> recommender; // reads users, movies and the indices above
+    uint64_t generation = 0; // 1 for the catalog loaded at startup, then one more per reload
+};
+
+typedef RcuPointer<Catalog> LiveCatalog;
+
+#endif // CATALOG_INCLUDED
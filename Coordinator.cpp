@@ -0,0 +1,341 @@
+#include "Coordinator.h"
+#include "UserDatabase.h"
+#include "Json.h"
+#include "SocketUtil.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace std;
+
+extern char** environ;
+
+// How long a worker may take to load its shard before start_workers gives up on it, and how
+// often it is polled meanwhile
+static const chrono::minutes WORKER_START_TIMEOUT(10);
+static const chrono::milliseconds WORKER_POLL_INTERVAL(50);
+
+// A worker that does not answer within this long is treated as gone
+static const int SHARD_TIMEOUT_SECONDS = 30;
+
+// The most emails one batch may hold, and how many of a shard's requests are sent before their
+// answers are read. Without the window a large batch could fill both socket buffers, with the
+// worker blocked sending answers nobody reads and the coordinator blocked sending requests.
+static const size_t MAX_BATCH_EMAILS = 100000;
+static const size_t BATCH_WINDOW = 64;
+
+// Connects to a Unix socket; -1 if nothing listens there yet
+static int connect_unix(const string& path) {
+    sockaddr_un address = {};
+    if (path.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+#ifdef SOCK_CLOEXEC
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+#else
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0); // macOS: set close-on-exec afterwards
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    if (fd < 0) {
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    timeval timeout = { SHARD_TIMEOUT_SECONDS, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+Coordinator::Coordinator() : m_next_shard(0) {}
+
+Coordinator::~Coordinator() {
+    stop_workers();
+}
+
+bool Coordinator::start_workers(const string& program, uint32_t shard_count, unsigned worker_threads, const string& socket_prefix) {
+    if (!m_shards.empty() || shard_count == 0) {
+        return false;
+    }
+
+    // The workers start with no signals blocked, whatever the coordinator's threads block
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigmask(&attributes, &no_signals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+    bool spawned = true;
+    for (uint32_t s = 0; s < shard_count && spawned; s++) {
+        unique_ptr<Shard> shard(new Shard);
+        shard->socket_path = socket_prefix + to_string(s) + ".sock";
+        vector<string> arguments = { program, "serve", "unix:" + shard->socket_path, to_string(worker_threads),
+            to_string(s) + "/" + to_string(shard_count) };
+        vector<char*> argv;
+        for (string& argument : arguments) {
+            argv.push_back(argument.data());
+        }
+        argv.push_back(nullptr);
+        spawned = posix_spawn(&shard->pid, program.c_str(), nullptr, &attributes, argv.data(), environ) == 0;
+        if (spawned) {
+            m_shards.push_back(move(shard));
+        }
+    }
+    posix_spawnattr_destroy(&attributes);
+
+    // Each worker is ready once its socket accepts a connection, which becomes the first idle one
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + WORKER_START_TIMEOUT;
+    for (int s = 0; s < m_shards.size() && spawned; s++) {
+        Shard& shard = *m_shards[s];
+        while (true) {
+            int fd = connect_unix(shard.socket_path);
+            if (fd >= 0) {
+                shard.idle_fds.push_back(fd);
+                break;
+            }
+            int status;
+            if (waitpid(shard.pid, &status, WNOHANG) == shard.pid) {
+                shard.pid = -1; // already reaped
+                spawned = false;
+                break;
+            }
+            if (chrono::steady_clock::now() > deadline) {
+                spawned = false;
+                break;
+            }
+            this_thread::sleep_for(WORKER_POLL_INTERVAL);
+        }
+    }
+    if (!spawned) {
+        stop_workers();
+    }
+    return spawned;
+}
+
+void Coordinator::stop_workers() {
+    for (unique_ptr<Shard>& shard : m_shards) {
+        for (int fd : shard->idle_fds) {
+            close(fd);
+        }
+        shard->idle_fds.clear();
+        if (shard->pid > 0) {
+            kill(shard->pid, SIGTERM);
+            int status;
+            while (waitpid(shard->pid, &status, 0) < 0 && errno == EINTR) {
+            }
+        }
+    }
+    m_shards.clear();
+}
+
+void Coordinator::reload_workers() {
+    for (unique_ptr<Shard>& shard : m_shards) {
+        if (shard->pid > 0) {
+            kill(shard->pid, SIGHUP);
+        }
+    }
+}
+
+uint32_t Coordinator::get_shard_count() const {
+    return uint32_t(m_shards.size());
+}
+
+uint64_t Coordinator::get_forwarded_count(uint32_t shard) const {
+    return m_shards[shard]->forwarded.load(memory_order_relaxed);
+}
+
+bool Coordinator::exchange(Shard& shard, string_view requests, size_t request_count, string& replies) const {
+    // Use an idle connection if there is one, so concurrent requests each get their own
+    int fd = -1;
+    {
+        scoped_lock lock(shard.idle_mutex);
+        if (!shard.idle_fds.empty()) {
+            fd = shard.idle_fds.back();
+            shard.idle_fds.pop_back();
+        }
+    }
+    if (fd < 0 && (fd = connect_unix(shard.socket_path)) < 0) {
+        return false;
+    }
+    shard.forwarded.fetch_add(request_count, memory_order_relaxed);
+
+    // The worker answers every line with one line, in order, and sends nothing else
+    bool answered = send_all(fd, requests);
+    size_t lines = 0;
+    char buffer[READ_CHUNK_BYTES];
+    while (answered && lines < request_count) {
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            answered = false;
+            break;
+        }
+        lines += size_t(count(buffer, buffer + received, '\n'));
+        replies.append(buffer, size_t(received));
+    }
+
+    if (!answered) {
+        close(fd);
+        return false;
+    }
+    scoped_lock lock(shard.idle_mutex);
+    shard.idle_fds.push_back(fd);
+    return true;
+}
+
+void Coordinator::handle_request(string_view line, string& response) const {
+    JsonObject request;
+    string error;
+    if (!request.parse(line, error)) {
+        append_json_error(JsonObject(), error, response);
+        return;
+    }
+
+    const string* op = request.get_string("op");
+    uint32_t shard;
+    if (op != nullptr && (*op == "user" || *op == "recommend")) {
+        const string* email = request.get_string("email");
+        if (email == nullptr) {
+            append_json_error(request, "missing email", response);
+            return;
+        }
+        shard = UserDatabase::shard_of_email(*email, get_shard_count());
+    }
+    else if (op != nullptr && (*op == "lookup" || *op == "search")) {
+        // Every worker has the whole catalog
+        shard = m_next_shard.fetch_add(1, memory_order_relaxed) % get_shard_count();
+    }
+    else if (op != nullptr && *op == "recommend_batch") {
+        answer_batch(request, response);
+        return;
+    }
+    else {
+        append_json_error(request, op == nullptr ? "missing op" : "unknown op", response);
+        return;
+    }
+
+    // The worker's answer already carries the request's id
+    string forwarded(line);
+    forwarded += '\n';
+    size_t answer_start = response.size();
+    if (!exchange(*m_shards[shard], forwarded, 1, response)) {
+        response.resize(answer_start);
+        append_json_error(request, "shard " + to_string(shard) + " is unavailable", response);
+    }
+}
+
+void Coordinator::answer_batch(const JsonObject& request, string& response) const {
+    const vector<string>* emails = request.get_string_array("emails");
+    if (emails == nullptr) {
+        append_json_error(request, "missing emails", response);
+        return;
+    }
+    if (emails->size() > MAX_BATCH_EMAILS) {
+        append_json_error(request, "a batch may hold at most " + to_string(MAX_BATCH_EMAILS) + " emails", response);
+        return;
+    }
+
+    // Every recommend request of the batch carries the batch's options as they were written
+    string options;
+    for (const char* key : { "count", "min_year", "max_year", "min_rating", "exclude_genres", "engine" }) {
+        string_view value = request.get_raw(key);
+        if (!value.empty()) {
+            options += ",\"";
+            options += key;
+            options += "\":";
+            options += value;
+        }
+    }
+
+    // positions[s] are the places in the batch of the emails shard s holds, in batch order
+    vector<vector<uint32_t>> positions(m_shards.size());
+    for (uint32_t e = 0; e < emails->size(); e++) {
+        positions[UserDatabase::shard_of_email((*emails)[e], get_shard_count())].push_back(e);
+    }
+
+    // Each shard's answers arrive in the order of its positions
+    vector<string> replies(m_shards.size());
+    vector<char> reached(m_shards.size(), true);
+    auto run_shard = [&](uint32_t s) {
+        string requests;
+        for (size_t start = 0; start < positions[s].size() && reached[s]; start += BATCH_WINDOW) {
+            size_t end = min(start + BATCH_WINDOW, positions[s].size());
+            requests.clear();
+            for (size_t p = start; p < end; p++) {
+                requests += "{\"op\":\"recommend\",\"email\":";
+                append_json_string(requests, (*emails)[positions[s][p]]);
+                requests += options;
+                requests += "}\n";
+            }
+            reached[s] = exchange(*m_shards[s], requests, end - start, replies[s]);
+        }
+    };
+    vector<thread> helpers;
+    uint32_t last_shard = uint32_t(m_shards.size());
+    for (uint32_t s = 0; s < m_shards.size(); s++) {
+        if (!positions[s].empty()) {
+            if (last_shard < m_shards.size()) {
+                helpers.emplace_back(run_shard, last_shard);
+            }
+            last_shard = s;
+        }
+    }
+    if (last_shard < m_shards.size()) {
+        run_shard(last_shard); // on this thread
+    }
+    for (thread& helper : helpers) {
+        helper.join();
+    }
+
+    // Put every answer line back in its email's place
+    vector<string_view> answers(emails->size());
+    vector<string> failures(m_shards.size());
+    for (uint32_t s = 0; s < m_shards.size(); s++) {
+        if (!reached[s]) {
+            failures[s] = "{\"ok\":false,\"error\":\"shard " + to_string(s) + " is unavailable\"}";
+            for (uint32_t position : positions[s]) {
+                answers[position] = failures[s];
+            }
+            continue;
+        }
+        size_t line_start = 0;
+        for (uint32_t position : positions[s]) {
+            size_t newline = replies[s].find('\n', line_start);
+            answers[position] = string_view(replies[s]).substr(line_start, newline - line_start);
+            line_start = newline + 1;
+        }
+    }
+
+    begin_json_response(request, response);
+    response += "\"ok\":true,\"results\":[";
+    for (size_t a = 0; a < answers.size(); a++) {
+        if (a > 0) {
+            response += ',';
+        }
+        response += answers[a];
+    }
+    response += "]}\n";
+}
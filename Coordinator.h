@@ -0,0 +1,65 @@
+#ifndef COORDINATOR_INCLUDED
+#define COORDINATOR_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <sys/types.h>
+#include "Server.h"
+
+class JsonObject;
+
+// Splits the users across shard worker processes on one machine. Worker i is this program in
+// serve mode on a Unix socket, loading only the users UserDatabase::shard_of_email puts in shard
+// i (and the whole movie catalog, whose snapshot pages the workers share). The coordinator
+// answers the same requests as CatalogHandler by forwarding each line unchanged: "user" and
+// "recommend" to the shard of their email, "lookup" and "search" to the shards in turn. It also
+// fans out one request over many users:
+//   {"op":"recommend_batch","emails":["...",...],"count":10}
+//       with the same optional filters as "recommend"
+//       -> {"ok":true,"results":[<the recommend response for each email, in order>,...]}
+// Each shard gets its part of a batch pipelined on one connection, all shards at once.
+class Coordinator : public RequestHandler
+{
+public:
+    Coordinator();
+    ~Coordinator(); // stops the workers
+
+    // Starts shard_count workers of program, each serving on socket_prefix<shard>.sock with
+    // worker_threads threads (0 means one per hardware thread), and waits until every one
+    // accepts connections. Returns false, with the workers stopped, if one of them exits first.
+    bool start_workers(const std::string& program, uint32_t shard_count, unsigned worker_threads, const std::string& socket_prefix);
+    // Sends SIGTERM to every worker and waits for it to exit
+    void stop_workers();
+    // Sends SIGHUP to every worker, so each reloads its shard of the data files
+    void reload_workers();
+
+    uint32_t get_shard_count() const;
+    uint64_t get_forwarded_count(uint32_t shard) const; // requests sent to the shard so far
+
+    void handle_request(std::string_view line, std::string& response) const override;
+
+private:
+    struct Shard
+    {
+        std::string socket_path;
+        pid_t pid = -1;
+        std::mutex idle_mutex; // guards idle_fds
+        std::vector<int> idle_fds; // connections to the worker no request is using
+        std::atomic<uint64_t> forwarded{ 0 };
+    };
+
+    // Sends request_count request lines to the shard and reads as many response lines into
+    // replies; false if the worker cannot be reached or stops answering
+    bool exchange(Shard& shard, std::string_view requests, size_t request_count, std::string& replies) const;
+    void answer_batch(const JsonObject& request, std::string& response) const;
+
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    mutable std::atomic<uint32_t> m_next_shard; // where the next lookup or search goes
+};
+
+#endif // COORDINATOR_INCLUDED
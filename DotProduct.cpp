@@ -0,0 +1,57 @@
+#include "DotProduct.h"
+#include <cstddef>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define DOT_PRODUCT_AVX2
+#endif
+using namespace std;
+
+// Portable version, one row at a time
+static void compute_dot_products_scalar(const float* rows, size_t row_count, size_t stride, const float* query, float* scores) {
+    for (size_t r = 0; r < row_count; r++) {
+        const float* row = rows + r * stride;
+        float sum = 0;
+        for (size_t d = 0; d < stride; d++) {
+            sum += row[d] * query[d];
+        }
+        scores[r] = sum;
+    }
+}
+
+#ifdef DOT_PRODUCT_AVX2
+// Four rows per step, eight dimensions per fused multiply-add, with one accumulator per row.
+// The four accumulators are then summed across their lanes together: two rounds of horizontal
+// adds leave each row's two half sums in the two 128-bit halves, which one add combines.
+__attribute__((target("avx2,fma")))
+static void compute_dot_products_avx2(const float* rows, size_t row_count, size_t stride, const float* query, float* scores) {
+    size_t r = 0;
+    for (; r + 4 <= row_count; r += 4) {
+        const float* row = rows + r * stride;
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        __m256 acc3 = _mm256_setzero_ps();
+        for (size_t d = 0; d < stride; d += 8) {
+            __m256 q = _mm256_loadu_ps(query + d);
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(row + d), q, acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(row + stride + d), q, acc1);
+            acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(row + 2 * stride + d), q, acc2);
+            acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(row + 3 * stride + d), q, acc3);
+        }
+        __m256 sums = _mm256_hadd_ps(_mm256_hadd_ps(acc0, acc1), _mm256_hadd_ps(acc2, acc3));
+        _mm_storeu_ps(scores + r, _mm_add_ps(_mm256_castps256_ps128(sums), _mm256_extractf128_ps(sums, 1)));
+    }
+    compute_dot_products_scalar(rows + r * stride, row_count - r, stride, query, scores + r);
+}
+#endif
+
+void compute_dot_products(const float* rows, size_t row_count, size_t stride, const float* query, float* scores) {
+#ifdef DOT_PRODUCT_AVX2
+    static const bool has_avx2_fma = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (has_avx2_fma) {
+        compute_dot_products_avx2(rows, row_count, stride, query, scores);
+        return;
+    }
+#endif
+    compute_dot_products_scalar(rows, row_count, stride, query, scores);
+}
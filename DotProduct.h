@@ -0,0 +1,12 @@
+#ifndef DOTPRODUCT_INCLUDED
+#define DOTPRODUCT_INCLUDED
+
+#include <cstddef>
+
+// Sets scores[r] to the dot product of query with row r of rows, for row_count rows that start
+// stride floats apart. Both the rows and the query have stride floats, the ones past the
+// vector's dimensions being zero, and stride is a multiple of 8. Uses AVX2 and FMA when the CPU
+// has them, four rows per step so the query is loaded once for all four.
+void compute_dot_products(const float* rows, size_t row_count, size_t stride, const float* query, float* scores);
+
+#endif // DOTPRODUCT_INCLUDED
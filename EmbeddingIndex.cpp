@@ -0,0 +1,491 @@
+#include "EmbeddingIndex.h"
+#include "UserDatabase.h"
+#include "MovieDatabase.h"
+#include "User.h"
+#include "Movie.h"
+#include "DotProduct.h"
+#include "ThreadPool.h"
+#include "Snapshot.h"
+#include <string>
+#include <vector>
+#include <span>
+#include <memory>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <fstream>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+using namespace std;
+
+// Identifies the binary file format written by save()
+static const char EMBEDDING_FILE_MAGIC[8] = { 'N', 'M', 'R', 'E', 'M', 'B', '0', '2' };
+
+// Rows are padded to whole 64-byte cache lines
+static const size_t ROW_ALIGNMENT_FLOATS = 16;
+
+// Rows scored by one call of the dot product kernel before their scores are offered to the heap
+static const size_t ROWS_PER_BLOCK = 256;
+
+// Users or movies solved for by one parallel_for task while training
+static const size_t VECTORS_PER_TASK = 64;
+
+static const int KMEANS_ITERATIONS = 10;
+
+// Working memory for solve_vector, reused from call to call
+struct SolveScratch
+{
+    vector<double> matrix;
+    vector<double> rhs;
+};
+
+// Per-thread working memory for fold_in and find_top_movies
+struct EmbeddingQueryScratch
+{
+    vector<uint32_t> rows; // of the watched movies
+    SolveScratch solve;
+    vector<float> block_scores = vector<float>(ROWS_PER_BLOCK);
+    vector<float> list_scores;
+    vector<uint32_t> lists;
+};
+
+static EmbeddingQueryScratch& query_scratch() {
+    static thread_local EmbeddingQueryScratch scratch;
+    return scratch;
+}
+
+// Heap order of (movie index, score) results: higher scores first, then lower movie indices
+static bool better_result(const pair<uint32_t, float>& a, const pair<uint32_t, float>& b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+}
+
+// Solves a x = b for a symmetric positive definite n x n matrix a (row major), overwriting the
+// lower triangle of a with its Cholesky factor and b with x
+static void solve_cholesky(double* a, double* b, int n) {
+    for (int j = 0; j < n; j++) {
+        double diagonal = a[j * n + j];
+        for (int k = 0; k < j; k++) {
+            diagonal -= a[j * n + k] * a[j * n + k];
+        }
+        a[j * n + j] = sqrt(max(diagonal, 1e-12));
+        for (int i = j + 1; i < n; i++) {
+            double sum = a[i * n + j];
+            for (int k = 0; k < j; k++) {
+                sum -= a[i * n + k] * a[j * n + k];
+            }
+            a[i * n + j] = sum / a[j * n + j];
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        double sum = b[i];
+        for (int k = 0; k < i; k++) {
+            sum -= a[i * n + k] * b[k];
+        }
+        b[i] = sum / a[i * n + i];
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        double sum = b[i];
+        for (int k = i + 1; k < n; k++) {
+            sum -= a[k * n + i] * b[k];
+        }
+        b[i] = sum / a[i * n + i];
+    }
+}
+
+// The lower triangle of the sum of v * v^T over count rows of vectors
+static vector<double> gram_matrix(const float* vectors, size_t count, size_t stride, int dimensions) {
+    vector<double> gram(size_t(dimensions) * dimensions, 0);
+    for (size_t r = 0; r < count; r++) {
+        const float* v = vectors + r * stride;
+        for (int i = 0; i < dimensions; i++) {
+            for (int j = 0; j <= i; j++) {
+                gram[i * dimensions + j] += double(v[i]) * v[j];
+            }
+        }
+    }
+    return gram;
+}
+
+// The implicit least squares step for one vector x given the fixed vectors of the other side:
+// minimize the sum over every other vector y of c (p - x.y)^2 plus regularization |x|^2, with
+// p = 1 and c = 1 + alpha for the rows x was watched with and p = 0, c = 1 for the rest. That is
+// (gram + alpha * sum of y y^T over rows + regularization I) x = (1 + alpha) * sum of y over rows,
+// where only the rows cost anything beyond the shared gram matrix. Writes x to out.
+static void solve_vector(const float* others, size_t stride, int dimensions, span<const uint32_t> rows, const vector<double>& gram,
+    float alpha, float regularization, SolveScratch& scratch, float* out) {
+    if (rows.empty()) {
+        fill(out, out + dimensions, 0.0f);
+        return;
+    }
+    scratch.matrix.assign(gram.begin(), gram.end());
+    scratch.rhs.assign(dimensions, 0);
+    for (uint32_t row : rows) {
+        const float* y = others + row * stride;
+        for (int i = 0; i < dimensions; i++) {
+            double scaled = double(alpha) * y[i];
+            for (int j = 0; j <= i; j++) {
+                scratch.matrix[i * dimensions + j] += scaled * y[j];
+            }
+            scratch.rhs[i] += (1.0 + alpha) * y[i];
+        }
+    }
+    for (int i = 0; i < dimensions; i++) {
+        scratch.matrix[i * dimensions + i] += regularization;
+    }
+    solve_cholesky(scratch.matrix.data(), scratch.rhs.data(), dimensions);
+    for (int i = 0; i < dimensions; i++) {
+        out[i] = float(scratch.rhs[i]);
+    }
+}
+
+EmbeddingIndex::EmbeddingIndex()
+    : m_movie_count(0), m_dimensions(0), m_stride(0), m_alpha(0), m_regularization(0), m_probe_count(0), m_fingerprint(0) {
+    m_list_starts.push_back(0);
+}
+
+EmbeddingIndex::AlignedFloats EmbeddingIndex::allocate(size_t count) {
+    AlignedFloats floats(static_cast<float*>(::operator new[](max<size_t>(count, 1) * sizeof(float), align_val_t(64))));
+    fill(floats.get(), floats.get() + count, 0.0f);
+    return floats;
+}
+
+void EmbeddingIndex::train(const UserDatabase& user_database, const MovieDatabase& movie_database, const TrainingOptions& options) {
+    m_movie_count = movie_database.get_movie_count();
+    m_fingerprint = movie_database.get_fingerprint();
+    m_dimensions = max(options.dimensions, 1);
+    m_stride = (size_t(m_dimensions) + ROW_ALIGNMENT_FLOATS - 1) / ROW_ALIGNMENT_FLOATS * ROW_ALIGNMENT_FLOATS;
+    m_alpha = options.alpha;
+    m_regularization = options.regularization;
+    size_t user_count = size_t(user_database.get_user_count());
+    size_t movie_count = size_t(m_movie_count);
+
+    // The distinct catalog movies of every user, and the users of every movie
+    vector<uint32_t> movie_of_number(user_database.get_movie_id_count(), UINT32_MAX);
+    for (uint32_t number = 0; number < movie_of_number.size(); number++) {
+        Movie* movie = movie_database.get_movie_from_id(user_database.get_movie_id(number));
+        if (movie != nullptr) {
+            movie_of_number[number] = uint32_t(movie->get_index());
+        }
+    }
+    vector<uint32_t> user_starts(1, 0);
+    vector<uint32_t> user_movies;
+    for (size_t u = 0; u < user_count; u++) {
+        size_t start = user_movies.size();
+        for (uint32_t number : user_database.get_user_at(int(u))->get_watch_history_view()) {
+            if (number < movie_of_number.size() && movie_of_number[number] != UINT32_MAX) {
+                user_movies.push_back(movie_of_number[number]);
+            }
+        }
+        sort(user_movies.begin() + start, user_movies.end());
+        user_movies.erase(unique(user_movies.begin() + start, user_movies.end()), user_movies.end());
+        user_starts.push_back(uint32_t(user_movies.size()));
+    }
+    vector<uint32_t> movie_starts(movie_count + 1, 0);
+    for (uint32_t movie : user_movies) {
+        movie_starts[movie + 1]++;
+    }
+    partial_sum(movie_starts.begin(), movie_starts.end(), movie_starts.begin());
+    vector<uint32_t> movie_users(user_movies.size());
+    vector<uint32_t> next(movie_starts.begin(), movie_starts.end() - 1);
+    for (size_t u = 0; u < user_count; u++) {
+        for (uint32_t p = user_starts[u]; p < user_starts[u + 1]; p++) {
+            movie_users[next[user_movies[p]]++] = uint32_t(u);
+        }
+    }
+
+    // Small random movie vectors to start from; the user vectors are solved for first
+    AlignedFloats user_vectors = allocate(user_count * m_stride);
+    AlignedFloats movie_vectors = allocate(movie_count * m_stride);
+    mt19937 generator(uint32_t(options.seed));
+    float scale = 0.1f / sqrt(float(m_dimensions));
+    for (size_t m = 0; m < movie_count; m++) {
+        for (int d = 0; d < m_dimensions; d++) {
+            movie_vectors[m * m_stride + d] = scale * (float(generator()) / float(UINT32_MAX) - 0.5f);
+        }
+    }
+
+    ThreadPool pool(options.thread_count);
+    vector<SolveScratch> solve_scratch(pool.get_thread_count());
+    auto solve_side = [&](const AlignedFloats& fixed, size_t fixed_count, AlignedFloats& solved, size_t solved_count,
+        const vector<uint32_t>& starts, const vector<uint32_t>& members) {
+        vector<double> gram = gram_matrix(fixed.get(), fixed_count, m_stride, m_dimensions);
+        pool.parallel_for((solved_count + VECTORS_PER_TASK - 1) / VECTORS_PER_TASK, [&](size_t task, unsigned worker) {
+            size_t end = min(solved_count, (task + 1) * VECTORS_PER_TASK);
+            for (size_t s = task * VECTORS_PER_TASK; s < end; s++) {
+                span<const uint32_t> rows(members.data() + starts[s], starts[s + 1] - starts[s]);
+                solve_vector(fixed.get(), m_stride, m_dimensions, rows, gram, m_alpha, m_regularization,
+                    solve_scratch[worker], solved.get() + s * m_stride);
+            }
+        });
+    };
+    for (int iteration = 0; iteration < options.iterations; iteration++) {
+        solve_side(movie_vectors, movie_count, user_vectors, user_count, user_starts, user_movies);
+        solve_side(user_vectors, user_count, movie_vectors, movie_count, movie_starts, movie_users);
+    }
+
+    m_gram = gram_matrix(movie_vectors.get(), movie_count, m_stride, m_dimensions);
+    build_lists(options, movie_vectors);
+}
+
+// Groups the movie vectors into lists by spherical k-means (on the vectors scaled to unit
+// length, so a list is movies pointing the same way) and lays the rows out list by list
+void EmbeddingIndex::build_lists(const TrainingOptions& options, const AlignedFloats& vectors) {
+    size_t movie_count = size_t(m_movie_count);
+    size_t list_count = options.list_count > 0 ? size_t(options.list_count) : size_t(lround(sqrt(double(movie_count))));
+    list_count = max<size_t>(1, min(list_count, movie_count));
+
+    AlignedFloats directions = allocate(movie_count * m_stride);
+    for (size_t m = 0; m < movie_count; m++) {
+        const float* v = vectors.get() + m * m_stride;
+        double length = sqrt(inner_product(v, v + m_stride, v, 0.0));
+        for (size_t d = 0; d < m_stride && length > 0; d++) {
+            directions[m * m_stride + d] = float(v[d] / length);
+        }
+    }
+
+    // Start from the directions of list_count different movies
+    AlignedFloats centers = allocate(list_count * m_stride);
+    vector<uint32_t> order(movie_count);
+    iota(order.begin(), order.end(), 0);
+    shuffle(order.begin(), order.end(), mt19937(uint32_t(options.seed)));
+    for (size_t l = 0; l < list_count && l < movie_count; l++) {
+        copy(directions.get() + order[l] * m_stride, directions.get() + (order[l] + 1) * m_stride, centers.get() + l * m_stride);
+    }
+
+    vector<uint32_t> list_of_movie(movie_count, 0);
+    vector<float> center_scores(list_count);
+    vector<double> sums(list_count * m_stride);
+    for (int iteration = 0; iteration < KMEANS_ITERATIONS; iteration++) {
+        for (size_t m = 0; m < movie_count; m++) {
+            compute_dot_products(centers.get(), list_count, m_stride, directions.get() + m * m_stride, center_scores.data());
+            list_of_movie[m] = uint32_t(max_element(center_scores.begin(), center_scores.end()) - center_scores.begin());
+        }
+        fill(sums.begin(), sums.end(), 0.0);
+        for (size_t m = 0; m < movie_count; m++) {
+            for (size_t d = 0; d < m_stride; d++) {
+                sums[list_of_movie[m] * m_stride + d] += directions[m * m_stride + d];
+            }
+        }
+        for (size_t l = 0; l < list_count; l++) {
+            double length = sqrt(inner_product(sums.begin() + l * m_stride, sums.begin() + (l + 1) * m_stride, sums.begin() + l * m_stride, 0.0));
+            for (size_t d = 0; d < m_stride && length > 0; d++) { // an empty list keeps its center
+                centers[l * m_stride + d] = float(sums[l * m_stride + d] / length);
+            }
+        }
+    }
+
+    // Counting sort of the movies by list, each list in movie order
+    m_list_starts.assign(list_count + 1, 0);
+    for (size_t m = 0; m < movie_count; m++) {
+        m_list_starts[list_of_movie[m] + 1]++;
+    }
+    partial_sum(m_list_starts.begin(), m_list_starts.end(), m_list_starts.begin());
+    vector<uint32_t> next(m_list_starts.begin(), m_list_starts.end() - 1);
+    m_row_movies.resize(movie_count);
+    m_movie_rows.resize(movie_count);
+    m_rows = allocate(movie_count * m_stride);
+    for (size_t m = 0; m < movie_count; m++) {
+        uint32_t row = next[list_of_movie[m]]++;
+        m_row_movies[row] = uint32_t(m);
+        m_movie_rows[m] = row;
+        copy(vectors.get() + m * m_stride, vectors.get() + (m + 1) * m_stride, m_rows.get() + row * m_stride);
+    }
+    m_centers = move(centers);
+}
+
+bool EmbeddingIndex::save(const string& filename) const {
+    ofstream outfile(filename, ios::binary);
+    if (!outfile) {
+        return false;
+    }
+
+    // Header: magic, movie count, dimensions, row stride, list count, then alpha and regularization,
+    // then the fingerprint of the catalog
+    uint32_t header[4] = { uint32_t(m_movie_count), uint32_t(m_dimensions), uint32_t(m_stride), uint32_t(get_list_count()) };
+    float parameters[2] = { m_alpha, m_regularization };
+    outfile.write(EMBEDDING_FILE_MAGIC, sizeof(EMBEDDING_FILE_MAGIC));
+    outfile.write(reinterpret_cast<const char*>(header), sizeof(header));
+    outfile.write(reinterpret_cast<const char*>(parameters), sizeof(parameters));
+    outfile.write(reinterpret_cast<const char*>(&m_fingerprint), sizeof(m_fingerprint));
+
+    // Body: the arrays back to back
+    outfile.write(reinterpret_cast<const char*>(m_rows.get()), size_t(m_movie_count) * m_stride * sizeof(float));
+    outfile.write(reinterpret_cast<const char*>(m_row_movies.data()), m_row_movies.size() * sizeof(uint32_t));
+    outfile.write(reinterpret_cast<const char*>(m_list_starts.data()), m_list_starts.size() * sizeof(uint32_t));
+    outfile.write(reinterpret_cast<const char*>(m_centers.get()), size_t(get_list_count()) * m_stride * sizeof(float));
+    outfile.write(reinterpret_cast<const char*>(m_gram.data()), m_gram.size() * sizeof(double));
+    return bool(outfile);
+}
+
+bool EmbeddingIndex::load(const string& filename) {
+    ifstream infile(filename, ios::binary);
+    if (!infile) {
+        return false;
+    }
+
+    char magic[sizeof(EMBEDDING_FILE_MAGIC)];
+    uint32_t header[4];
+    float parameters[2];
+    uint64_t fingerprint;
+    if (!infile.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), EMBEDDING_FILE_MAGIC)) {
+        return false; // not an embedding index, or written by an incompatible version
+    }
+    if (!infile.read(reinterpret_cast<char*>(header), sizeof(header)) || !infile.read(reinterpret_cast<char*>(parameters), sizeof(parameters))
+        || !infile.read(reinterpret_cast<char*>(&fingerprint), sizeof(fingerprint))
+        || header[1] == 0 || header[2] < header[1] || header[2] % ROW_ALIGNMENT_FLOATS != 0 || header[3] == 0) {
+        return false;
+    }
+
+    // The arrays have to be exactly what is left of the file, before anything is allocated for them
+    uint64_t body_bytes = (uint64_t(header[0]) + header[3]) * header[2] * sizeof(float) + uint64_t(header[0]) * sizeof(uint32_t)
+        + (uint64_t(header[3]) + 1) * sizeof(uint32_t) + uint64_t(header[1]) * header[1] * sizeof(double);
+    streamoff body_start = infile.tellg();
+    infile.seekg(0, ios::end);
+    if (!infile || uint64_t(infile.tellg() - body_start) != body_bytes) {
+        return false;
+    }
+    infile.seekg(body_start);
+
+    m_movie_count = int(header[0]);
+    m_dimensions = int(header[1]);
+    m_stride = header[2];
+    m_alpha = parameters[0];
+    m_regularization = parameters[1];
+    m_fingerprint = fingerprint;
+    m_rows = allocate(size_t(m_movie_count) * m_stride);
+    m_row_movies.resize(m_movie_count);
+    m_list_starts.resize(size_t(header[3]) + 1);
+    m_centers = allocate(size_t(header[3]) * m_stride);
+    m_gram.resize(size_t(m_dimensions) * m_dimensions);
+
+    infile.read(reinterpret_cast<char*>(m_rows.get()), size_t(m_movie_count) * m_stride * sizeof(float));
+    infile.read(reinterpret_cast<char*>(m_row_movies.data()), m_row_movies.size() * sizeof(uint32_t));
+    infile.read(reinterpret_cast<char*>(m_list_starts.data()), m_list_starts.size() * sizeof(uint32_t));
+    infile.read(reinterpret_cast<char*>(m_centers.get()), size_t(header[3]) * m_stride * sizeof(float));
+    infile.read(reinterpret_cast<char*>(m_gram.data()), m_gram.size() * sizeof(double));
+    // The lists have to cover the rows in order, or probing would scan past the last row
+    bool valid = bool(infile) && valid_offsets(m_list_starts, size_t(m_movie_count));
+    m_movie_rows.assign(m_movie_count, UINT32_MAX);
+    for (uint32_t row = 0; row < m_row_movies.size() && valid; row++) {
+        valid = m_row_movies[row] < uint32_t(m_movie_count) && m_movie_rows[m_row_movies[row]] == UINT32_MAX;
+        if (valid) {
+            m_movie_rows[m_row_movies[row]] = row;
+        }
+    }
+    if (!valid) {
+        // Truncated or inconsistent file, leave an empty index behind
+        *this = EmbeddingIndex();
+        return false;
+    }
+    return true;
+}
+
+int EmbeddingIndex::get_movie_count() const {
+    return m_movie_count;
+}
+
+uint64_t EmbeddingIndex::get_fingerprint() const {
+    return m_fingerprint;
+}
+
+int EmbeddingIndex::get_dimensions() const {
+    return m_dimensions;
+}
+
+int EmbeddingIndex::get_list_count() const {
+    return int(m_list_starts.size()) - 1;
+}
+
+size_t EmbeddingIndex::get_memory_bytes() const {
+    return (size_t(m_movie_count) + get_list_count()) * m_stride * sizeof(float)
+        + (m_row_movies.size() + m_movie_rows.size() + m_list_starts.size()) * sizeof(uint32_t) + m_gram.size() * sizeof(double);
+}
+
+void EmbeddingIndex::set_probe_count(int probe_count) {
+    m_probe_count = max(probe_count, 0);
+}
+
+int EmbeddingIndex::get_probe_count() const {
+    return m_probe_count;
+}
+
+size_t EmbeddingIndex::get_stride() const {
+    return m_stride;
+}
+
+void EmbeddingIndex::fold_in(span<const int> watched_movies, vector<float>& user_vector) const {
+    EmbeddingQueryScratch& scratch = query_scratch();
+    scratch.rows.clear();
+    for (int movie_index : watched_movies) {
+        if (movie_index >= 0 && movie_index < m_movie_count) {
+            scratch.rows.push_back(m_movie_rows[movie_index]);
+        }
+    }
+    sort(scratch.rows.begin(), scratch.rows.end());
+    scratch.rows.erase(unique(scratch.rows.begin(), scratch.rows.end()), scratch.rows.end());
+
+    user_vector.assign(m_stride, 0.0f);
+    if (m_dimensions > 0) {
+        solve_vector(m_rows.get(), m_stride, m_dimensions, scratch.rows, m_gram, m_alpha, m_regularization,
+            scratch.solve, user_vector.data());
+    }
+}
+
+void EmbeddingIndex::find_top_movies(const vector<float>& user_vector, size_t movie_count, span<const uint64_t> excluded,
+    vector<pair<uint32_t, float>>& top) const {
+    top.clear();
+    if (movie_count == 0 || m_movie_count == 0 || user_vector.size() < m_stride) {
+        return;
+    }
+
+    int list_count = get_list_count();
+    if (m_probe_count == 0 || m_probe_count >= list_count) {
+        scan_rows(0, uint32_t(m_movie_count), user_vector.data(), movie_count, excluded, top);
+    }
+    else {
+        // Only the lists whose centers point most the user's way
+        EmbeddingQueryScratch& scratch = query_scratch();
+        scratch.list_scores.resize(list_count);
+        compute_dot_products(m_centers.get(), list_count, m_stride, user_vector.data(), scratch.list_scores.data());
+        scratch.lists.resize(list_count);
+        iota(scratch.lists.begin(), scratch.lists.end(), 0);
+        partial_sort(scratch.lists.begin(), scratch.lists.begin() + m_probe_count, scratch.lists.end(), [&](uint32_t a, uint32_t b) {
+            return scratch.list_scores[a] != scratch.list_scores[b] ? scratch.list_scores[a] > scratch.list_scores[b] : a < b;
+        });
+        for (int p = 0; p < m_probe_count; p++) {
+            uint32_t list = scratch.lists[p];
+            scan_rows(m_list_starts[list], m_list_starts[list + 1], user_vector.data(), movie_count, excluded, top);
+        }
+    }
+    sort_heap(top.begin(), top.end(), better_result);
+}
+
+// Scores rows [first_row, end_row) a block at a time and offers each movie that is not excluded
+// to the heap of the best movie_count, whose front is the worst one kept
+void EmbeddingIndex::scan_rows(uint32_t first_row, uint32_t end_row, const float* query, size_t movie_count,
+    span<const uint64_t> excluded, vector<pair<uint32_t, float>>& top) const {
+    EmbeddingQueryScratch& scratch = query_scratch();
+    for (uint32_t block = first_row; block < end_row; block += ROWS_PER_BLOCK) {
+        size_t row_count = min<size_t>(ROWS_PER_BLOCK, end_row - block);
+        compute_dot_products(m_rows.get() + block * m_stride, row_count, m_stride, query, scratch.block_scores.data());
+        for (size_t r = 0; r < row_count; r++) {
+            pair<uint32_t, float> candidate(m_row_movies[block + r], scratch.block_scores[r]);
+            if (!excluded.empty() && ((excluded[candidate.first >> 6] >> (candidate.first & 63)) & 1)) {
+                continue;
+            }
+            if (top.size() < movie_count) {
+                top.push_back(candidate);
+                push_heap(top.begin(), top.end(), better_result);
+            }
+            else if (better_result(candidate, top.front())) {
+                pop_heap(top.begin(), top.end(), better_result);
+                top.back() = candidate;
+                push_heap(top.begin(), top.end(), better_result);
+            }
+        }
+    }
+}
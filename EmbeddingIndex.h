@@ -0,0 +1,103 @@
+#ifndef EMBEDDINGINDEX_INCLUDED
+#define EMBEDDINGINDEX_INCLUDED
+
+#include <string>
+#include <vector>
+#include <span>
+#include <memory>
+#include <new>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+class UserDatabase;
+class MovieDatabase;
+
+// A vector of a few dozen floats for every movie, learned from the watch histories so that the
+// dot product of a user's vector with a movie's predicts how likely the user is to watch it.
+// Training is implicit-feedback alternating least squares: every (user, movie) pair is a
+// preference of 1 if the user watched the movie and 0 otherwise, trusted 1 + alpha times more
+// when it is 1, and user and movie vectors are solved for in turn, each with the other side
+// fixed. Only the movie vectors are kept. A user's vector is solved for at query time from the
+// movies they have watched (the same least squares step), so history changes count at once.
+//
+// The movie vectors are stored one per row, rows padded to a multiple of 16 floats in one
+// 64-byte aligned buffer, and scored against a user's vector in blocks (see DotProduct.h) with
+// a bounded heap of the best. The rows are grouped into lists by k-means over the vectors'
+// directions (an inverted file); with a probe count set, a query scores only the lists whose
+// centers are most aligned with the user's vector, which is faster but can miss movies.
+class EmbeddingIndex
+{
+public:
+    struct TrainingOptions
+    {
+        int dimensions = 32;
+        int iterations = 10;
+        float alpha = 20; // how much more a watched pair is trusted than an unwatched one
+        float regularization = 0.1f; // pulls every vector towards zero
+        int list_count = 0; // inverted file lists; 0 for about the square root of the movie count
+        unsigned thread_count = 0; // 0 means one per hardware thread
+        uint64_t seed = 1; // for the starting vectors and the first list centers
+    };
+
+    EmbeddingIndex();
+
+    // Learns vectors for every movie in the catalog from the histories of every user
+    void train(const UserDatabase& user_database, const MovieDatabase& movie_database, const TrainingOptions& options);
+
+    // Writes the index to a binary file, or reads one written earlier. load() rejects a file that
+    // is truncated or inconsistent; compare get_fingerprint() with the catalog's before using it.
+    bool save(const std::string& filename) const;
+    bool load(const std::string& filename);
+
+    int get_movie_count() const;
+    uint64_t get_fingerprint() const; // MovieDatabase::get_fingerprint() of the catalog it was trained on
+    int get_dimensions() const;
+    int get_list_count() const;
+    size_t get_memory_bytes() const;
+
+    // Queries score the probe_count lists nearest the user's vector; 0 (the default) or at
+    // least get_list_count() scores every movie. Not safe while other threads query.
+    void set_probe_count(int probe_count);
+    int get_probe_count() const;
+
+    // Sets user_vector to the vector of a user who watched the movies at these catalog indices
+    // (repeats count once). user_vector gets get_stride() floats, zero for an empty history.
+    void fold_in(std::span<const int> watched_movies, std::vector<float>& user_vector) const;
+    size_t get_stride() const;
+
+    // Replaces top with the movie_count best (movie index, score) pairs for the user vector,
+    // best first, leaving out the movies whose bit is set in excluded (bit m & 63 of word m >> 6)
+    void find_top_movies(const std::vector<float>& user_vector, size_t movie_count, std::span<const uint64_t> excluded,
+        std::vector<std::pair<uint32_t, float>>& top) const;
+
+private:
+    struct AlignedDelete
+    {
+        void operator()(float* data) const {
+            ::operator delete[](data, std::align_val_t(64));
+        }
+    };
+    typedef std::unique_ptr<float[], AlignedDelete> AlignedFloats;
+    static AlignedFloats allocate(size_t count); // zeroed
+
+    void build_lists(const TrainingOptions& options, const AlignedFloats& vectors);
+    void scan_rows(uint32_t first_row, uint32_t end_row, const float* query, size_t movie_count,
+        std::span<const uint64_t> excluded, std::vector<std::pair<uint32_t, float>>& top) const;
+
+    int m_movie_count;
+    int m_dimensions;
+    size_t m_stride; // floats per row
+    float m_alpha;
+    float m_regularization;
+    int m_probe_count;
+    AlignedFloats m_rows; // the movie vectors, row r is movie m_row_movies[r], grouped by list
+    std::vector<uint32_t> m_row_movies;
+    std::vector<uint32_t> m_movie_rows; // the row of every movie index
+    std::vector<uint32_t> m_list_starts; // list l is rows [m_list_starts[l], m_list_starts[l + 1])
+    AlignedFloats m_centers; // one row per list, of unit length
+    std::vector<double> m_gram; // sum of v * v^T over the movie vectors, dimensions x dimensions, for fold_in
+    uint64_t m_fingerprint;
+};
+
+#endif // EMBEDDINGINDEX_INCLUDED
@@ -0,0 +1,72 @@
+#include "GenreAffinity.h"
+#include <span>
+#include <cstdint>
+#include <bit>
+#include <algorithm>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define GENRE_AFFINITY_AVX2
+#endif
+using namespace std;
+
+// Portable version: add up the weight of each genre bit that is set
+static void compute_genre_affinity_scalar(span<const uint64_t> genre_masks, span<const int> genre_weights, int* affinity) {
+    for (size_t m = 0; m < genre_masks.size(); m++) {
+        int sum = 0;
+        for (uint64_t mask = genre_masks[m]; mask != 0; mask &= mask - 1) {
+            sum += genre_weights[countr_zero(mask)];
+        }
+        affinity[m] = sum;
+    }
+}
+
+#ifdef GENRE_AFFINITY_AVX2
+// Four movies per step. Bit b of every weight forms the plane mask planes[b], so a movie's
+// affinity is the sum over b of popcount(mask & planes[b]) << b, evaluated from the highest
+// plane down as acc = 2 * acc + popcount. AVX2 has no 64-bit popcount, so bytes are counted
+// with a nibble lookup table and summed per lane with a sum of absolute differences.
+__attribute__((target("avx2")))
+static void compute_genre_affinity_avx2(span<const uint64_t> genre_masks, span<const int> genre_weights, int* affinity) {
+    uint64_t planes[32] = {};
+    int plane_count = 0;
+    for (int g = 0; g < genre_weights.size(); g++) {
+        for (int b = 0; b < 31; b++) {
+            if ((genre_weights[g] >> b) & 1) {
+                planes[b] |= uint64_t(1) << g;
+                plane_count = max(plane_count, b + 1);
+            }
+        }
+    }
+
+    const __m256i nibble_counts = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    const __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0); // the low 32 bits of each 64-bit lane
+
+    size_t m = 0;
+    for (; m + 4 <= genre_masks.size(); m += 4) {
+        __m256i masks = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(genre_masks.data() + m));
+        __m256i acc = _mm256_setzero_si256();
+        for (int b = plane_count - 1; b >= 0; b--) {
+            __m256i bits = _mm256_and_si256(masks, _mm256_set1_epi64x(int64_t(planes[b])));
+            __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(bits, low_nibbles)),
+                _mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(_mm256_srli_epi16(bits, 4), low_nibbles)));
+            acc = _mm256_add_epi64(_mm256_slli_epi64(acc, 1), _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+        }
+        __m128i packed = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(acc, low_halves));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(affinity + m), packed);
+    }
+    compute_genre_affinity_scalar(genre_masks.subspan(m), genre_weights, affinity + m);
+}
+#endif
+
+void compute_genre_affinity(span<const uint64_t> genre_masks, span<const int> genre_weights, int* affinity) {
+#ifdef GENRE_AFFINITY_AVX2
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) {
+        compute_genre_affinity_avx2(genre_masks, genre_weights, affinity);
+        return;
+    }
+#endif
+    compute_genre_affinity_scalar(genre_masks, genre_weights, affinity);
+}
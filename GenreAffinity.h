@@ -0,0 +1,17 @@
+#ifndef GENREAFFINITY_INCLUDED
+#define GENREAFFINITY_INCLUDED
+
+#include <span>
+#include <cstdint>
+
+// Largest number of distinct genres the bitmask column can hold
+const int MAX_MASK_GENRES = 64;
+
+// Sets affinity[m] to the sum of genre_weights[g] over the genres g set in genre_masks[m], for
+// every movie m. With genre_weights[g] the number of times genre g appears in a user's watched
+// movies, that is exactly the genre points the posting lists would give the movie.
+// genre_weights has at most MAX_MASK_GENRES non-negative entries. Uses AVX2 when the CPU has it:
+// the weights are split into bit planes and each plane is applied with an AND and a popcount.
+void compute_genre_affinity(std::span<const uint64_t> genre_masks, std::span<const int> genre_weights, int* affinity);
+
+#endif // GENREAFFINITY_INCLUDED
@@ -0,0 +1,296 @@
+#include "Json.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+using namespace std;
+
+// Position of the parser in the text being parsed
+struct JsonCursor
+{
+    string_view text;
+    size_t position = 0;
+
+    void skip_spaces() {
+        while (position < text.size() && (text[position] == ' ' || text[position] == '\t' || text[position] == '\r' || text[position] == '\n')) {
+            position++;
+        }
+    }
+
+    // Skips spaces and consumes c if it comes next
+    bool consume(char c) {
+        skip_spaces();
+        if (position < text.size() && text[position] == c) {
+            position++;
+            return true;
+        }
+        return false;
+    }
+
+    bool consume_word(string_view word) {
+        if (text.substr(position, word.size()) == word) {
+            position += word.size();
+            return true;
+        }
+        return false;
+    }
+};
+
+static void append_utf8(string& out, uint32_t code_point) {
+    if (code_point < 0x80) {
+        out += char(code_point);
+    }
+    else if (code_point < 0x800) {
+        out += char(0xC0 | (code_point >> 6));
+        out += char(0x80 | (code_point & 0x3F));
+    }
+    else if (code_point < 0x10000) {
+        out += char(0xE0 | (code_point >> 12));
+        out += char(0x80 | ((code_point >> 6) & 0x3F));
+        out += char(0x80 | (code_point & 0x3F));
+    }
+    else {
+        out += char(0xF0 | (code_point >> 18));
+        out += char(0x80 | ((code_point >> 12) & 0x3F));
+        out += char(0x80 | ((code_point >> 6) & 0x3F));
+        out += char(0x80 | (code_point & 0x3F));
+    }
+}
+
+// Reads the four hex digits of a \u escape
+static bool parse_hex4(JsonCursor& cursor, uint32_t& value) {
+    if (cursor.position + 4 > cursor.text.size()) {
+        return false;
+    }
+    const char* first = cursor.text.data() + cursor.position;
+    from_chars_result result = from_chars(first, first + 4, value, 16);
+    if (result.ptr != first + 4) {
+        return false;
+    }
+    cursor.position += 4;
+    return true;
+}
+
+// Parses a string whose opening quote has already been consumed
+static bool parse_string(JsonCursor& cursor, string& out, string& error) {
+    out.clear();
+    while (cursor.position < cursor.text.size()) {
+        char c = cursor.text[cursor.position++];
+        if (c == '"') {
+            return true;
+        }
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+        if (cursor.position == cursor.text.size()) {
+            break;
+        }
+        char escape = cursor.text[cursor.position++];
+        switch (escape) {
+        case '"': out += '"'; break;
+        case '\\': out += '\\'; break;
+        case '/': out += '/'; break;
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u': {
+            uint32_t code_point;
+            if (!parse_hex4(cursor, code_point)) {
+                error = "bad \\u escape";
+                return false;
+            }
+            // A high surrogate is followed by the low one of the pair
+            uint32_t low;
+            size_t pair_start = cursor.position;
+            if (code_point >= 0xD800 && code_point < 0xDC00 && cursor.consume_word("\\u") && parse_hex4(cursor, low)
+                && low >= 0xDC00 && low < 0xE000) {
+                code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+            }
+            else {
+                cursor.position = pair_start;
+            }
+            append_utf8(out, code_point);
+            break;
+        }
+        default:
+            error = "bad escape in string";
+            return false;
+        }
+    }
+    error = "unterminated string";
+    return false;
+}
+
+bool JsonObject::parse(string_view text, string& error) {
+    m_members.clear();
+    error.clear();
+    JsonCursor cursor{ text };
+    if (!cursor.consume('{')) {
+        error = "expected an object";
+        return false;
+    }
+
+    bool first = true;
+    while (!cursor.consume('}')) {
+        if (!first && !cursor.consume(',')) {
+            error = "expected , or }";
+            return false;
+        }
+        first = false;
+
+        Member member;
+        if (!cursor.consume('"') || !parse_string(cursor, member.key, error)) {
+            error = error.empty() ? "expected a member name" : error;
+            return false;
+        }
+        if (!cursor.consume(':')) {
+            error = "expected :";
+            return false;
+        }
+
+        cursor.skip_spaces();
+        size_t value_start = cursor.position;
+        if (cursor.consume('"')) {
+            member.type = STRING;
+            if (!parse_string(cursor, member.text, error)) {
+                return false;
+            }
+        }
+        else if (cursor.consume('[')) {
+            member.type = STRING_ARRAY;
+            bool first_element = true;
+            while (!cursor.consume(']')) {
+                if (!first_element && !cursor.consume(',')) {
+                    error = "expected , or ]";
+                    return false;
+                }
+                first_element = false;
+                member.strings.emplace_back();
+                if (!cursor.consume('"')) {
+                    error = "only arrays of strings are supported";
+                    return false;
+                }
+                if (!parse_string(cursor, member.strings.back(), error)) {
+                    return false;
+                }
+            }
+        }
+        else if (cursor.consume_word("true") || cursor.consume_word("false")) {
+            member.type = BOOLEAN;
+        }
+        else if (cursor.consume_word("null")) {
+            member.type = NULL_VALUE;
+        }
+        else if (cursor.position < text.size() && text[cursor.position] == '{') {
+            error = "nested objects are not supported";
+            return false;
+        }
+        else {
+            member.type = NUMBER;
+            // from_chars also reads nan, inf and infinity, which JSON does not have and which
+            // pass every range check, so a number must start with a digit after its sign
+            const char* begin = text.data() + cursor.position;
+            const char* end = text.data() + text.size();
+            const char* digit = begin < end && *begin == '-' ? begin + 1 : begin;
+            from_chars_result result = from_chars(begin, end, member.number);
+            if (digit == end || *digit < '0' || *digit > '9'
+                || result.ec != errc() || result.ptr == begin || !isfinite(member.number)) {
+                error = "bad value for " + member.key;
+                return false;
+            }
+            cursor.position += size_t(result.ptr - begin);
+        }
+        member.raw = string(text.substr(value_start, cursor.position - value_start));
+        m_members.push_back(move(member));
+    }
+
+    cursor.skip_spaces();
+    if (cursor.position != text.size()) {
+        error = "unexpected text after the object";
+        return false;
+    }
+    return true;
+}
+
+const JsonObject::Member* JsonObject::find(string_view key) const {
+    for (const Member& member : m_members) {
+        if (member.key == key) {
+            return &member;
+        }
+    }
+    return nullptr;
+}
+
+bool JsonObject::has(string_view key) const {
+    return find(key) != nullptr;
+}
+
+const string* JsonObject::get_string(string_view key) const {
+    const Member* member = find(key);
+    return member != nullptr && member->type == STRING ? &member->text : nullptr;
+}
+
+const vector<string>* JsonObject::get_string_array(string_view key) const {
+    const Member* member = find(key);
+    return member != nullptr && member->type == STRING_ARRAY ? &member->strings : nullptr;
+}
+
+bool JsonObject::get_number(string_view key, double& value) const {
+    const Member* member = find(key);
+    if (member == nullptr || member->type != NUMBER) {
+        return false;
+    }
+    value = member->number;
+    return true;
+}
+
+string_view JsonObject::get_raw(string_view key) const {
+    const Member* member = find(key);
+    return member != nullptr ? string_view(member->raw) : string_view();
+}
+
+void append_json_string(string& out, string_view text) {
+    out += '"';
+    for (char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", unsigned(c));
+                out += escaped;
+            }
+            else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+void begin_json_response(const JsonObject& request, string& response) {
+    response += '{';
+    string_view id = request.get_raw("id");
+    if (!id.empty()) {
+        response += "\"id\":";
+        response += id;
+        response += ',';
+    }
+}
+
+void append_json_error(const JsonObject& request, string_view message, string& response) {
+    begin_json_response(request, response);
+    response += "\"ok\":false,\"error\":";
+    append_json_string(response, message);
+    response += "}\n";
+}
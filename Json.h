@@ -0,0 +1,52 @@
+#ifndef JSON_INCLUDED
+#define JSON_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Just enough JSON for the line-delimited requests of the serving mode: one flat object whose
+// members are strings, numbers, booleans, null or arrays of strings. Nested objects and arrays
+// of anything but strings are rejected.
+class JsonObject
+{
+public:
+    // Parses text, replacing the members; on failure returns false and describes why in error
+    bool parse(std::string_view text, std::string& error);
+
+    bool has(std::string_view key) const;
+    // nullptr if the member is missing or not of that type
+    const std::string* get_string(std::string_view key) const;
+    const std::vector<std::string>* get_string_array(std::string_view key) const;
+    // false if the member is missing or not a number
+    bool get_number(std::string_view key, double& value) const;
+    // The member's value exactly as it appeared in the text, or empty if it is missing
+    std::string_view get_raw(std::string_view key) const;
+
+private:
+    enum Type { STRING, NUMBER, BOOLEAN, NULL_VALUE, STRING_ARRAY };
+
+    struct Member
+    {
+        std::string key;
+        Type type;
+        std::string text; // the decoded string, for STRING
+        double number = 0;
+        std::vector<std::string> strings; // for STRING_ARRAY
+        std::string raw;
+    };
+
+    const Member* find(std::string_view key) const;
+
+    std::vector<Member> m_members;
+};
+
+// Appends text to out as a quoted JSON string, escaping what JSON requires
+void append_json_string(std::string& out, std::string_view text);
+
+// Starts a response object to request, echoing the request's "id" if it has one, or appends a
+// whole {"ok":false,"error":message} response line
+void begin_json_response(const JsonObject& request, std::string& response);
+void append_json_error(const JsonObject& request, std::string_view message, std::string& response);
+
+#endif // JSON_INCLUDED
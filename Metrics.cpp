@@ -0,0 +1,198 @@
+#include "Metrics.h"
+#include <string>
+#include <vector>
+#include <ostream>
+#include <fstream>
+#include <atomic>
+#include <bit>
+#include <mutex>
+#include <cstdio>
+using namespace std;
+
+Histogram::Histogram() : m_count(0), m_sum(0), m_max(0) {
+    for (int b = 0; b < BUCKET_COUNT; b++) {
+        m_buckets[b].store(0, memory_order_relaxed);
+    }
+}
+
+// Values below SUB_BUCKET_COUNT get a bucket each; a larger value with its highest set bit at
+// position p lands in one of the SUB_BUCKET_COUNT buckets of [2^p, 2^(p + 1))
+int Histogram::bucket_of(uint64_t value) {
+    if (value < SUB_BUCKET_COUNT) {
+        return int(value);
+    }
+    int shift = bit_width(value) - 1 - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKET_COUNT + int(value >> shift) - SUB_BUCKET_COUNT;
+}
+
+// Largest value that falls in the bucket
+uint64_t Histogram::bucket_upper_bound(int bucket) {
+    if (bucket < SUB_BUCKET_COUNT) {
+        return uint64_t(bucket);
+    }
+    int shift = bucket / SUB_BUCKET_COUNT - 1;
+    uint64_t lower = uint64_t(SUB_BUCKET_COUNT + bucket % SUB_BUCKET_COUNT) << shift;
+    return lower + ((uint64_t(1) << shift) - 1);
+}
+
+void Histogram::record(uint64_t value) {
+    m_buckets[bucket_of(value)].fetch_add(1, memory_order_relaxed);
+    m_count.fetch_add(1, memory_order_relaxed);
+    m_sum.fetch_add(value, memory_order_relaxed);
+
+    uint64_t seen = m_max.load(memory_order_relaxed);
+    while (value > seen && !m_max.compare_exchange_weak(seen, value, memory_order_relaxed)) {
+    }
+}
+
+uint64_t Histogram::get_count() const {
+    return m_count.load(memory_order_relaxed);
+}
+
+uint64_t Histogram::get_sum() const {
+    return m_sum.load(memory_order_relaxed);
+}
+
+uint64_t Histogram::get_max() const {
+    return m_max.load(memory_order_relaxed);
+}
+
+uint64_t Histogram::get_value_at_quantile(double quantile) const {
+    uint64_t count = get_count();
+    if (count == 0) {
+        return 0;
+    }
+
+    // The rank of the wanted value, counting from 1
+    uint64_t rank = uint64_t(quantile * count + 0.5);
+    rank = rank < 1 ? 1 : (rank > count ? count : rank);
+
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKET_COUNT; b++) {
+        seen += m_buckets[b].load(memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t bound = bucket_upper_bound(b);
+            return bound < get_max() ? bound : get_max(); // the top bucket is never reported above the max
+        }
+    }
+    return get_max();
+}
+
+Metrics::Metrics() : requests(0), unknown_users(0), history_misses(0), cache_hits(0), cache_misses(0), bad_requests(0), catalog_reloads(0) {
+    for (int p = 0; p < POSTINGS_COUNT; p++) {
+        postings_touched[p].store(0, memory_order_relaxed);
+    }
+}
+
+void Metrics::set_load_timings(const string& database, const LoadTimings& timings) {
+    scoped_lock lock(m_load_mutex);
+    for (int d = 0; d < m_load_timings.size(); d++) {
+        if (m_load_timings[d].first == database) {
+            m_load_timings[d].second = timings;
+            return;
+        }
+    }
+    m_load_timings.emplace_back(database, timings);
+}
+
+static const char* const STAGE_NAMES[Metrics::STAGE_COUNT] = { "resolve_history", "build_filter", "neighbor_fanout", "director_fanout",
+    "actor_fanout", "genre_fanout", "filter_watched", "rank" };
+static const char* const POSTINGS_NAMES[Metrics::POSTINGS_COUNT] = { "neighbor", "director", "actor", "genre" };
+static const char* const SERVED_OP_NAMES[Metrics::SERVED_OP_COUNT] = { "user", "lookup", "search", "recommend" };
+static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// Writes the quantile, sum and count lines of a summary; labels is either empty or ends in a comma
+// scale converts the recorded values to the exported unit (e.g. nanoseconds to seconds)
+static void write_summary(ostream& out, const string& name, const string& labels, const Histogram& histogram, double scale) {
+    for (double quantile : QUANTILES) {
+        out << name << "{" << labels << "quantile=\"" << quantile << "\"} " << histogram.get_value_at_quantile(quantile) * scale << "\n";
+    }
+    string plain_labels = labels.empty() ? "" : "{" + labels.substr(0, labels.size() - 1) + "}";
+    out << name << "_sum" << plain_labels << " " << histogram.get_sum() * scale << "\n";
+    out << name << "_count" << plain_labels << " " << histogram.get_count() << "\n";
+}
+
+void Metrics::write_prometheus(ostream& out) const {
+    out << "# HELP recommender_stage_seconds Time spent in each stage of a recommendation.\n";
+    out << "# TYPE recommender_stage_seconds summary\n";
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        write_summary(out, "recommender_stage_seconds", string("stage=\"") + STAGE_NAMES[s] + "\",", stage_latency[s], 1e-9);
+    }
+
+    out << "# HELP recommender_query_seconds Time spent ranking movies for one user, all stages.\n";
+    out << "# TYPE recommender_query_seconds summary\n";
+    write_summary(out, "recommender_query_seconds", "", query_latency, 1e-9);
+
+    out << "# HELP recommender_candidates Movies that got any points in one recommendation.\n";
+    out << "# TYPE recommender_candidates summary\n";
+    write_summary(out, "recommender_candidates", "", candidate_count, 1);
+
+    out << "# HELP recommender_requests_total Recommendation requests, including unknown users.\n";
+    out << "# TYPE recommender_requests_total counter\n";
+    out << "recommender_requests_total " << requests.load(memory_order_relaxed) << "\n";
+    out << "# HELP recommender_unknown_users_total Requests for an email that is not in the user database.\n";
+    out << "# TYPE recommender_unknown_users_total counter\n";
+    out << "recommender_unknown_users_total " << unknown_users.load(memory_order_relaxed) << "\n";
+    out << "# HELP recommender_history_misses_total Watched movie IDs that are not in the movie database.\n";
+    out << "# TYPE recommender_history_misses_total counter\n";
+    out << "recommender_history_misses_total " << history_misses.load(memory_order_relaxed) << "\n";
+    out << "# HELP recommender_cache_hits_total Requests answered from the result cache.\n";
+    out << "# TYPE recommender_cache_hits_total counter\n";
+    out << "recommender_cache_hits_total " << cache_hits.load(memory_order_relaxed) << "\n";
+    out << "# HELP recommender_cache_misses_total Requests the result cache could not answer.\n";
+    out << "# TYPE recommender_cache_misses_total counter\n";
+    out << "recommender_cache_misses_total " << cache_misses.load(memory_order_relaxed) << "\n";
+
+    out << "# HELP recommender_postings_touched_total Index entries walked while adding up scores.\n";
+    out << "# TYPE recommender_postings_touched_total counter\n";
+    for (int p = 0; p < POSTINGS_COUNT; p++) {
+        out << "recommender_postings_touched_total{index=\"" << POSTINGS_NAMES[p] << "\"} " << postings_touched[p].load(memory_order_relaxed) << "\n";
+    }
+
+    out << "# HELP recommender_served_request_seconds Time spent answering one request of the serving mode.\n";
+    out << "# TYPE recommender_served_request_seconds summary\n";
+    for (int o = 0; o < SERVED_OP_COUNT; o++) {
+        write_summary(out, "recommender_served_request_seconds", string("op=\"") + SERVED_OP_NAMES[o] + "\",", served_latency[o], 1e-9);
+    }
+    out << "# HELP recommender_bad_requests_total Requests of the serving mode that were malformed or of an unknown op.\n";
+    out << "# TYPE recommender_bad_requests_total counter\n";
+    out << "recommender_bad_requests_total " << bad_requests.load(memory_order_relaxed) << "\n";
+    out << "# HELP recommender_catalog_reloads_total Times the data files were reloaded and published while running.\n";
+    out << "# TYPE recommender_catalog_reloads_total counter\n";
+    out << "recommender_catalog_reloads_total " << catalog_reloads.load(memory_order_relaxed) << "\n";
+
+    scoped_lock lock(m_load_mutex);
+    out << "# HELP recommender_load_phase_seconds Time spent in each phase of loading a database.\n";
+    out << "# TYPE recommender_load_phase_seconds gauge\n";
+    for (const pair<string, LoadTimings>& load : m_load_timings) {
+        const uint64_t phases[4] = { load.second.map_ns, load.second.parse_ns, load.second.build_ns, load.second.index_ns };
+        const char* const phase_names[4] = { "map", "parse", "build", "index" };
+        for (int p = 0; p < 4; p++) {
+            out << "recommender_load_phase_seconds{database=\"" << load.first << "\",phase=\"" << phase_names[p] << "\"} " << phases[p] * 1e-9 << "\n";
+        }
+    }
+    out << "# HELP recommender_load_slowest_index_seconds Longest single index build of the index phase, when indices are built in parallel.\n";
+    out << "# TYPE recommender_load_slowest_index_seconds gauge\n";
+    for (const pair<string, LoadTimings>& load : m_load_timings) {
+        if (load.second.slowest_index_ns == 0) {
+            continue; // its indices were built one after another
+        }
+        out << "recommender_load_slowest_index_seconds{database=\"" << load.first << "\"} " << load.second.slowest_index_ns * 1e-9 << "\n";
+    }
+}
+
+bool Metrics::write_prometheus(const string& filename) const {
+    // Write to a temporary file and rename it, so a scraper never sees a half written file
+    string temporary = filename + ".tmp";
+    {
+        ofstream out(temporary);
+        if (!out) {
+            return false;
+        }
+        write_prometheus(out);
+        if (!out) {
+            return false;
+        }
+    }
+    return rename(temporary.c_str(), filename.c_str()) == 0;
+}
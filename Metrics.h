@@ -0,0 +1,83 @@
+#ifndef METRICS_INCLUDED
+#define METRICS_INCLUDED
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include "TextLoader.h"
+
+// A histogram of non-negative integers (usually nanoseconds) in the style of HdrHistogram:
+// values below 2^SUB_BUCKET_BITS are counted exactly, and every larger power of two is split
+// into 2^SUB_BUCKET_BITS equal buckets, so any recorded value is known to within about 3%.
+// record() is a few relaxed atomic adds, so one histogram can be shared by many threads.
+class Histogram
+{
+public:
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const int BUCKET_COUNT = SUB_BUCKET_COUNT * (64 - SUB_BUCKET_BITS + 1);
+
+    Histogram();
+    void record(uint64_t value);
+
+    uint64_t get_count() const;
+    uint64_t get_sum() const;
+    uint64_t get_max() const;
+    // The smallest bucket bound that at least quantile (0 to 1) of the values are at or below
+    uint64_t get_value_at_quantile(double quantile) const;
+
+private:
+    static int bucket_of(uint64_t value);
+    static uint64_t bucket_upper_bound(int bucket);
+
+    std::atomic<uint64_t> m_buckets[BUCKET_COUNT];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+};
+
+// Latency and work counters for the recommendation path plus the load timings of both
+// databases, written out in the Prometheus text exposition format. A Recommender records
+// into it once set_metrics() has been called; see Recommender::rank_movies for the stages.
+class Metrics
+{
+public:
+    // Stages of one recommendation, in the order they run; the director, actor and genre
+    // stages and postings are in MovieDatabase::Attribute order. BUILD_FILTER only runs for
+    // filtered recommendations.
+    enum Stage { RESOLVE_HISTORY, BUILD_FILTER, NEIGHBOR_FANOUT, DIRECTOR_FANOUT, ACTOR_FANOUT, GENRE_FANOUT, FILTER_WATCHED, RANK, STAGE_COUNT };
+    // Index structures whose entries the fan-out stages walk
+    enum Postings { NEIGHBOR_POSTINGS, DIRECTOR_POSTINGS, ACTOR_POSTINGS, GENRE_POSTINGS, POSTINGS_COUNT };
+    // Kinds of request a Server answers
+    enum ServedOp { SERVED_USER, SERVED_LOOKUP, SERVED_SEARCH, SERVED_RECOMMEND, SERVED_OP_COUNT };
+
+    Metrics();
+
+    Histogram stage_latency[STAGE_COUNT]; // nanoseconds per query
+    Histogram query_latency; // nanoseconds per query, all stages
+    Histogram candidate_count; // movies that got any points, per query
+    std::atomic<uint64_t> requests; // recommend calls, including the ones for unknown users
+    std::atomic<uint64_t> unknown_users;
+    std::atomic<uint64_t> history_misses; // watched movie IDs that are not in the movie database
+    std::atomic<uint64_t> postings_touched[POSTINGS_COUNT]; // entries walked by the fan-out stages
+    std::atomic<uint64_t> cache_hits; // requests answered from the Recommender's result cache
+    std::atomic<uint64_t> cache_misses;
+    Histogram served_latency[SERVED_OP_COUNT]; // nanoseconds to answer one Server request, by kind
+    std::atomic<uint64_t> bad_requests; // Server requests that could not be parsed or had an unknown op
+    std::atomic<uint64_t> catalog_reloads; // catalog generations published after the first
+
+    // Records how long each phase of loading a database took, under the given name
+    void set_load_timings(const std::string& database, const LoadTimings& timings);
+
+    void write_prometheus(std::ostream& out) const;
+    bool write_prometheus(const std::string& filename) const; // false if the file cannot be written
+
+private:
+    mutable std::mutex m_load_mutex; // guards m_load_timings
+    std::vector<std::pair<std::string, LoadTimings>> m_load_timings;
+};
+
+#endif // METRICS_INCLUDED
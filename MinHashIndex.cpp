@@ -0,0 +1,208 @@
+#include "MinHashIndex.h"
+#include "UserDatabase.h"
+#include "User.h"
+#include "ThreadPool.h"
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include <climits>
+using namespace std;
+
+// The hash functions are drawn from this seed, so every build gives the same signatures
+static const uint64_t HASH_SEED = 0x4d696e48617368ull;
+
+// Users whose signatures are computed by one parallel_for task
+static const size_t USERS_PER_TASK = 256;
+
+// The band bucket of a user with nothing to sign
+static const uint32_t NO_BUCKET = UINT32_MAX;
+
+// splitmix64: steps state and returns a well mixed 64-bit number
+static uint64_t next_random(uint64_t& state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// The splitmix64 finalizer, so neighboring movie numbers hash far apart
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Per-thread working memory for find_similar_users
+struct MinHashQueryScratch
+{
+    vector<uint32_t> signature;
+    vector<uint32_t> seen; // seen[u] == query if user u is already a candidate of this query
+    uint32_t query = 0;
+    vector<pair<uint32_t, uint32_t>> candidates; // (agreeing signature positions, user index)
+};
+
+MinHashIndex::MinHashIndex()
+    : m_user_database(nullptr), m_band_count(0), m_rows_per_band(0), m_bucket_mask(0) {}
+
+void MinHashIndex::build(const UserDatabase& user_database, int band_count, int rows_per_band, unsigned thread_count) {
+    m_user_database = &user_database;
+    m_band_count = max(band_count, 1);
+    m_rows_per_band = max(rows_per_band, 1);
+    size_t hash_count = size_t(m_band_count) * m_rows_per_band;
+
+    // Multiply-add hash functions of a mixed movie number, taking the high half; odd
+    // multipliers so no two movies collide in all of them
+    uint64_t state = HASH_SEED;
+    m_multipliers.resize(hash_count);
+    m_offsets.resize(hash_count);
+    for (size_t h = 0; h < hash_count; h++) {
+        m_multipliers[h] = next_random(state) | 1;
+        m_offsets[h] = next_random(state);
+    }
+
+    size_t user_count = size_t(user_database.get_user_count());
+    uint32_t bucket_count = 1;
+    while (bucket_count < user_count) {
+        bucket_count <<= 1;
+    }
+    m_bucket_mask = bucket_count - 1;
+
+    // Sign every user and find its bucket in every band, one block of users per task
+    m_signatures.assign(user_count * hash_count, 0);
+    vector<uint32_t> buckets(user_count * m_band_count);
+    ThreadPool pool(thread_count);
+    pool.parallel_for((user_count + USERS_PER_TASK - 1) / USERS_PER_TASK, [&](size_t task, unsigned) {
+        size_t end = min(user_count, (task + 1) * USERS_PER_TASK);
+        for (size_t u = task * USERS_PER_TASK; u < end; u++) {
+            const User& user = *user_database.get_user_at(int(u));
+            uint32_t* signature = &m_signatures[u * hash_count];
+            compute_signature(user, signature);
+            bool empty = user.get_watch_history_view().empty();
+            for (int b = 0; b < m_band_count; b++) {
+                buckets[u * m_band_count + b] = empty ? NO_BUCKET : bucket_of(signature, b);
+            }
+        }
+    });
+
+    // Counting sort of the users into the buckets of every band, in user order within a bucket
+    m_bucket_starts.assign(size_t(m_band_count) * bucket_count + 1, 0);
+    for (size_t u = 0; u < user_count; u++) {
+        for (int b = 0; b < m_band_count; b++) {
+            uint32_t bucket = buckets[u * m_band_count + b];
+            if (bucket != NO_BUCKET) {
+                m_bucket_starts[size_t(b) * bucket_count + bucket + 1]++;
+            }
+        }
+    }
+    for (size_t i = 1; i < m_bucket_starts.size(); i++) {
+        m_bucket_starts[i] += m_bucket_starts[i - 1];
+    }
+    m_bucket_users.resize(m_bucket_starts.back());
+    vector<uint32_t> next(m_bucket_starts.begin(), m_bucket_starts.end() - 1);
+    for (size_t u = 0; u < user_count; u++) {
+        for (int b = 0; b < m_band_count; b++) {
+            uint32_t bucket = buckets[u * m_band_count + b];
+            if (bucket != NO_BUCKET) {
+                m_bucket_users[next[size_t(b) * bucket_count + bucket]++] = uint32_t(u);
+            }
+        }
+    }
+}
+
+int MinHashIndex::get_user_count() const {
+    size_t hash_count = size_t(m_band_count) * m_rows_per_band;
+    return hash_count > 0 ? int(m_signatures.size() / hash_count) : 0;
+}
+
+int MinHashIndex::get_band_count() const {
+    return m_band_count;
+}
+
+int MinHashIndex::get_rows_per_band() const {
+    return m_rows_per_band;
+}
+
+size_t MinHashIndex::get_memory_bytes() const {
+    return (m_signatures.size() + m_bucket_starts.size() + m_bucket_users.size()) * sizeof(uint32_t)
+        + (m_multipliers.size() + m_offsets.size()) * sizeof(uint64_t);
+}
+
+// Fills signature with the smallest value of every hash function over the watched movies;
+// all ones for an empty history
+void MinHashIndex::compute_signature(const User& user, uint32_t* signature) const {
+    size_t hash_count = m_multipliers.size();
+    fill(signature, signature + hash_count, UINT32_MAX);
+    for (uint32_t number : user.get_watch_history_view()) {
+        uint64_t x = mix(number);
+        for (size_t h = 0; h < hash_count; h++) {
+            signature[h] = min(signature[h], uint32_t((x * m_multipliers[h] + m_offsets[h]) >> 32));
+        }
+    }
+}
+
+// FNV-1a over the band's rows, folded into the bucket range
+uint32_t MinHashIndex::bucket_of(const uint32_t* signature, int band) const {
+    uint64_t hash = 14695981039346656037ull;
+    for (int r = 0; r < m_rows_per_band; r++) {
+        hash = (hash ^ signature[band * m_rows_per_band + r]) * 1099511628211ull;
+    }
+    return uint32_t(mix(hash)) & m_bucket_mask;
+}
+
+void MinHashIndex::find_similar_users(const User& user, size_t max_neighbors, vector<SimilarUser>& similar) const {
+    similar.clear();
+    size_t hash_count = m_multipliers.size();
+    size_t user_count = size_t(get_user_count());
+    if (user_count == 0 || max_neighbors == 0 || user.get_watch_history_view().empty()) {
+        return;
+    }
+
+    static thread_local MinHashQueryScratch scratch;
+    scratch.signature.resize(hash_count);
+    compute_signature(user, scratch.signature.data());
+    if (scratch.seen.size() < user_count) {
+        scratch.seen.resize(user_count, 0);
+    }
+    if (++scratch.query == 0) {
+        // The query numbers wrapped around, so old marks could pass for this query's
+        fill(scratch.seen.begin(), scratch.seen.end(), 0);
+        scratch.query = 1;
+    }
+
+    // Gather the users sharing a bucket with the user in any band, comparing each one once
+    scratch.candidates.clear();
+    size_t bucket_count = size_t(m_bucket_mask) + 1;
+    for (int b = 0; b < m_band_count && scratch.candidates.size() < MAX_CANDIDATES; b++) {
+        size_t bucket = size_t(b) * bucket_count + bucket_of(scratch.signature.data(), b);
+        for (uint32_t p = m_bucket_starts[bucket]; p < m_bucket_starts[bucket + 1] && scratch.candidates.size() < MAX_CANDIDATES; p++) {
+            uint32_t u = m_bucket_users[p];
+            if (scratch.seen[u] == scratch.query) {
+                continue;
+            }
+            scratch.seen[u] = scratch.query;
+            if (m_user_database->get_user_at(int(u)) == &user) {
+                continue;
+            }
+            const uint32_t* signature = &m_signatures[u * hash_count];
+            uint32_t agreeing = 0;
+            for (size_t h = 0; h < hash_count; h++) {
+                agreeing += signature[h] == scratch.signature[h];
+            }
+            if (agreeing > 0) { // not just a bucket collision
+                scratch.candidates.emplace_back(agreeing, u);
+            }
+        }
+    }
+
+    // Most agreeing positions first, then in user order so the result does not depend on the bands
+    size_t keep = min(max_neighbors, scratch.candidates.size());
+    partial_sort(scratch.candidates.begin(), scratch.candidates.begin() + keep, scratch.candidates.end(),
+        [](const pair<uint32_t, uint32_t>& a, const pair<uint32_t, uint32_t>& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+    for (size_t c = 0; c < keep; c++) {
+        similar.push_back(SimilarUser{ m_user_database->get_user_at(int(scratch.candidates[c].second)),
+            float(scratch.candidates[c].first) / float(hash_count) });
+    }
+}
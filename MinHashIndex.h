@@ -0,0 +1,67 @@
+#ifndef MINHASHINDEX_INCLUDED
+#define MINHASHINDEX_INCLUDED
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class UserDatabase;
+class User;
+
+// Finds users whose watch histories overlap, without comparing against every user.
+// Each user's set of watched movie ID numbers gets a MinHash signature: for each of
+// band_count * rows_per_band hash functions, the smallest hash of any movie in the set. Two
+// signatures agree in a given position with probability equal to the Jaccard similarity of the
+// two sets (shared movies over movies in either). The signature is cut into bands of
+// rows_per_band positions, and users whose band hashes to the same bucket become candidates,
+// so users with similarity s are found with probability 1 - (1 - s^rows)^bands: more rows per
+// band find fewer, closer users, more bands find more. Candidates are then ranked by how many
+// signature positions agree with the query's.
+class MinHashIndex
+{
+public:
+    // A user found by find_similar_users and the estimated Jaccard similarity of the histories
+    struct SimilarUser
+    {
+        User* user;
+        float similarity;
+    };
+
+    MinHashIndex();
+
+    // Builds the signatures and band buckets of every user in the database, on thread_count
+    // threads (0 means one per hardware thread). The database must outlive the index, and
+    // queries use its users' histories as they are when asked.
+    void build(const UserDatabase& user_database, int band_count, int rows_per_band, unsigned thread_count = 0);
+
+    int get_user_count() const;
+    int get_band_count() const;
+    int get_rows_per_band() const;
+    size_t get_memory_bytes() const; // taken by the signatures and the bucket tables
+
+    // Replaces similar with up to max_neighbors users that share a bucket with the user, most
+    // similar first, leaving out the user itself. At most MAX_CANDIDATES candidates are
+    // ranked, so the cost does not grow with the number of users. The user may be one the
+    // index was not built with, as long as its history numbers movies like the database does.
+    void find_similar_users(const User& user, size_t max_neighbors, std::vector<SimilarUser>& similar) const;
+
+    static const size_t MAX_CANDIDATES = 4096;
+
+private:
+    void compute_signature(const User& user, uint32_t* signature) const;
+    uint32_t bucket_of(const uint32_t* signature, int band) const;
+
+    const UserDatabase* m_user_database;
+    int m_band_count;
+    int m_rows_per_band;
+    uint32_t m_bucket_mask; // the bucket count of every band is a power of two
+    std::vector<uint64_t> m_multipliers; // hash function h is (mix(x) * m_multipliers[h] + m_offsets[h]) >> 32
+    std::vector<uint64_t> m_offsets;
+    std::vector<uint32_t> m_signatures; // user u's are [u * hash count, (u + 1) * hash count)
+    // The users in bucket k of band b are m_bucket_users[m_bucket_starts[i], m_bucket_starts[i + 1])
+    // with i = b * bucket count + k; users with an empty history are in no bucket
+    std::vector<uint32_t> m_bucket_starts;
+    std::vector<uint32_t> m_bucket_users;
+};
+
+#endif // MINHASHINDEX_INCLUDED
@@ -1,52 +1,106 @@
 #include "Movie.h"
+#include "MovieDatabase.h"
 #include <string>
 #include <vector>
+#include <string_view>
+#include <span>
+#include <memory>
 using namespace std;
 
 Movie::Movie(const string& id, const string& title, const string& release_year,
     const vector<string>& directors, const vector<string>& actors,
     const vector<string>& genres, float rating)
+    : m_database(nullptr), m_index(0), m_owned(new MovieDatabase)
 {
-    m_id = id;
-    m_title = title;
-    m_release_year = release_year;
-    m_rating = rating;
-    m_directors = directors;
-    m_actors = actors;
-    m_genres = genres;
+    // Store the movie the same way a database stores any other
+    vector<string_view> names[MovieDatabase::ATTRIBUTE_COUNT];
+    const vector<string>* lists[MovieDatabase::ATTRIBUTE_COUNT] = { &directors, &actors, &genres };
+    for (int a = 0; a < MovieDatabase::ATTRIBUTE_COUNT; a++) {
+        names[a].assign(lists[a]->begin(), lists[a]->end());
+    }
+    m_owned->add_movie(id, title, release_year, names[MovieDatabase::DIRECTOR], names[MovieDatabase::ACTOR],
+        names[MovieDatabase::GENRE], rating);
+    m_owned->freeze_indices();
+    m_database = m_owned.get();
 }
 
+Movie::Movie(const MovieDatabase* database, int index)
+    : m_database(database), m_index(index)
+{
+    // nothing
+}
+
+Movie::~Movie() {}
+
 string Movie::get_id() const
 {
-    return m_id;
+    return string(get_id_view());
 }
 
 string Movie::get_title() const
 {
-    return m_title;
+    return string(get_title_view());
 }
 
 string Movie::get_release_year() const
 {
-    return m_release_year;
+    return string(get_release_year_view());
 }
 
 float Movie::get_rating() const
 {
-    return m_rating;
+    return m_database->get_ratings()[m_index];
 }
 
 vector<string> Movie::get_directors() const
 {
-    return m_directors;
+    Names directors = get_directors_view();
+    return vector<string>(directors.begin(), directors.end());
 }
 
 vector<string> Movie::get_actors() const
 {
-    return m_actors;
+    Names actors = get_actors_view();
+    return vector<string>(actors.begin(), actors.end());
 }
 
 vector<string> Movie::get_genres() const
 {
-    return m_genres;
+    Names genres = get_genres_view();
+    return vector<string>(genres.begin(), genres.end());
+}
+
+string_view Movie::get_id_view() const
+{
+    return m_database->get_id_at(m_index);
+}
+
+string_view Movie::get_title_view() const
+{
+    return m_database->get_title_at(m_index);
+}
+
+string_view Movie::get_release_year_view() const
+{
+    return m_database->get_release_year_text_at(m_index);
+}
+
+Movie::Names Movie::get_directors_view() const
+{
+    return Names(m_database->get_attribute_ids(MovieDatabase::DIRECTOR, m_index), m_database->get_attribute_names(MovieDatabase::DIRECTOR));
+}
+
+Movie::Names Movie::get_actors_view() const
+{
+    return Names(m_database->get_attribute_ids(MovieDatabase::ACTOR, m_index), m_database->get_attribute_names(MovieDatabase::ACTOR));
+}
+
+Movie::Names Movie::get_genres_view() const
+{
+    return Names(m_database->get_attribute_ids(MovieDatabase::GENRE, m_index), m_database->get_attribute_names(MovieDatabase::GENRE));
+}
+
+int Movie::get_index() const
+{
+    return m_owned != nullptr ? -1 : m_index;
 }
\ No newline at end of file
@@ -3,15 +3,84 @@
 
 #include <string>
 #include <vector>
+#include <string_view>
+#include <span>
+#include <memory>
+#include <iterator>
+#include <cstdint>
+#include <cstddef>
 
+class MovieDatabase;
+
+// A movie of a MovieDatabase. The database stores the catalog as columns (see MovieDatabase.h);
+// a Movie holds only its database and its index and reads its fields from the columns.
 class Movie
 {
 public:
+    // The directors, actors or genres of a movie: interned ids and the names they stand for
+    class Names
+    {
+    public:
+        class iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = std::string_view;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const std::string_view*;
+            using reference = std::string_view;
+
+            iterator(const uint32_t* id, const std::string_view* names) : m_id(id), m_names(names) {}
+            std::string_view operator*() const {
+                return m_names[*m_id];
+            }
+            iterator& operator++() {
+                ++m_id;
+                return *this;
+            }
+            iterator operator++(int) {
+                iterator previous = *this;
+                ++m_id;
+                return previous;
+            }
+            bool operator==(const iterator& other) const {
+                return m_id == other.m_id;
+            }
+
+        private:
+            const uint32_t* m_id;
+            const std::string_view* m_names;
+        };
+
+        Names(std::span<const uint32_t> ids, std::span<const std::string_view> names) : m_ids(ids), m_names(names) {}
+        iterator begin() const {
+            return iterator(m_ids.data(), m_names.data());
+        }
+        iterator end() const {
+            return iterator(m_ids.data() + m_ids.size(), m_names.data());
+        }
+        size_t size() const {
+            return m_ids.size();
+        }
+        bool empty() const {
+            return m_ids.empty();
+        }
+        std::string_view operator[](size_t i) const {
+            return m_names[m_ids[i]];
+        }
+
+    private:
+        std::span<const uint32_t> m_ids;
+        std::span<const std::string_view> m_names;
+    };
+
+    // A movie on its own, which keeps a one-movie database of its own
     Movie(const std::string& id, const std::string& title,
         const std::string& release_year,
         const std::vector<std::string>& directors,
         const std::vector<std::string>& actors,
         const std::vector<std::string>& genres, float rating);
+    ~Movie();
     std::string get_id() const;
     std::string get_title() const;
     std::string get_release_year() const;
@@ -20,16 +89,26 @@ public:
     std::vector<std::string> get_actors() const;
     std::vector<std::string> get_genres() const;
 
+    // Same data as the getters above, as views into the database's columns (no copies).
+    // The views stay valid until the database is loaded again or destroyed.
+    std::string_view get_id_view() const;
+    std::string_view get_title_view() const;
+    std::string_view get_release_year_view() const;
+    Names get_directors_view() const;
+    Names get_actors_view() const;
+    Names get_genres_view() const;
+
+    // position of the movie in its MovieDatabase (load order), or -1 if it is not in one
+    int get_index() const;
+
 private:
-    std::string m_id;
-    std::string m_title;
-    std::string m_release_year;
+    friend class MovieDatabase;
 
-    float m_rating;
+    Movie(const MovieDatabase* database, int index);
 
-    std::vector<std::string> m_directors;
-    std::vector<std::string> m_actors;
-    std::vector<std::string> m_genres;
+    const MovieDatabase* m_database;
+    int m_index;
+    std::unique_ptr<MovieDatabase> m_owned; // only for a movie made on its own
 };
 
 #endif // MOVIE_INCLUDED
\ No newline at end of file
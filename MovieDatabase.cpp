@@ -1,120 +1,313 @@
 #include "Movie.h"
 #include "MovieDatabase.h"
+#include "TextLoader.h"
+#include "GenreAffinity.h"
+#include "ThreadPool.h"
 #include <string>
 #include <vector>
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <algorithm>
+#include <span>
+#include <string_view>
+#include <cstdint>
+#include <chrono>
+#include <memory_resource>
+#include <charconv>
+#include <cstring>
+#include <new>
+#include <functional>
 using namespace std;
 
-MovieDatabase::MovieDatabase() {}
-
-MovieDatabase::~MovieDatabase() {
-    for (int j = 0; j < m_movies.size(); j++) {
-        delete m_movies[j];
-    }
+// The lookup indices load() builds at the same time: one per attribute, then the ID multimap
+static const size_t INDEX_COUNT = MovieDatabase::ATTRIBUTE_COUNT + 1;
+static const size_t ID_INDEX = MovieDatabase::ATTRIBUTE_COUNT;
+
+// Calls build(index) for every index in [0, INDEX_COUNT), each on a thread of its own unless
+// thread_count is lower, and returns the nanoseconds the longest one took
+static uint64_t build_indices_in_parallel(unsigned thread_count, const function<void(size_t)>& build) {
+    ThreadPool pool(thread_count == 0 ? unsigned(INDEX_COUNT) : min(thread_count, unsigned(INDEX_COUNT)));
+    uint64_t build_ns[INDEX_COUNT] = {};
+    pool.parallel_for(INDEX_COUNT, [&](size_t index, unsigned) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        build(index);
+        build_ns[index] = lap_ns(start);
+    });
+    return *max_element(build_ns, build_ns + INDEX_COUNT);
 }
 
-bool MovieDatabase::load(const string& filename)
-{
-    // Open input file stream
-    ifstream infile(filename);
-
-    // Read first line (the ID of the movie) and loop through each line of the file
-    string tempStr;
-
-    // get first line (the ID of the movie)
-    while (getline(infile, tempStr)) {
+MovieDatabase::MovieDatabase() : m_attribute_bases(), m_fingerprint(0), m_version(0) {
+    m_incidence_offsets_storage.push_back(0);
+    m_incidence_offsets = m_incidence_offsets_storage;
+}
 
-        // Extract movie ID from the current line
-        string tempID = tempStr;
+// The movies are never destroyed one by one: they came from m_arena and the attribute names from
+// their tables' arenas, which hand their blocks back in one go when they are destroyed
+MovieDatabase::~MovieDatabase() {}
 
-        // Extract movie name from the next line
-        string tempName;
-        if (!getline(infile, tempName)) {
-            return false;
-        }
+// Appends text to a string pool and returns where it is
+static StringRef append_text(vector<char>& pool, string_view text) {
+    StringRef ref{ uint32_t(pool.size()), uint32_t(text.size()) };
+    pool.insert(pool.end(), text.begin(), text.end());
+    return ref;
+}
 
-        // Extract movie release year from the next line
-        string tempReleaseYear;
-        if (!getline(infile, tempReleaseYear)) {
-            return false;
+// The fields of one movie record, as views into the mapped file
+// Its directors, actors and genres are names[first_name, first_name + director_count + actor_count + genre_count)
+struct ParsedMovie
+{
+    string_view id;
+    string_view title;
+    string_view release_year;
+    size_t first_name;
+    uint32_t director_count;
+    uint32_t actor_count;
+    uint32_t genre_count;
+    float rating;
+};
+
+// The movies and errors found in one chunk of the file, with line numbers relative to the chunk
+struct ParsedMovieChunk
+{
+    vector<ParsedMovie> movies;
+    vector<string_view> names;
+    vector<LoadError> errors;
+    size_t line_count = 0;
+};
+
+// Lines in a movies.txt record
+static const size_t MOVIE_RECORD_LINES = 7;
+
+// Parses every record in a chunk of movies.txt; malformed records are reported and skipped
+// Each record is seven lines: ID, title, release year, directors, actors, genres (comma
+// separated) and rating, followed by a blank line. They are read by position, since a movie
+// with no directors, actors or genres has a blank line for them.
+static void parse_movie_chunk(string_view chunk, ParsedMovieChunk& parsed) {
+    RecordReader reader(chunk);
+    vector<string_view> lines;
+    vector<string_view> fields;
+    size_t first_line;
+
+    while (reader.next_record(MOVIE_RECORD_LINES, lines, first_line)) {
+        if (lines.size() != MOVIE_RECORD_LINES) {
+            parsed.errors.push_back(LoadError{ first_line, "movie record has " + to_string(lines.size()) + " lines instead of 7" });
+            continue;
         }
 
-        // Extract directors data from the next line and split by commas to create a vector of director names
-        string input1;
-        vector<string> directorsAdjustCommas;
-        if (!getline(infile, input1)) {
-            return false;
+        ParsedMovie movie;
+        if (!parse_float(lines[6], movie.rating)) {
+            parsed.errors.push_back(LoadError{ first_line + 6, "rating \"" + string(lines[6]) + "\" is not a number" });
+            continue;
         }
-        stringstream directors_stream(input1);
-        while (getline(directors_stream, input1, ',')) {
-            directorsAdjustCommas.push_back(input1);
+        movie.id = lines[0];
+        movie.title = lines[1];
+        movie.release_year = lines[2];
+        movie.first_name = parsed.names.size();
+
+        uint32_t* counts[3] = { &movie.director_count, &movie.actor_count, &movie.genre_count };
+        for (int f = 0; f < 3; f++) {
+            split_commas(lines[3 + f], fields);
+            parsed.names.insert(parsed.names.end(), fields.begin(), fields.end());
+            *counts[f] = uint32_t(fields.size());
         }
+        parsed.movies.push_back(movie);
+    }
+    parsed.line_count = reader.get_line_count();
+}
 
-        // Extract actors data from the next line and split by commas to create a vector of actor names
-        vector<string> actorsAdjustCommas;
-        if (!getline(infile, input1)) {
-            return false;
+bool MovieDatabase::load(const string& filename, unsigned thread_count)
+{
+    // A database backed by a snapshot cannot take more movies
+    if (m_snapshot.is_open()) {
+        return false;
+    }
+
+    // Map the whole file; it only stays mapped while loading
+    chrono::steady_clock::time_point phase_start = chrono::steady_clock::now();
+    m_load_timings = LoadTimings();
+    MappedFile file;
+    if (!read_snapshot_source(filename, m_source) || !file.open(filename)) {
+        return false;
+    }
+    string_view text(file.data(), file.size());
+    m_load_timings.map_ns = lap_ns(phase_start);
+
+    // Split the file into chunks of whole records and parse them in parallel
+    vector<ParsedMovieChunk> parsed = parse_record_chunks<ParsedMovieChunk>(text, thread_count, parse_movie_chunk, MOVIE_RECORD_LINES);
+    m_load_timings.parse_ns = lap_ns(phase_start);
+
+    // Add the movies' rows in file order, so movie indices follow the file, and number the
+    // errors by their line in the whole file
+    m_load_errors.clear();
+    size_t line_base = 0;
+    for (int c = 0; c < parsed.size(); c++) {
+        for (const ParsedMovie& movie : parsed[c].movies) {
+            add_row(movie.id, movie.title, movie.release_year, movie.rating);
         }
-        stringstream actors_stream(input1);
-        while (getline(actors_stream, input1, ',')) {
-            actorsAdjustCommas.push_back(input1);
+        for (const LoadError& error : parsed[c].errors) {
+            m_load_errors.push_back(LoadError{ line_base + error.line, error.message });
         }
-
-        // Extract genres data from the next line and split by commas to create a vector of genre names
-        vector<string> genresAdjustCommas;
-        if (!getline(infile, input1)) {
-            return false;
+        line_base += parsed[c].line_count;
+    }
+    freeze_columns();
+    m_load_timings.build_ns = lap_ns(phase_start);
+
+    // The parsed records are shared by the index builds: each attribute's thread interns that
+    // attribute of every movie, in file order, then builds its posting lists and multimap, while
+    // another thread sorts the IDs
+    m_load_timings.slowest_index_ns = build_indices_in_parallel(thread_count, [&](size_t index) {
+        if (index == ID_INDEX) {
+            assign_id_map(sorted_order(m_ids));
+            return;
         }
-        stringstream genres_stream(input1);
-        while (getline(genres_stream, input1, ',')) {
-            genresAdjustCommas.push_back(input1);
+        AttributeTable& table = m_attributes[index];
+        for (const ParsedMovieChunk& chunk : parsed) {
+            for (const ParsedMovie& movie : chunk.movies) {
+                const uint32_t counts[ATTRIBUTE_COUNT] = { movie.director_count, movie.actor_count, movie.genre_count };
+                size_t first = movie.first_name;
+                for (size_t a = 0; a < index; a++) {
+                    first += counts[a];
+                }
+                table.add_movie(span<const string_view>(chunk.names.data() + first, counts[index]));
+            }
         }
+        table.build_postings();
+        assign_attribute_map(Attribute(index), table.sorted_name_order());
+    });
+    build_derived_columns();
+    m_load_timings.index_ns = lap_ns(phase_start);
+    m_version++;
+    return true;
+}
 
-        // Extract movie rating as a string from the next line and convert it to float
-        string tempRating;
-        if (!getline(infile, tempRating)) {
-            return false;
-        }
-        float flo_tempRating = stof(tempRating);
+// Returns the malformed records skipped by the last load(), in file order
+const vector<LoadError>& MovieDatabase::get_load_errors() const {
+    return m_load_errors;
+}
 
-        // Create a new instance of the Movie class with the extracted data
-        Movie* m_movie = new Movie(tempID, tempName, tempReleaseYear, directorsAdjustCommas, actorsAdjustCommas, genresAdjustCommas, flo_tempRating);
+const LoadTimings& MovieDatabase::get_load_timings() const {
+    return m_load_timings;
+}
 
-        // Insert movies into m_movies vector to be deleted later
-        m_movies.push_back(m_movie);
+uint64_t MovieDatabase::get_version() const {
+    return m_version;
+}
 
-        // Associate the movie with its ID
-        m_id_movie_map.insert(tempID, m_movie);
+// Appends the movie's row to every column and interns its directors, actors and genres
+void MovieDatabase::add_movie(string_view id, string_view title, string_view release_year,
+    span<const string_view> directors, span<const string_view> actors, span<const string_view> genres, float rating)
+{
+    add_row(id, title, release_year, rating);
+    m_attributes[DIRECTOR].add_movie(directors);
+    m_attributes[ACTOR].add_movie(actors);
+    m_attributes[GENRE].add_movie(genres);
+}
 
-        int q;
+// Appends the movie's row to the text and rating columns, leaving its attributes to the caller
+void MovieDatabase::add_row(string_view id, string_view title, string_view release_year, float rating)
+{
+    // The text goes into the string pool, which may still move; the column spans are pointed at
+    // the storage once loading is done
+    m_ids_storage.push_back(append_text(m_text_storage, id));
+    m_titles_storage.push_back(append_text(m_text_storage, title));
+    m_release_year_texts_storage.push_back(append_text(m_text_storage, release_year));
+    m_ratings_storage.push_back(rating);
+
+    // The movie is only a view of its row, made in the arena right after the previous one
+    Movie* m_movie = new (m_arena.allocate(sizeof(Movie), alignof(Movie))) Movie(this, int(m_movies.size()));
+    m_movies.push_back(m_movie);
+}
 
-        // Associate the movie with its directors in the director-movie multimap
-        for (q = 0; q < directorsAdjustCommas.size(); q++) {
-            m_director_movie_map.insert(directorsAdjustCommas[q], m_movie);
-        }
+// Points the columns at their storage and builds the searchable flat index arrays and the
+// derived columns from them, on this thread; load() builds the indices in parallel instead
+void MovieDatabase::freeze_indices()
+{
+    freeze_columns();
+    assign_id_map(sorted_order(m_ids));
 
-        // Associate the movie with its actors in the actor-movie multimap
-        for (q = 0; q < actorsAdjustCommas.size(); q++) {
-            m_actor_movie_map.insert(actorsAdjustCommas[q], m_movie);
-        }
+    // The attribute multimaps only need the distinct names sorted, not every (name, movie) pair
+    for (int a = 0; a < ATTRIBUTE_COUNT; a++) {
+        m_attributes[a].build_postings();
+        assign_attribute_map(Attribute(a), m_attributes[a].sorted_name_order());
+    }
+    build_derived_columns();
+}
+
+// Points the text and rating columns at their storage, which no longer moves
+void MovieDatabase::freeze_columns()
+{
+    m_text = m_text_storage;
+    m_ids = m_ids_storage;
+    m_titles = m_titles_storage;
+    m_release_year_texts = m_release_year_texts_storage;
+    m_ratings = m_ratings_storage;
+}
+
+// Builds the columns computed from the others once every attribute has its posting lists
+void MovieDatabase::build_derived_columns()
+{
+    build_incidence();
+    build_fingerprint();
+    build_genre_masks();
+    build_release_years();
+    build_title_ranks();
+}
+
+string_view MovieDatabase::text_of(StringRef ref) const {
+    return string_view(m_text.data() + ref.offset, ref.length);
+}
 
-        // Associate the movie with its genres in the genre-movie multimap
-        for (q = 0; q < genresAdjustCommas.size(); q++) {
-            m_genre_movie_map.insert(genresAdjustCommas[q], m_movie);
+// Returns the movie indices ordered by the text of a column, equal texts in load order
+vector<uint32_t> MovieDatabase::sorted_order(span<const StringRef> column) const {
+    vector<uint32_t> order(column.size());
+    for (uint32_t m = 0; m < order.size(); m++) {
+        order[m] = m;
+    }
+    stable_sort(order.begin(), order.end(), [this, column](uint32_t a, uint32_t b) {
+        return text_of(column[a]) < text_of(column[b]);
+    });
+    return order;
+}
+
+// Fills the ID multimap from the movie indices sorted by ID
+void MovieDatabase::assign_id_map(span<const uint32_t> id_order)
+{
+    vector<string_view> keys;
+    vector<size_t> offsets;
+    vector<Movie*> values;
+    for (uint32_t movie_index : id_order) {
+        string_view id = text_of(m_ids[movie_index]);
+        if (keys.empty() || keys.back() != id) { // first value of a new key
+            keys.push_back(id);
+            offsets.push_back(values.size());
         }
+        values.push_back(m_movies[movie_index]);
+    }
+    offsets.push_back(values.size());
+    m_id_movie_map.assign_sorted(move(keys), move(offsets), move(values));
+}
 
-        // Skip the new line
-        getline(infile, tempStr);
+// Fills the multimap of an attribute from its posting lists, given its ids sorted by name
+void MovieDatabase::assign_attribute_map(Attribute attribute, span<const uint32_t> name_order)
+{
+    vector<string_view> keys;
+    vector<size_t> offsets;
+    vector<Movie*> values;
+    for (uint32_t attribute_id : name_order) {
+        keys.push_back(m_attributes[attribute].names[attribute_id]);
+        offsets.push_back(values.size());
+        for (uint32_t movie_index : get_movie_indices_with(attribute, attribute_id)) {
+            values.push_back(m_movies[movie_index]);
+        }
     }
-    // Successfully loaded movie data from the file
-    return true;
+    offsets.push_back(values.size());
+
+    TreeMultimap<string_view, Movie*>* attribute_maps[ATTRIBUTE_COUNT] = { &m_director_movie_map, &m_actor_movie_map, &m_genre_movie_map };
+    attribute_maps[attribute]->assign_sorted(move(keys), move(offsets), move(values));
 }
 
-Movie* MovieDatabase::get_movie_from_id(const string& id) const {
+Movie* MovieDatabase::get_movie_from_id(string_view id) const {
     // Find the iterator that corresponds to the given ID in the map that maps movie IDs to movie pointers.
-    TreeMultimap<string, Movie*>::Iterator it = m_id_movie_map.find(id);
+    TreeMultimap<string_view, Movie*>::Iterator it = m_id_movie_map.find(id);
 
     // Each movie has a unique ID.
 
@@ -130,9 +323,9 @@ Movie* MovieDatabase::get_movie_from_id(const string& id) const {
 }
 
 // Returns a vector of Movie pointers associated with the given director
-vector<Movie*> MovieDatabase::get_movies_with_director(const string& director) const {
+vector<Movie*> MovieDatabase::get_movies_with_director(string_view director) const {
     // Find all the movies associated with the given director
-    TreeMultimap<string, Movie*>::Iterator it = m_director_movie_map.find(director);
+    TreeMultimap<string_view, Movie*>::Iterator it = m_director_movie_map.find(director);
 
     // Create a vector to store all the movies associated with the director
     vector<Movie*> movies_with_director;
@@ -148,9 +341,9 @@ vector<Movie*> MovieDatabase::get_movies_with_director(const string& director) c
 }
 
 // Returns a vector of Movie pointers that feature the specified actor.
-vector<Movie*> MovieDatabase::get_movies_with_actor(const string& actor) const {
+vector<Movie*> MovieDatabase::get_movies_with_actor(string_view actor) const {
     // Find the iterator for the given actor in the actor-movie map
-    TreeMultimap<string, Movie*>::Iterator it = m_actor_movie_map.find(actor);
+    TreeMultimap<string_view, Movie*>::Iterator it = m_actor_movie_map.find(actor);
 
     // Create an empty vector to store the movies with the given actor
     vector<Movie*> movies_with_actor;
@@ -166,9 +359,9 @@ vector<Movie*> MovieDatabase::get_movies_with_actor(const string& actor) const {
 }
 
 // Returns a vector of Movie pointers associated with the given genre
-vector<Movie*> MovieDatabase::get_movies_with_genre(const string& genre) const {
+vector<Movie*> MovieDatabase::get_movies_with_genre(string_view genre) const {
     // Find the iterator for the given genre in the genre-movie map
-    TreeMultimap<string, Movie*>::Iterator it = m_genre_movie_map.find(genre);
+    TreeMultimap<string_view, Movie*>::Iterator it = m_genre_movie_map.find(genre);
 
     // Create a vector to store movies that match the given genre
     vector<Movie*> matching_movies;
@@ -183,4 +376,449 @@ vector<Movie*> MovieDatabase::get_movies_with_genre(const string& genre) const {
 
     // Return the vector of movies that match the given genre
     return matching_movies;
+}
+
+// The _view lookups return the index's own storage for the key instead of a copy
+// The ranges stay valid until the database is loaded again or destroyed
+span<Movie* const> MovieDatabase::get_movies_with_director_view(string_view director) const {
+    return m_director_movie_map.find_all(director);
+}
+
+span<Movie* const> MovieDatabase::get_movies_with_actor_view(string_view actor) const {
+    return m_actor_movie_map.find_all(actor);
+}
+
+span<Movie* const> MovieDatabase::get_movies_with_genre_view(string_view genre) const {
+    return m_genre_movie_map.find_all(genre);
+}
+
+int MovieDatabase::get_movie_count() const {
+    return int(m_movies.size());
+}
+
+// Returns the movie at the given dense index, which must be in [0, get_movie_count())
+Movie* MovieDatabase::get_movie_at(int index) const {
+    return m_movies[index];
+}
+
+// Returns the interned ids of the given attribute (e.g. the actors) of the movie at movie_index
+span<const uint32_t> MovieDatabase::get_attribute_ids(Attribute attribute, int movie_index) const {
+    const AttributeTable& table = m_attributes[attribute];
+    return span<const uint32_t>(table.movie_ids.data() + table.movie_offsets[movie_index],
+        table.movie_offsets[movie_index + 1] - table.movie_offsets[movie_index]);
+}
+
+// Returns the indices of all movies that have the given attribute id, in load order
+span<const uint32_t> MovieDatabase::get_movie_indices_with(Attribute attribute, uint32_t attribute_id) const {
+    const AttributeTable& table = m_attributes[attribute];
+    return span<const uint32_t>(table.postings.data() + table.posting_offsets[attribute_id],
+        table.posting_offsets[attribute_id + 1] - table.posting_offsets[attribute_id]);
+}
+
+string_view MovieDatabase::get_attribute_name(Attribute attribute, uint32_t attribute_id) const {
+    return m_attributes[attribute].names[attribute_id];
+}
+
+span<const string_view> MovieDatabase::get_attribute_names(Attribute attribute) const {
+    return m_attributes[attribute].names;
+}
+
+uint32_t MovieDatabase::get_attribute_count(Attribute attribute) const {
+    return uint32_t(m_attributes[attribute].names.size());
+}
+
+string_view MovieDatabase::get_id_at(int movie_index) const {
+    return text_of(m_ids[movie_index]);
+}
+
+string_view MovieDatabase::get_title_at(int movie_index) const {
+    return text_of(m_titles[movie_index]);
+}
+
+string_view MovieDatabase::get_release_year_text_at(int movie_index) const {
+    return text_of(m_release_year_texts[movie_index]);
+}
+
+uint32_t MovieDatabase::get_attribute_base(Attribute attribute) const {
+    return m_attribute_bases[attribute];
+}
+
+uint32_t MovieDatabase::get_incidence_row_count() const {
+    return uint32_t(m_incidence_offsets.size()) - 1;
+}
+
+span<const uint32_t> MovieDatabase::get_incidence_row(uint32_t row) const {
+    return span<const uint32_t>(m_incidence_postings.data() + m_incidence_offsets[row], m_incidence_offsets[row + 1] - m_incidence_offsets[row]);
+}
+
+// Lays the posting lists of the three attributes end to end as the rows of one incidence matrix,
+// and points each attribute's postings at its part of it, freeing the separate copies
+void MovieDatabase::build_incidence() {
+    size_t posting_total = 0;
+    for (int a = 0; a < ATTRIBUTE_COUNT; a++) {
+        posting_total += m_attributes[a].postings.size();
+    }
+    m_incidence_postings_storage.clear();
+    m_incidence_postings_storage.reserve(posting_total);
+    m_incidence_offsets_storage.assign(1, 0);
+    for (int a = 0; a < ATTRIBUTE_COUNT; a++) {
+        const AttributeTable& table = m_attributes[a];
+        uint32_t posting_base = uint32_t(m_incidence_postings_storage.size());
+        for (uint32_t id = 0; id + 1 < table.posting_offsets.size(); id++) {
+            m_incidence_offsets_storage.push_back(posting_base + table.posting_offsets[id + 1]);
+        }
+        m_incidence_postings_storage.insert(m_incidence_postings_storage.end(), table.postings.begin(), table.postings.end());
+    }
+    m_incidence_offsets = m_incidence_offsets_storage;
+    m_incidence_postings = m_incidence_postings_storage;
+    point_postings_at_incidence();
+    for (int a = 0; a < ATTRIBUTE_COUNT; a++) {
+        vector<uint32_t>().swap(m_attributes[a].postings_storage);
+    }
+}
+
+// Numbers the rows of each attribute from the end of the previous one's and points its posting
+// lists at its rows of the incidence matrix
+void MovieDatabase::point_postings_at_incidence() {
+    uint32_t row = 0;
+    for (int a = 0; a < ATTRIBUTE_COUNT; a++) {
+        AttributeTable& table = m_attributes[a];
+        uint32_t row_count = uint32_t(table.names.size());
+        m_attribute_bases[a] = row;
+        table.postings = m_incidence_postings.subspan(m_incidence_offsets[row], m_incidence_offsets[row + row_count] - m_incidence_offsets[row]);
+        row += row_count;
+    }
+    m_attribute_bases[ATTRIBUTE_COUNT] = row;
+}
+
+span<const uint64_t> MovieDatabase::get_genre_masks() const {
+    return m_genre_masks;
+}
+
+// Packs each movie's genre ids into one word; leaves the column empty if that would lose information
+void MovieDatabase::build_genre_masks() {
+    m_genre_masks.clear();
+    if (m_attributes[GENRE].posting_offsets.size() > MAX_MASK_GENRES + 1) {
+        return;
+    }
+
+    vector<uint64_t> masks(m_movies.size(), 0);
+    for (int m = 0; m < m_movies.size(); m++) {
+        for (uint32_t genre_id : get_attribute_ids(GENRE, m)) {
+            uint64_t bit = uint64_t(1) << genre_id;
+            if (masks[m] & bit) {
+                return; // the genre is listed twice and would have to count twice
+            }
+            masks[m] |= bit;
+        }
+    }
+    m_genre_masks = move(masks);
+}
+
+span<const uint16_t> MovieDatabase::get_release_years() const {
+    return m_release_years;
+}
+
+span<const float> MovieDatabase::get_ratings() const {
+    return m_ratings;
+}
+
+span<const uint32_t> MovieDatabase::get_title_ranks() const {
+    return m_title_ranks;
+}
+
+uint64_t MovieDatabase::get_fingerprint() const {
+    return m_fingerprint;
+}
+
+// FNV-1a over the IDs and attribute names, with a separator after each so that moving text from
+// one field to the next changes the hash
+void MovieDatabase::build_fingerprint() {
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](string_view text, char separator) {
+        for (char c : text) {
+            hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+        }
+        hash = (hash ^ uint8_t(separator)) * 1099511628211ull;
+    };
+    for (int m = 0; m < m_movies.size(); m++) {
+        add(get_id_at(m), '\n');
+        for (int a = 0; a < ATTRIBUTE_COUNT; a++) {
+            for (uint32_t attribute_id : get_attribute_ids(Attribute(a), m)) {
+                add(m_attributes[a].names[attribute_id], ',');
+            }
+            add(string_view(), ';');
+        }
+    }
+    m_fingerprint = hash;
+}
+
+// Parses every release year into a number, so a filter can test a whole catalog without
+// parsing text
+void MovieDatabase::build_release_years() {
+    m_release_years_storage.assign(m_movies.size(), 0);
+    for (int m = 0; m < m_movies.size(); m++) {
+        string_view year = get_release_year_text_at(m);
+        uint16_t value = 0;
+        if (from_chars(year.data(), year.data() + year.size(), value).ptr == year.data() + year.size()) {
+            m_release_years_storage[m] = value;
+        }
+    }
+    m_release_years = m_release_years_storage;
+}
+
+// Numbers the movies by title, giving equal titles the same rank
+void MovieDatabase::build_title_ranks() {
+    vector<uint32_t> title_order = sorted_order(m_titles);
+    m_title_ranks_storage.assign(m_movies.size(), 0);
+    uint32_t rank = 0;
+    for (uint32_t k = 0; k < title_order.size(); k++) {
+        if (k > 0 && get_title_at(title_order[k]) != get_title_at(title_order[k - 1])) {
+            rank = k;
+        }
+        m_title_ranks_storage[title_order[k]] = rank;
+    }
+    m_title_ranks = m_title_ranks_storage;
+}
+
+// Sections of a movie snapshot; every column is one section indexed by movie index
+enum MovieSnapshotSection
+{
+    MOVIE_IDS = 1, // StringRef per movie
+    MOVIE_ID_ORDER, // movie indices sorted by ID
+    MOVIE_TITLES, // StringRef per movie
+    MOVIE_RELEASE_YEAR_TEXTS, // StringRef per movie
+    MOVIE_RELEASE_YEARS, // uint16_t per movie
+    MOVIE_RATINGS, // float per movie
+    MOVIE_TITLE_RANKS, // uint32_t per movie
+    MOVIE_INCIDENCE_OFFSETS, // the incidence matrix, whose rows are every attribute's posting lists
+    MOVIE_INCIDENCE_POSTINGS,
+    // followed by one group of sections per attribute, starting at attribute_section(attribute, 0)
+    ATTRIBUTE_NAMES = 0, // StringRef per attribute id
+    ATTRIBUTE_NAME_ORDER, // attribute ids sorted by name
+    ATTRIBUTE_MOVIE_OFFSETS,
+    ATTRIBUTE_MOVIE_IDS,
+    ATTRIBUTE_POSTING_OFFSETS, // into the attribute's part of MOVIE_INCIDENCE_POSTINGS
+};
+
+static uint32_t attribute_section(int attribute, uint32_t section) {
+    return 16 * (attribute + 1) + section;
+}
+
+// Returns true if offsets are those of incidence rows [first_row, first_row + offsets.size() - 1),
+// counted from the first of them, so an attribute's posting lists agree with the matrix's rows
+static bool matches_rows(span<const uint32_t> offsets, span<const uint32_t> incidence_offsets, size_t first_row) {
+    if (offsets.empty() || first_row + offsets.size() > incidence_offsets.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < offsets.size(); i++) {
+        if (offsets[i] != incidence_offsets[first_row + i] - incidence_offsets[first_row]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MovieDatabase::compile(const string& snapshot_filename) const {
+    SnapshotWriter writer(SNAPSHOT_MOVIES, m_source);
+
+    // The text columns, with their strings in the snapshot's pool
+    span<const StringRef> text_columns[] = { m_ids, m_titles, m_release_year_texts };
+    const uint32_t text_sections[] = { MOVIE_IDS, MOVIE_TITLES, MOVIE_RELEASE_YEAR_TEXTS };
+    for (int c = 0; c < 3; c++) {
+        vector<StringRef> refs;
+        for (StringRef ref : text_columns[c]) {
+            refs.push_back(writer.add_string(text_of(ref)));
+        }
+        writer.add_section<StringRef>(text_sections[c], refs);
+    }
+    writer.add_section<uint16_t>(MOVIE_RELEASE_YEARS, m_release_years);
+    writer.add_section<float>(MOVIE_RATINGS, m_ratings);
+    writer.add_section<uint32_t>(MOVIE_TITLE_RANKS, m_title_ranks);
+
+    // The ID index, prebuilt so opening the snapshot does not sort
+    writer.add_section<uint32_t>(MOVIE_ID_ORDER, sorted_order(m_ids));
+
+    // The posting lists of all attributes once, as the incidence matrix they are views of
+    writer.add_section<uint32_t>(MOVIE_INCIDENCE_OFFSETS, m_incidence_offsets);
+    writer.add_section<uint32_t>(MOVIE_INCIDENCE_POSTINGS, m_incidence_postings);
+
+    // The interned attributes with both CSR directions and the name index
+    for (int a = 0; a < ATTRIBUTE_COUNT; a++) {
+        const AttributeTable& table = m_attributes[a];
+
+        vector<StringRef> names;
+        for (uint32_t n = 0; n < table.names.size(); n++) {
+            names.push_back(writer.add_string(table.names[n]));
+        }
+        vector<uint32_t> name_order = table.sorted_name_order();
+
+        writer.add_section<StringRef>(attribute_section(a, ATTRIBUTE_NAMES), names);
+        writer.add_section<uint32_t>(attribute_section(a, ATTRIBUTE_NAME_ORDER), name_order);
+        writer.add_section<uint32_t>(attribute_section(a, ATTRIBUTE_MOVIE_OFFSETS), table.movie_offsets);
+        writer.add_section<uint32_t>(attribute_section(a, ATTRIBUTE_MOVIE_IDS), table.movie_ids);
+        writer.add_section<uint32_t>(attribute_section(a, ATTRIBUTE_POSTING_OFFSETS), table.posting_offsets);
+    }
+
+    return writer.write(snapshot_filename);
+}
+
+bool MovieDatabase::open_snapshot(const string& snapshot_filename, const string& source_filename) {
+    chrono::steady_clock::time_point phase_start = chrono::steady_clock::now();
+    if (!m_movies.empty() || !m_snapshot.open(snapshot_filename, SNAPSHOT_MOVIES, source_filename)) {
+        return false;
+    }
+
+    // Check that every array has the size the others imply before trusting any of them
+    span<const StringRef> ids = m_snapshot.section<StringRef>(MOVIE_IDS);
+    span<const StringRef> titles = m_snapshot.section<StringRef>(MOVIE_TITLES);
+    span<const StringRef> release_year_texts = m_snapshot.section<StringRef>(MOVIE_RELEASE_YEAR_TEXTS);
+    span<const uint16_t> release_years = m_snapshot.section<uint16_t>(MOVIE_RELEASE_YEARS);
+    span<const float> ratings = m_snapshot.section<float>(MOVIE_RATINGS);
+    span<const uint32_t> title_ranks = m_snapshot.section<uint32_t>(MOVIE_TITLE_RANKS);
+    span<const uint32_t> id_order = m_snapshot.section<uint32_t>(MOVIE_ID_ORDER);
+    span<const uint32_t> incidence_offsets = m_snapshot.section<uint32_t>(MOVIE_INCIDENCE_OFFSETS);
+    span<const uint32_t> incidence_postings = m_snapshot.section<uint32_t>(MOVIE_INCIDENCE_POSTINGS);
+    size_t movie_count = ids.size();
+    size_t pool_size = m_snapshot.get_pool().size();
+    bool valid = titles.size() == movie_count && release_year_texts.size() == movie_count && release_years.size() == movie_count
+        && ratings.size() == movie_count && title_ranks.size() == movie_count && all_below(title_ranks, movie_count)
+        && valid_strings(ids, pool_size) && valid_strings(titles, pool_size) && valid_strings(release_year_texts, pool_size)
+        && id_order.size() == movie_count && all_below(id_order, movie_count)
+        && valid_offsets(incidence_offsets, incidence_postings.size()) && all_below(incidence_postings, movie_count);
+    size_t first_row = 0;
+    for (int a = 0; a < ATTRIBUTE_COUNT; a++) {
+        size_t name_count = m_snapshot.section<StringRef>(attribute_section(a, ATTRIBUTE_NAMES)).size();
+        valid = valid && all_below(m_snapshot.section<uint32_t>(attribute_section(a, ATTRIBUTE_NAME_ORDER)), name_count)
+            && all_below(m_snapshot.section<uint32_t>(attribute_section(a, ATTRIBUTE_MOVIE_IDS)), name_count);
+        span<const uint32_t> movie_offsets = m_snapshot.section<uint32_t>(attribute_section(a, ATTRIBUTE_MOVIE_OFFSETS));
+        span<const uint32_t> posting_offsets = m_snapshot.section<uint32_t>(attribute_section(a, ATTRIBUTE_POSTING_OFFSETS));
+        valid = valid && m_snapshot.section<uint32_t>(attribute_section(a, ATTRIBUTE_NAME_ORDER)).size() == name_count
+            && movie_offsets.size() == movie_count + 1
+            && valid_offsets(movie_offsets, m_snapshot.section<uint32_t>(attribute_section(a, ATTRIBUTE_MOVIE_IDS)).size())
+            && posting_offsets.size() == name_count + 1 && matches_rows(posting_offsets, incidence_offsets, first_row);
+        first_row += name_count;
+    }
+    valid = valid && incidence_offsets.size() == first_row + 1;
+    if (!valid) {
+        m_snapshot.close();
+        return false;
+    }
+
+    m_load_timings = LoadTimings();
+    m_load_timings.map_ns = lap_ns(phase_start);
+
+    // Point the attribute tables straight at the mapped CSR arrays
+    for (int a = 0; a < ATTRIBUTE_COUNT; a++) {
+        AttributeTable& table = m_attributes[a];
+        table.movie_offsets = m_snapshot.section<uint32_t>(attribute_section(a, ATTRIBUTE_MOVIE_OFFSETS));
+        table.movie_ids = m_snapshot.section<uint32_t>(attribute_section(a, ATTRIBUTE_MOVIE_IDS));
+        table.posting_offsets = m_snapshot.section<uint32_t>(attribute_section(a, ATTRIBUTE_POSTING_OFFSETS));
+
+        span<const StringRef> names = m_snapshot.section<StringRef>(attribute_section(a, ATTRIBUTE_NAMES));
+        table.names.reserve(names.size());
+        for (int n = 0; n < names.size(); n++) {
+            table.names.push_back(m_snapshot.get_string(names[n]));
+        }
+    }
+
+    // The columns are used where they are in the mapping; a Movie is only a view of its row
+    m_text = m_snapshot.get_pool();
+    m_ids = ids;
+    m_titles = titles;
+    m_release_year_texts = release_year_texts;
+    m_release_years = release_years;
+    m_ratings = ratings;
+    m_title_ranks = title_ranks;
+    m_incidence_offsets = incidence_offsets;
+    m_incidence_postings = incidence_postings;
+    point_postings_at_incidence();
+    m_movies.reserve(movie_count);
+    for (int m = 0; m < movie_count; m++) {
+        m_movies.push_back(new (m_arena.allocate(sizeof(Movie), alignof(Movie))) Movie(this, m));
+    }
+
+    m_load_timings.build_ns = lap_ns(phase_start);
+
+    // Rebuild the lookup indices from the prebuilt orders, without sorting, one per thread
+    m_load_timings.slowest_index_ns = build_indices_in_parallel(0, [&](size_t index) {
+        if (index == ID_INDEX) {
+            assign_id_map(id_order);
+        }
+        else {
+            assign_attribute_map(Attribute(index), m_snapshot.section<uint32_t>(attribute_section(int(index), ATTRIBUTE_NAME_ORDER)));
+        }
+    });
+    build_fingerprint();
+    build_genre_masks();
+
+    m_load_timings.index_ns = lap_ns(phase_start);
+    m_version++;
+    return true;
+}
+
+// Interns the values of this attribute for the next movie in load order
+// Each name is copied into the table's arena the first time it is seen, where it stays put
+void MovieDatabase::AttributeTable::add_movie(span<const string_view> values) {
+    if (movie_offsets_storage.empty()) {
+        movie_offsets_storage.push_back(0);
+    }
+
+    for (int v = 0; v < values.size(); v++) {
+        // Give the value the next free id the first time we see it
+        unordered_map<string_view, uint32_t>::iterator it = ids.find(values[v]);
+        if (it == ids.end()) {
+            char* copy = static_cast<char*>(arena.allocate(max<size_t>(values[v].size(), 1), 1));
+            if (!values[v].empty()) {
+                memcpy(copy, values[v].data(), values[v].size());
+            }
+            string_view name(copy, values[v].size());
+            it = ids.emplace(name, uint32_t(names.size())).first;
+            names.push_back(name);
+        }
+        movie_ids_storage.push_back(it->second);
+    }
+    movie_offsets_storage.push_back(uint32_t(movie_ids_storage.size()));
+}
+
+// Inverts the movie -> ids arrays into id -> movies posting lists with a counting sort
+void MovieDatabase::AttributeTable::build_postings() {
+    if (movie_offsets_storage.empty()) {
+        movie_offsets_storage.push_back(0);
+    }
+
+    // Count the movies of each id, then turn the counts into starting offsets
+    posting_offsets_storage.assign(names.size() + 1, 0);
+    for (int i = 0; i < movie_ids_storage.size(); i++) {
+        posting_offsets_storage[movie_ids_storage[i] + 1]++;
+    }
+    for (int a = 0; a < names.size(); a++) {
+        posting_offsets_storage[a + 1] += posting_offsets_storage[a];
+    }
+
+    // Place every movie in its ids' lists, visiting movies in load order
+    postings_storage.resize(movie_ids_storage.size());
+    vector<uint32_t> next(posting_offsets_storage.begin(), posting_offsets_storage.end() - 1);
+    for (uint32_t m = 0; m + 1 < movie_offsets_storage.size(); m++) {
+        for (uint32_t i = movie_offsets_storage[m]; i < movie_offsets_storage[m + 1]; i++) {
+            postings_storage[next[movie_ids_storage[i]]++] = m;
+        }
+    }
+
+    movie_offsets = movie_offsets_storage;
+    movie_ids = movie_ids_storage;
+    posting_offsets = posting_offsets_storage;
+    postings = postings_storage;
+}
+
+// Returns the attribute ids ordered by their names
+vector<uint32_t> MovieDatabase::AttributeTable::sorted_name_order() const {
+    vector<uint32_t> name_order(names.size());
+    for (uint32_t n = 0; n < name_order.size(); n++) {
+        name_order[n] = n;
+    }
+    sort(name_order.begin(), name_order.end(), [this](uint32_t x, uint32_t y) {
+        return names[x] < names[y];
+    });
+    return name_order;
 }
\ No newline at end of file
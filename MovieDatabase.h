@@ -3,27 +3,177 @@
 
 #include <string>
 #include <vector>
+#include <span>
+#include <string_view>
+#include <cstdint>
+#include <unordered_map>
+#include <memory_resource>
 #include "treemm.h"
+#include "Snapshot.h"
+#include "TextLoader.h"
 
 class Movie;
 
+// The catalog is stored as columns indexed by movie index (load order): the ID, title and
+// release year text of each movie as offsets into one string pool, float ratings, numeric
+// release years, title ranks, and CSR arrays of interned director, actor and genre ids. A Movie
+// is a view of one row. Loaded from a snapshot, every column is used in place in the mapping.
 class MovieDatabase
 {
 public:
     MovieDatabase();
     ~MovieDatabase();
-    bool load(const std::string& filename);
-    Movie* get_movie_from_id(const std::string& id) const;
-    std::vector<Movie*> get_movies_with_director(const std::string& director) const;
-    std::vector<Movie*> get_movies_with_actor(const std::string& actor) const;
-    std::vector<Movie*> get_movies_with_genre(const std::string& genre) const;
+    // Loads movies.txt, parsing it on thread_count threads (0 means one per hardware thread)
+    // and then building the ID, director, actor and genre indices on a thread each.
+    // Malformed records are skipped and listed by get_load_errors(); returns false only if
+    // the file cannot be read.
+    bool load(const std::string& filename, unsigned thread_count = 0);
+    const std::vector<LoadError>& get_load_errors() const;
+    const LoadTimings& get_load_timings() const; // phases of the last load() or open_snapshot()
+    uint64_t get_version() const; // changes every time the catalog does
+    // A hash of every movie's ID, directors, actors and genres in load order, stored by files
+    // built from the catalog (NeighborIndex, EmbeddingIndex) so they are not used with another
+    uint64_t get_fingerprint() const;
+
+    // Writes the loaded database to a binary snapshot, or opens one written earlier instead of
+    // calling load(). An opened snapshot is memory mapped and used in place, without parsing.
+    // open_snapshot() only works on a database that has not loaded anything yet, and refuses a
+    // snapshot compiled from an earlier version of source_filename (the file load() read).
+    bool compile(const std::string& snapshot_filename) const;
+    bool open_snapshot(const std::string& snapshot_filename, const std::string& source_filename = std::string());
+    Movie* get_movie_from_id(std::string_view id) const;
+    std::vector<Movie*> get_movies_with_director(std::string_view director) const;
+    std::vector<Movie*> get_movies_with_actor(std::string_view actor) const;
+    std::vector<Movie*> get_movies_with_genre(std::string_view genre) const;
+
+    // Same as above, but returning a view of the stored list instead of a copy
+    std::span<Movie* const> get_movies_with_director_view(std::string_view director) const;
+    std::span<Movie* const> get_movies_with_actor_view(std::string_view actor) const;
+    std::span<Movie* const> get_movies_with_genre_view(std::string_view genre) const;
+
+    // Every movie has a dense index (its position in load order) and every director, actor
+    // and genre is interned to a dense id at load time, so scoring can work on integers only.
+    enum Attribute { DIRECTOR, ACTOR, GENRE, ATTRIBUTE_COUNT };
+    int get_movie_count() const;
+    Movie* get_movie_at(int index) const;
+    std::span<const uint32_t> get_attribute_ids(Attribute attribute, int movie_index) const;
+    std::span<const uint32_t> get_movie_indices_with(Attribute attribute, uint32_t attribute_id) const;
+    std::string_view get_attribute_name(Attribute attribute, uint32_t attribute_id) const;
+    std::span<const std::string_view> get_attribute_names(Attribute attribute) const; // by attribute id
+    uint32_t get_attribute_count(Attribute attribute) const; // ids run from 0 to this minus one
+
+    // The three attributes as one attribute -> movie incidence matrix in CSR form, built at load
+    // time or mapped from a snapshot. Row get_attribute_base(a) + id is get_movie_indices_with(a, id),
+    // so a recommender can fold a watch history into one weight per row and then walk each row
+    // once. The per-attribute posting lists are views of the matrix's rows rather than copies.
+    uint32_t get_attribute_base(Attribute attribute) const;
+    uint32_t get_incidence_row_count() const;
+    std::span<const uint32_t> get_incidence_row(uint32_t row) const;
+
+    // The text columns, as written in the data file, for the movie at an index
+    std::string_view get_id_at(int movie_index) const;
+    std::string_view get_title_at(int movie_index) const;
+    std::string_view get_release_year_text_at(int movie_index) const;
+
+    // Every movie's genres as a bitmask of genre ids, indexed by movie index, for
+    // compute_genre_affinity. Empty if the catalog has more than MAX_MASK_GENRES genres or a
+    // movie lists the same genre twice, since a mask cannot count a genre more than once.
+    std::span<const uint64_t> get_genre_masks() const;
+
+    // Columns for filtering, indexed by movie index: the release year (0 if it is not a number
+    // from 1 to 65535) and the rating of every movie
+    std::span<const uint16_t> get_release_years() const;
+    std::span<const float> get_ratings() const;
+    // Each movie's position in title order, equal for equal titles, so titles can be compared as
+    // integers: title_ranks[a] < title_ranks[b] exactly when title a sorts before title b
+    std::span<const uint32_t> get_title_ranks() const;
 
 private:
-    TreeMultimap<std::string, Movie*> m_id_movie_map;
-    TreeMultimap<std::string, Movie*> m_director_movie_map;
-    TreeMultimap<std::string, Movie*> m_actor_movie_map;
-    TreeMultimap<std::string, Movie*> m_genre_movie_map;
+    friend class Movie; // a movie made on its own keeps a one-movie database
+
+    // Interned values of one attribute, with compressed sparse row (CSR) arrays in both
+    // directions: movie index -> attribute ids, and attribute id -> movie indices
+    struct AttributeTable
+    {
+        std::vector<std::string_view> names; // attribute id -> name, viewing the arena's copy or the snapshot
+        std::unordered_map<std::string_view, uint32_t> ids; // name -> attribute id, used while loading
+        std::pmr::monotonic_buffer_resource arena; // the copies of the names, so tables can be filled in parallel
+
+        // The CSR arrays, pointing either at the storage vectors below or into a mapped snapshot
+        std::span<const uint32_t> movie_offsets; // ids of movie m are movie_ids[movie_offsets[m], movie_offsets[m + 1])
+        std::span<const uint32_t> movie_ids;
+        std::span<const uint32_t> posting_offsets; // movies of id a are postings[posting_offsets[a], posting_offsets[a + 1])
+        std::span<const uint32_t> postings;
+
+        std::vector<uint32_t> movie_offsets_storage;
+        std::vector<uint32_t> movie_ids_storage;
+        std::vector<uint32_t> posting_offsets_storage;
+        std::vector<uint32_t> postings_storage;
+
+        void add_movie(std::span<const std::string_view> values);
+        void build_postings();
+        std::vector<uint32_t> sorted_name_order() const;
+    };
+
+    void add_movie(std::string_view id, std::string_view title, std::string_view release_year,
+        std::span<const std::string_view> directors, std::span<const std::string_view> actors,
+        std::span<const std::string_view> genres, float rating);
+    void add_row(std::string_view id, std::string_view title, std::string_view release_year, float rating);
+    void freeze_indices();
+    void freeze_columns();
+    void build_derived_columns();
+    void assign_id_map(std::span<const uint32_t> id_order);
+    void assign_attribute_map(Attribute attribute, std::span<const uint32_t> name_order);
+    void build_incidence();
+    void point_postings_at_incidence();
+    void build_fingerprint();
+    void build_genre_masks();
+    void build_release_years();
+    void build_title_ranks();
+    std::vector<uint32_t> sorted_order(std::span<const StringRef> column) const;
+    std::string_view text_of(StringRef ref) const;
+
+    // The Movie objects live in m_arena and the attribute names in their table's arena, and are
+    // released together with them; the index keys view the string pool and the names
+    std::pmr::monotonic_buffer_resource m_arena;
+    TreeMultimap<std::string_view, Movie*> m_id_movie_map;
+    TreeMultimap<std::string_view, Movie*> m_director_movie_map;
+    TreeMultimap<std::string_view, Movie*> m_actor_movie_map;
+    TreeMultimap<std::string_view, Movie*> m_genre_movie_map;
     std::vector<Movie*> m_movies;
+    AttributeTable m_attributes[ATTRIBUTE_COUNT];
+    std::vector<uint64_t> m_genre_masks; // genre bitmask column, see get_genre_masks()
+    uint32_t m_attribute_bases[ATTRIBUTE_COUNT + 1]; // rows of attribute a are [m_attribute_bases[a], m_attribute_bases[a + 1])
+
+    // The incidence matrix, pointing either at the storage vectors below or into a mapped snapshot
+    std::span<const uint32_t> m_incidence_offsets; // row r is m_incidence_postings[m_incidence_offsets[r], m_incidence_offsets[r + 1])
+    std::span<const uint32_t> m_incidence_postings;
+    std::vector<uint32_t> m_incidence_offsets_storage;
+    std::vector<uint32_t> m_incidence_postings_storage;
+
+    // The columns, pointing either at the storage vectors below or into a mapped snapshot
+    std::span<const char> m_text; // the string pool the text columns refer to
+    std::span<const StringRef> m_ids;
+    std::span<const StringRef> m_titles;
+    std::span<const StringRef> m_release_year_texts;
+    std::span<const uint16_t> m_release_years;
+    std::span<const float> m_ratings;
+    std::span<const uint32_t> m_title_ranks;
+
+    std::vector<char> m_text_storage;
+    std::vector<StringRef> m_ids_storage;
+    std::vector<StringRef> m_titles_storage;
+    std::vector<StringRef> m_release_year_texts_storage;
+    std::vector<uint16_t> m_release_years_storage;
+    std::vector<float> m_ratings_storage;
+    std::vector<uint32_t> m_title_ranks_storage;
+
+    std::vector<LoadError> m_load_errors;
+    LoadTimings m_load_timings;
+    SnapshotSource m_source; // of the file the last load() read, for compile()
+    uint64_t m_fingerprint;
+    uint64_t m_version;
+    SnapshotReader m_snapshot; // open while the database is backed by a snapshot
 };
 
 #endif // MOVIEDATABASE_INCLUDED
\ No newline at end of file
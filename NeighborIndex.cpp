@@ -0,0 +1,169 @@
+#include "NeighborIndex.h"
+#include "MovieDatabase.h"
+#include "Recommender.h"
+#include "Snapshot.h"
+#include <string>
+#include <vector>
+#include <span>
+#include <cstdint>
+#include <algorithm>
+#include <fstream>
+using namespace std;
+
+// Identifies the binary file format written by save()
+static const char NEIGHBOR_FILE_MAGIC[8] = { 'N', 'M', 'R', 'N', 'B', 'R', '0', '2' };
+
+NeighborIndex::NeighborIndex() : m_max_neighbors(0), m_exact(true), m_fingerprint(0) {
+    m_offsets.push_back(0);
+}
+
+void NeighborIndex::build(const MovieDatabase& movie_database, int max_neighbors) {
+    int movie_count = movie_database.get_movie_count();
+
+    m_max_neighbors = max_neighbors;
+    m_exact = true;
+    m_fingerprint = movie_database.get_fingerprint();
+    m_offsets.assign(1, 0);
+    m_neighbors.clear();
+    m_points.clear();
+
+    // Dense accumulator for one row at a time, plus the movies touched in that row
+    vector<int> points(movie_count, 0);
+    vector<uint32_t> touched;
+    vector<pair<int, uint32_t>> row; // (points, neighbor) so the heaviest entries can be kept
+
+    const MovieDatabase::Attribute attributes[2] = { MovieDatabase::DIRECTOR, MovieDatabase::ACTOR };
+    const int attribute_points[2] = { DIRECTOR_POINTS, ACTOR_POINTS };
+
+    for (int m = 0; m < movie_count; m++) {
+        // Same fan-out as Recommender::recommend_movies, for a single watched movie
+        for (int a = 0; a < 2; a++) {
+            for (uint32_t attribute_id : movie_database.get_attribute_ids(attributes[a], m)) {
+                for (uint32_t neighbor : movie_database.get_movie_indices_with(attributes[a], attribute_id)) {
+                    if (points[neighbor] == 0) {
+                        touched.push_back(neighbor);
+                    }
+                    points[neighbor] += attribute_points[a];
+                }
+            }
+        }
+
+        // Collect the row, leaving out the movie itself, and reset the accumulator
+        row.clear();
+        for (int t = 0; t < touched.size(); t++) {
+            if (touched[t] != uint32_t(m)) {
+                if (points[touched[t]] > UINT16_MAX) {
+                    m_exact = false; // does not fit in the stored points, so it is clamped
+                }
+                row.emplace_back(min(points[touched[t]], int(UINT16_MAX)), touched[t]);
+            }
+            points[touched[t]] = 0;
+        }
+        touched.clear();
+
+        // Keep only the heaviest entries if the row is too long
+        if (max_neighbors > 0 && row.size() > size_t(max_neighbors)) {
+            nth_element(row.begin(), row.begin() + max_neighbors, row.end(),
+                [](const pair<int, uint32_t>& a, const pair<int, uint32_t>& b) { return a.first > b.first; });
+            row.resize(max_neighbors);
+            m_exact = false;
+        }
+
+        // Store the row in neighbor order so query-time updates walk the score array forwards
+        sort(row.begin(), row.end(),
+            [](const pair<int, uint32_t>& a, const pair<int, uint32_t>& b) { return a.second < b.second; });
+        for (int r = 0; r < row.size(); r++) {
+            m_neighbors.push_back(row[r].second);
+            m_points.push_back(uint16_t(row[r].first));
+        }
+        m_offsets.push_back(uint32_t(m_neighbors.size()));
+    }
+}
+
+bool NeighborIndex::save(const string& filename) const {
+    ofstream outfile(filename, ios::binary);
+    if (!outfile) {
+        return false;
+    }
+
+    // Header: magic, movie count, entry count, row cap, exact flag, catalog fingerprint
+    uint32_t header[4] = { uint32_t(get_movie_count()), uint32_t(m_neighbors.size()), uint32_t(m_max_neighbors), m_exact ? 1u : 0u };
+    outfile.write(NEIGHBOR_FILE_MAGIC, sizeof(NEIGHBOR_FILE_MAGIC));
+    outfile.write(reinterpret_cast<const char*>(header), sizeof(header));
+    outfile.write(reinterpret_cast<const char*>(&m_fingerprint), sizeof(m_fingerprint));
+
+    // Body: the three arrays back to back
+    outfile.write(reinterpret_cast<const char*>(m_offsets.data()), m_offsets.size() * sizeof(uint32_t));
+    outfile.write(reinterpret_cast<const char*>(m_neighbors.data()), m_neighbors.size() * sizeof(uint32_t));
+    outfile.write(reinterpret_cast<const char*>(m_points.data()), m_points.size() * sizeof(uint16_t));
+    return bool(outfile);
+}
+
+bool NeighborIndex::load(const string& filename) {
+    ifstream infile(filename, ios::binary);
+    if (!infile) {
+        return false;
+    }
+
+    char magic[sizeof(NEIGHBOR_FILE_MAGIC)];
+    uint32_t header[4];
+    uint64_t fingerprint;
+    if (!infile.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), NEIGHBOR_FILE_MAGIC)) {
+        return false; // not a neighbor index, or written by an incompatible version
+    }
+    if (!infile.read(reinterpret_cast<char*>(header), sizeof(header)) || !infile.read(reinterpret_cast<char*>(&fingerprint), sizeof(fingerprint))) {
+        return false;
+    }
+
+    // The arrays have to be exactly what is left of the file, before anything is allocated for them
+    uint64_t body_bytes = (uint64_t(header[0]) + 1) * sizeof(uint32_t) + uint64_t(header[1]) * (sizeof(uint32_t) + sizeof(uint16_t));
+    streamoff body_start = infile.tellg();
+    infile.seekg(0, ios::end);
+    if (!infile || uint64_t(infile.tellg() - body_start) != body_bytes) {
+        return false;
+    }
+    infile.seekg(body_start);
+
+    m_offsets.resize(size_t(header[0]) + 1);
+    m_neighbors.resize(header[1]);
+    m_points.resize(header[1]);
+    m_max_neighbors = int(header[2]);
+    m_exact = header[3] != 0;
+    m_fingerprint = fingerprint;
+
+    infile.read(reinterpret_cast<char*>(m_offsets.data()), m_offsets.size() * sizeof(uint32_t));
+    infile.read(reinterpret_cast<char*>(m_neighbors.data()), m_neighbors.size() * sizeof(uint32_t));
+    infile.read(reinterpret_cast<char*>(m_points.data()), m_points.size() * sizeof(uint16_t));
+
+    // Rows that overlap or run backwards, or neighbors outside the catalog, would have the
+    // recommender index past its score array, so a damaged file is rejected as a whole
+    if (!infile || !valid_offsets(m_offsets, m_neighbors.size()) || !all_below(m_neighbors, size_t(header[0]))) {
+        *this = NeighborIndex();
+        return false;
+    }
+    return true;
+}
+
+int NeighborIndex::get_movie_count() const {
+    return int(m_offsets.size()) - 1;
+}
+
+uint64_t NeighborIndex::get_fingerprint() const {
+    return m_fingerprint;
+}
+
+bool NeighborIndex::is_exact() const {
+    return m_exact;
+}
+
+size_t NeighborIndex::get_entry_count() const {
+    return m_neighbors.size();
+}
+
+span<const uint32_t> NeighborIndex::get_neighbors(int movie_index) const {
+    return span<const uint32_t>(m_neighbors.data() + m_offsets[movie_index], m_offsets[movie_index + 1] - m_offsets[movie_index]);
+}
+
+span<const uint16_t> NeighborIndex::get_points(int movie_index) const {
+    return span<const uint16_t>(m_points.data() + m_offsets[movie_index], m_offsets[movie_index + 1] - m_offsets[movie_index]);
+}
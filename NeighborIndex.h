@@ -0,0 +1,49 @@
+#ifndef NEIGHBORINDEX_INCLUDED
+#define NEIGHBORINDEX_INCLUDED
+
+#include <string>
+#include <vector>
+#include <span>
+#include <cstdint>
+
+class MovieDatabase;
+
+// Precomputed similar-movie lists: for every movie, the other movies that share a director
+// or an actor with it, with the points that sharing is worth (20 per director, 30 per actor).
+// Those points only depend on the pair of movies, so a recommender can add up one row per
+// watched movie instead of walking every director and actor posting list again.
+// Genres are left out on purpose: a genre is shared with a large part of the catalog, so its
+// rows would be dense, and the recommender adds genre points from the posting lists instead.
+class NeighborIndex
+{
+public:
+    NeighborIndex();
+
+    // Builds the rows from the database. If max_neighbors is positive, each row keeps only its
+    // max_neighbors heaviest entries, which bounds memory but makes scores approximate.
+    void build(const MovieDatabase& movie_database, int max_neighbors);
+
+    // Writes the index to a binary file, or reads one written earlier. load() rejects a file that
+    // is truncated or inconsistent; compare get_fingerprint() with the catalog's before using it.
+    bool save(const std::string& filename) const;
+    bool load(const std::string& filename);
+
+    int get_movie_count() const;
+    uint64_t get_fingerprint() const; // MovieDatabase::get_fingerprint() of the catalog it was built from
+    bool is_exact() const; // true if no row was cut short by max_neighbors
+    size_t get_entry_count() const;
+
+    // Movie indices similar to the movie at movie_index, in increasing order, and their points
+    std::span<const uint32_t> get_neighbors(int movie_index) const;
+    std::span<const uint16_t> get_points(int movie_index) const;
+
+private:
+    int m_max_neighbors;
+    bool m_exact;
+    uint64_t m_fingerprint;
+    std::vector<uint32_t> m_offsets; // row of movie m is [m_offsets[m], m_offsets[m + 1])
+    std::vector<uint32_t> m_neighbors;
+    std::vector<uint16_t> m_points;
+};
+
+#endif // NEIGHBORINDEX_INCLUDED
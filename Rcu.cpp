@@ -0,0 +1,88 @@
+#include "Rcu.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+using namespace std;
+
+// A reading thread's slot. Slots are never freed: a thread that exits hands its slot back and
+// the next new reading thread takes it over, so the list only grows to the most reading threads
+// that ever existed at once.
+struct alignas(64) RcuDomain::Reader
+{
+    atomic<uint64_t> epoch{ 0 }; // the epoch the thread's current read-side section began in, or 0
+    atomic<bool> in_use{ true };
+    int nesting = 0; // only touched by the owning thread
+    Reader* next = nullptr;
+};
+
+static atomic<RcuDomain::Reader*> g_readers{ nullptr };
+static atomic<uint64_t> g_epoch{ 1 };
+static mutex g_synchronize_mutex; // one grace period at a time
+
+// Gives the slot back when its thread exits
+struct ReaderHolder
+{
+    RcuDomain::Reader* reader = nullptr;
+    ~ReaderHolder();
+};
+
+ReaderHolder::~ReaderHolder() {
+    if (reader != nullptr) {
+        reader->in_use.store(false, memory_order_release);
+    }
+}
+
+RcuDomain::Reader& RcuDomain::thread_reader() {
+    static thread_local ReaderHolder holder;
+    if (holder.reader != nullptr) {
+        return *holder.reader;
+    }
+
+    // Take over a slot given back by a thread that exited, or add a new one at the head
+    for (Reader* reader = g_readers.load(memory_order_acquire); reader != nullptr; reader = reader->next) {
+        bool unused = false;
+        if (reader->in_use.compare_exchange_strong(unused, true, memory_order_acq_rel)) {
+            holder.reader = reader;
+            return *reader;
+        }
+    }
+    Reader* reader = new Reader;
+    reader->next = g_readers.load(memory_order_relaxed);
+    while (!g_readers.compare_exchange_weak(reader->next, reader, memory_order_release, memory_order_relaxed)) {
+    }
+    holder.reader = reader;
+    return *reader;
+}
+
+void RcuDomain::read_lock() {
+    Reader& reader = thread_reader();
+    if (reader.nesting++ == 0) {
+        // Sequentially consistent, so either a publisher's grace period sees this slot set or
+        // the pointer load that follows sees what it published
+        reader.epoch.store(g_epoch.load(memory_order_acquire), memory_order_seq_cst);
+    }
+}
+
+void RcuDomain::read_unlock() {
+    Reader& reader = thread_reader();
+    if (--reader.nesting == 0) {
+        reader.epoch.store(0, memory_order_release);
+    }
+}
+
+void RcuDomain::synchronize() {
+    scoped_lock lock(g_synchronize_mutex);
+    uint64_t epoch = g_epoch.fetch_add(1, memory_order_seq_cst) + 1;
+
+    // A section still at an older epoch began before the new object was published
+    for (Reader* reader = g_readers.load(memory_order_acquire); reader != nullptr; reader = reader->next) {
+        while (true) {
+            uint64_t seen = reader->epoch.load(memory_order_seq_cst);
+            if (seen == 0 || seen >= epoch) {
+                break;
+            }
+            this_thread::yield();
+        }
+    }
+}
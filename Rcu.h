@@ -0,0 +1,89 @@
+#ifndef RCU_INCLUDED
+#define RCU_INCLUDED
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+// Read-copy-update: readers of a published object never lock or write shared memory other than
+// their own slot, and a writer replaces the object by publishing a new one and then waiting for a
+// grace period, after which no reader can still hold the old object, before freeing it.
+//
+// Every reading thread gets a slot the first time it reads. Entering a read-side section stores
+// the current epoch in the slot and leaving stores 0. synchronize() advances the epoch and waits
+// until every slot is either 0 or holds the new epoch or a later one, so every section that could
+// have seen the old object has ended. Sections may nest on one thread. A thread must not call
+// synchronize() (or publish()) from inside a read-side section, since it would wait for itself.
+class RcuDomain
+{
+public:
+    static void read_lock();
+    static void read_unlock();
+    static void synchronize();
+
+    struct Reader; // a reading thread's slot, defined in Rcu.cpp
+
+private:
+    static Reader& thread_reader();
+};
+
+// An object published under RcuDomain. read() returns a guard through which the object stays
+// valid, however many times it is replaced meanwhile, until the guard is destroyed.
+template <typename T>
+class RcuPointer
+{
+public:
+    class ReadGuard
+    {
+    public:
+        explicit ReadGuard(const std::atomic<T*>& current) {
+            RcuDomain::read_lock();
+            m_object = current.load(std::memory_order_seq_cst);
+        }
+        ~ReadGuard() {
+            RcuDomain::read_unlock();
+        }
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+        const T* get() const {
+            return m_object;
+        }
+        const T& operator*() const {
+            return *m_object;
+        }
+        const T* operator->() const {
+            return m_object;
+        }
+
+    private:
+        const T* m_object;
+    };
+
+    explicit RcuPointer(std::unique_ptr<T> initial) : m_current(initial.release()) {}
+    ~RcuPointer() {
+        delete m_current.load();
+    }
+    RcuPointer(const RcuPointer&) = delete;
+    RcuPointer& operator=(const RcuPointer&) = delete;
+
+    ReadGuard read() const {
+        return ReadGuard(m_current);
+    }
+
+    // Makes next the object new readers see, waits until no reader holds the one it replaces and
+    // frees that. Publishers are serialized; readers are never blocked.
+    void publish(std::unique_ptr<T> next) {
+        std::scoped_lock lock(m_publish_mutex);
+        T* previous = m_current.exchange(next.release(), std::memory_order_seq_cst);
+        RcuDomain::synchronize();
+        delete previous;
+    }
+
+private:
+    std::atomic<T*> m_current;
+    std::mutex m_publish_mutex;
+};
+
+#endif // RCU_INCLUDED
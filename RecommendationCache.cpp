@@ -0,0 +1,89 @@
+#include "RecommendationCache.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <algorithm>
+using namespace std;
+
+// Rough heap footprint of an entry: the list node, its index slot, the email and the ranking
+static size_t entry_bytes(const string& email, size_t ranking_size) {
+    return 64 + sizeof(pair<string_view, void*>) + 32 + email.capacity() + ranking_size * sizeof(pair<uint32_t, int32_t>);
+}
+
+RecommendationCache::RecommendationCache(size_t max_bytes)
+    : m_max_bytes(max_bytes), m_bytes(0), m_hits(0), m_misses(0), m_evictions(0), m_invalidations(0) {}
+
+bool RecommendationCache::find(string_view email, const Stamp& stamp, int movie_count, Ranking& ranking) {
+    scoped_lock lock(m_mutex);
+    unordered_map<string_view, list<Entry>::iterator>::iterator it = m_index.find(email);
+    if (it == m_index.end()) {
+        m_misses++;
+        return false;
+    }
+
+    list<Entry>::iterator entry = it->second;
+    if (entry->stamp != stamp) {
+        // The history or a database changed since the ranking was computed
+        erase(entry);
+        m_invalidations++;
+        m_misses++;
+        return false;
+    }
+    bool complete = entry->ranking.size() < size_t(entry->movie_count);
+    if (movie_count > entry->movie_count && !complete) {
+        m_misses++; // asks for more than was ranked
+        return false;
+    }
+
+    // Move the entry to the front and copy out the prefix that was asked for
+    m_entries.splice(m_entries.begin(), m_entries, entry);
+    ranking.assign(entry->ranking.begin(), entry->ranking.begin() + min(entry->ranking.size(), size_t(movie_count)));
+    m_hits++;
+    return true;
+}
+
+void RecommendationCache::insert(string_view email, const Stamp& stamp, int movie_count, const Ranking& ranking) {
+    scoped_lock lock(m_mutex);
+    unordered_map<string_view, list<Entry>::iterator>::iterator it = m_index.find(email);
+    if (it != m_index.end()) {
+        erase(it->second);
+    }
+
+    string key(email);
+    size_t bytes = entry_bytes(key, ranking.size());
+    if (bytes > m_max_bytes) {
+        return; // would not fit even in an empty cache
+    }
+
+    m_entries.push_front(Entry{ move(key), stamp, movie_count, ranking, bytes });
+    m_index.emplace(m_entries.front().email, m_entries.begin());
+    m_bytes += bytes;
+
+    // Evict the least recently used entries until the cache is back within its budget
+    while (m_bytes > m_max_bytes) {
+        erase(prev(m_entries.end()));
+        m_evictions++;
+    }
+}
+
+void RecommendationCache::clear() {
+    scoped_lock lock(m_mutex);
+    m_index.clear();
+    m_entries.clear();
+    m_bytes = 0;
+}
+
+RecommendationCache::Stats RecommendationCache::get_stats() const {
+    scoped_lock lock(m_mutex);
+    return Stats{ m_hits, m_misses, m_evictions, m_invalidations, m_entries.size(), m_bytes };
+}
+
+// Removes an entry; the caller holds the lock
+void RecommendationCache::erase(list<Entry>::iterator entry) {
+    m_bytes -= entry->bytes;
+    m_index.erase(entry->email);
+    m_entries.erase(entry);
+}
@@ -0,0 +1,84 @@
+#ifndef RECOMMENDATIONCACHE_INCLUDED
+#define RECOMMENDATIONCACHE_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+class User;
+
+// A least recently used cache of finished rankings, keyed by user email and bounded by a
+// memory budget. A ranking computed for movie_count movies also answers every smaller
+// movie_count, since the best k movies are the first k of the best movie_count. Every entry
+// carries the versions of what it was computed from, and is dropped once any of them changed.
+// All methods may be called from several threads at once.
+class RecommendationCache
+{
+public:
+    // What a ranking depends on: the user record and its watch history, the user database it
+    // came from and the movie catalog
+    struct Stamp
+    {
+        const User* user;
+        uint64_t history_version;
+        uint64_t user_database_version;
+        uint64_t movie_database_version;
+
+        bool operator==(const Stamp& other) const = default;
+    };
+
+    // A ranking: (movie index, compatibility score) pairs, best first
+    typedef std::vector<std::pair<uint32_t, int32_t>> Ranking;
+
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions; // entries dropped to stay within the budget
+        uint64_t invalidations; // entries dropped because what they were computed from changed
+        size_t entries;
+        size_t bytes;
+    };
+
+    explicit RecommendationCache(size_t max_bytes);
+
+    // Fills ranking with the best movie_count movies for the email and returns true if a valid
+    // cached ranking covers them; otherwise returns false and counts a miss
+    bool find(std::string_view email, const Stamp& stamp, int movie_count, Ranking& ranking);
+
+    // Caches the ranking computed for movie_count movies, replacing any older one for the email
+    void insert(std::string_view email, const Stamp& stamp, int movie_count, const Ranking& ranking);
+
+    void clear();
+    Stats get_stats() const;
+
+private:
+    struct Entry
+    {
+        std::string email;
+        Stamp stamp;
+        int movie_count; // the movie_count the ranking was computed for
+        Ranking ranking; // holds fewer than movie_count movies only if that was every candidate
+        size_t bytes;
+    };
+
+    void erase(std::list<Entry>::iterator entry);
+
+    mutable std::mutex m_mutex;
+    size_t m_max_bytes;
+    size_t m_bytes;
+    std::list<Entry> m_entries; // most recently used first
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> m_index; // keys view the entries' emails
+    uint64_t m_hits;
+    uint64_t m_misses;
+    uint64_t m_evictions;
+    uint64_t m_invalidations;
+};
+
+#endif // RECOMMENDATIONCACHE_INCLUDED
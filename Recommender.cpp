@@ -3,28 +3,184 @@
 #include "MovieDatabase.h"
 #include "User.h"
 #include "Movie.h"
+#include "NeighborIndex.h"
+#include "MinHashIndex.h"
+#include "EmbeddingIndex.h"
+#include "ThreadPool.h"
+#include "Metrics.h"
+#include "RecommendationCache.h"
+#include "GenreAffinity.h"
 #include <string>
 #include <vector>
-#include <unordered_map>
 #include <algorithm>
 #include <iostream>
+#include <cstdint>
+#include <span>
+#include <memory_resource>
+#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <climits>
+#include <cmath>
 using namespace std;
 
+// Points a movie earns for each director, actor and genre it shares with a watched movie,
+// indexed by MovieDatabase::Attribute
+static const int ATTRIBUTE_POINTS[MovieDatabase::ATTRIBUTE_COUNT] = { DIRECTOR_POINTS, ACTOR_POINTS, GENRE_POINTS };
+
+// Per-thread working memory for recommend_movies, reused from call to call so that
+// scoring and ranking do not allocate once the arrays have grown to the size of the catalog
+struct Recommender::ScoringScratch
+{
+    vector<int> scores; // compatibility score of every movie, indexed by movie index, all zero between calls
+    vector<uint32_t> candidates; // indices of the movies that got points in this call
+    vector<uint32_t> candidate_slots; // rank_movies appends candidates here, one slot more than the catalog has movies
+    vector<int> attribute_weights; // points per incidence row from the watch history, all zero between calls
+    vector<uint32_t> touched_attributes; // the incidence rows with weight in this call
+    vector<int> watched; // indices of the movies the user has watched
+    vector<AuxiliaryMovieAndRank> top; // bounded heap of the best movie_count candidates
+    vector<int> genre_weights; // times each genre id appears in the watched movies
+    vector<int> genre_affinity; // genre points of every movie, from the bitmask kernel
+    vector<uint64_t> excluded; // bit per movie index that a filtered query must not score
+    vector<MinHashIndex::SimilarUser> similar_users; // the users a SIMILAR_USERS query draws from
+    vector<int> similar_watched; // indices of the movies one of them has watched
+    vector<float> user_vector; // of an EMBEDDING query
+    vector<pair<uint32_t, float>> embedding_top; // the best movies by dot product, best first
+};
+
+// The most similar users a SIMILAR_USERS recommendation draws from
+static const size_t SIMILAR_USER_COUNT = 50;
+
+static bool is_excluded(const vector<uint64_t>& excluded, uint32_t movie_index) {
+    return (excluded[movie_index >> 6] >> (movie_index & 63)) & 1;
+}
+
+// Adds weight to the score of every movie in an incidence row, appending the movies that had no
+// points to candidates from slot count on, and returns the new count. The slot at count is
+// written whether or not the movie is new, so there are no branches on the scores and the loop
+// unrolls; candidates needs room for one more movie than the catalog has.
+static size_t add_weighted_row(span<const uint32_t> row, int weight, int* scores, uint32_t* candidates, size_t count) {
+    for (uint32_t movie_index : row) {
+        int score = scores[movie_index];
+        candidates[count] = movie_index;
+        count += score == 0;
+        scores[movie_index] = score + weight;
+    }
+    return count;
+}
+
+// The same for a filtered query: excluded movies get no points and are not appended
+static size_t add_weighted_row(span<const uint32_t> row, int weight, int* scores, uint32_t* candidates, size_t count,
+    const uint64_t* excluded) {
+    for (uint32_t movie_index : row) {
+        int keep = int((excluded[movie_index >> 6] >> (movie_index & 63)) & 1) - 1; // all ones unless excluded
+        int score = scores[movie_index];
+        candidates[count] = movie_index;
+        count += (score == 0) & (keep != 0);
+        scores[movie_index] = score + (weight & keep);
+    }
+    return count;
+}
+
+bool RecommendationFilter::is_empty() const {
+    return min_release_year <= 0 && max_release_year <= 0 && min_rating <= 0 && excluded_genres.empty();
+}
+
+// The scores kept for a tracked user, and what they were computed from
+struct Recommender::TrackedScores
+{
+    mutex lock;
+    RecommendationCache::Stamp stamp = {}; // user, history and database versions the scores reflect
+    const NeighborIndex* neighbor_index = nullptr;
+    vector<int> scores; // points of every movie from the whole watch history, watched movies included
+    vector<uint32_t> candidates; // every movie that has had points since the last rebuild
+    vector<bool> is_candidate;
+    vector<int> watched; // sorted indices of the watched movies, one per viewing
+    vector<uint32_t> watch_counts; // viewings of every movie in watched, so ranking skips them in O(1)
+};
+
+Recommender::ScoringScratch& Recommender::thread_scratch() {
+    static thread_local ScoringScratch scratch;
+    return scratch;
+}
+
 // Define the constructor for the Recommender class which takes in two parameters:
 // 1) a reference to a constant UserDatabase object called "user_database"
 // 2) a reference to a constant MovieDatabase object called "movie_database"
-Recommender::Recommender(const UserDatabase& user_database, const MovieDatabase& movie_database) {
-    // Use const_cast to remove the const qualifier from the input references
-    // and assign the resulting pointer to the member variable "m_user_database"
-    m_user_database = const_cast<UserDatabase*>(&user_database);
+Recommender::Recommender(const UserDatabase& user_database, const MovieDatabase& movie_database)
+    : m_user_database(&user_database), m_movie_database(&movie_database), m_neighbor_index(nullptr), m_similar_user_index(nullptr), m_embedding_index(nullptr), m_metrics(nullptr),
+    m_history_table_version(movie_database.get_version())
+{
+    // Look every movie ID the histories use up in the catalog once, instead of once per viewing
+    m_movie_of_history_id.resize(user_database.get_movie_id_count());
+    for (uint32_t number = 0; number < m_movie_of_history_id.size(); number++) {
+        Movie* movie = movie_database.get_movie_from_id(user_database.get_movie_id(number));
+        m_movie_of_history_id[number] = movie != nullptr ? movie->get_index() : -1;
+    }
+}
+
+Recommender::~Recommender() {}
 
-    // Use const_cast to remove the const qualifier from the input references
-    // and assign the resulting pointer to the member variable "m_movie_database"
-    m_movie_database = const_cast<MovieDatabase*>(&movie_database);
+// Appends the catalog index of every movie in the user's history that the catalog has, in
+// viewing order. IDs numbered after the table was built, or every ID once the catalog has
+// changed, are looked up by name.
+void Recommender::resolve_history(const User& user, vector<int>& watched) const {
+    bool use_table = m_movie_database->get_version() == m_history_table_version;
+    for (uint32_t number : user.get_watch_history_view()) {
+        int movie_index = -1;
+        if (use_table && number < m_movie_of_history_id.size()) {
+            movie_index = m_movie_of_history_id[number];
+        }
+        else {
+            Movie* movie = m_movie_database->get_movie_from_id(user.get_movie_ids()[number]);
+            movie_index = movie != nullptr ? movie->get_index() : -1;
+        }
+        if (movie_index >= 0) {
+            watched.push_back(movie_index);
+        }
+    }
+}
+
+void Recommender::set_neighbor_index(const NeighborIndex* neighbor_index) {
+    m_neighbor_index = neighbor_index;
+
+    // Capped neighbor rows give different scores, so cached rankings no longer apply
+    if (m_cache != nullptr) {
+        m_cache->clear();
+    }
+}
+
+void Recommender::set_similar_user_index(const MinHashIndex* similar_user_index) {
+    m_similar_user_index = similar_user_index;
+}
+
+void Recommender::set_embedding_index(const EmbeddingIndex* embedding_index) {
+    m_embedding_index = embedding_index;
+}
+
+void Recommender::set_metrics(Metrics* metrics) {
+    m_metrics = metrics;
+}
+
+void Recommender::set_cache_budget(size_t max_bytes) {
+    m_cache.reset(max_bytes > 0 ? new RecommendationCache(max_bytes) : nullptr);
+}
+
+RecommendationCache::Stats Recommender::get_cache_stats() const {
+    return m_cache != nullptr ? m_cache->get_stats() : RecommendationCache::Stats{};
+}
+
+// The versions a ranking for this user depends on
+RecommendationCache::Stamp Recommender::cache_stamp(const User& user) const {
+    return RecommendationCache::Stamp{ &user, user.get_history_version(), m_user_database->get_version(), m_movie_database->get_version() };
 }
 
 // Returns true if movie1 should be sorted before movie2 based on their scores, ratings, and names.
-bool Recommender::customCompare(const AuxiliaryMovieAndRank& movie1, const AuxiliaryMovieAndRank& movie2) {
+// Titles are only looked up when both the scores and the ratings are equal.
+bool Recommender::customCompare(const AuxiliaryMovieAndRank& movie1, const AuxiliaryMovieAndRank& movie2) const {
     if (movie1.m_movie_score > movie2.m_movie_score) {
         // If movie1 has a higher score than movie2, then it should be sorted before movie2
         return true;
@@ -43,15 +199,21 @@ bool Recommender::customCompare(const AuxiliaryMovieAndRank& movie1, const Auxil
             return false;
         }
         else { // Scores and ratings are equal
-            // Sort movies alphabetically by their names
-            return movie1.m_movie_name < movie2.m_movie_name;
+            // Sort movies alphabetically by their names, using the precomputed title order
+            span<const uint32_t> title_ranks = m_movie_database->get_title_ranks();
+            return title_ranks[movie1.m_movie_index] < title_ranks[movie2.m_movie_index];
         }
     }
 }
 
 // This function takes in a user's email and the number of recommended movies to output
 // It uses a compatibility score to recommend movies that are related to movies the user has watched before
-vector<MovieAndRank> Recommender::recommend_movies(const string& user_email, int movie_count) const {
+vector<MovieAndRank> Recommender::recommend_movies(const string& user_email, int movie_count, const RecommendationFilter& filter,
+    RecommendationEngine engine) const {
+    if (m_metrics != nullptr) {
+        m_metrics->requests.fetch_add(1, memory_order_relaxed);
+    }
+
     // If movie_count is not a positive integer, return an empty vector
     if (movie_count <= 0) {
         vector<MovieAndRank> empty_vector_recs;
@@ -60,107 +222,589 @@ vector<MovieAndRank> Recommender::recommend_movies(const string& user_email, int
 
     // Get the user from the user database using their email
     User* m_user = m_user_database->get_user_from_email(user_email);
+    if (m_user == nullptr) {
+        if (m_metrics != nullptr) {
+            m_metrics->unknown_users.fetch_add(1, memory_order_relaxed);
+        }
+        return vector<MovieAndRank>();
+    }
+
+    // Serve the ranking from the cache if it holds a current one that is long enough, and
+    // otherwise score and rank the catalog for this user in this thread's scratch arrays
+    // The cache is keyed by email alone, so filtered rankings, and those of the other engines,
+    // are neither looked up nor kept
+    bool filtered = !filter.is_empty();
+    bool use_cache = m_cache != nullptr && !filtered && engine == ATTRIBUTE_OVERLAP;
+    RecommendationCache::Ranking ranking;
+    bool cached = use_cache && m_cache->find(user_email, cache_stamp(*m_user), movie_count, ranking);
+    if (m_metrics != nullptr && use_cache) {
+        (cached ? m_metrics->cache_hits : m_metrics->cache_misses).fetch_add(1, memory_order_relaxed);
+    }
+    if (!cached) {
+        // A tracked user's kept scores only need the history changes applied before ranking
+        // (shared, so untrack_user cannot free them while they are in use here)
+        shared_ptr<TrackedScores> tracked;
+        {
+            scoped_lock lock(m_tracked_mutex);
+            unordered_map<string, shared_ptr<TrackedScores>>::const_iterator it = m_tracked.find(user_email);
+            if (it != m_tracked.end()) {
+                tracked = it->second;
+            }
+        }
+
+        ScoringScratch& scratch = thread_scratch();
+        if (engine == SIMILAR_USERS) {
+            rank_by_similar_users(*m_user, movie_count, filter, scratch);
+        }
+        else if (engine == EMBEDDING) {
+            rank_by_embedding(*m_user, movie_count, filter, scratch);
+        }
+        else if (tracked != nullptr) {
+            scoped_lock lock(tracked->lock);
+            update_tracked_scores(*m_user, *tracked);
+            if (filtered) {
+                build_exclusions(filter, tracked->watched, scratch);
+            }
+            rank_tracked_movies(*tracked, movie_count, filtered, scratch);
+        }
+        else {
+            rank_movies(*m_user, movie_count, filter, scratch);
+        }
+        for (int c = 0; c < scratch.top.size(); c++) {
+            ranking.emplace_back(scratch.top[c].m_movie_index, scratch.top[c].m_movie_score);
+        }
+        if (use_cache) {
+            m_cache->insert(user_email, cache_stamp(*m_user), movie_count, ranking);
+        }
+    }
+
+    // Create a vector of movie-and-rank objects with at most movie_count recommendations
+    vector<MovieAndRank> recommendations_vector;
+    recommendations_vector.reserve(ranking.size());
+    for (int c = 0; c < ranking.size(); c++) {
+        Movie* movie = m_movie_database->get_movie_at(ranking[c].first);
+        int compatibilityScore = ranking[c].second;
+
+        recommendations_vector.emplace_back(movie->get_id(), compatibilityScore);
+    }
+
+    return recommendations_vector;
+}
 
-    // Get a vector of movie IDs that the user has watched
-    vector<string> movies_watched_ids = m_user->get_watch_history();
+// Identifies the binary file format written by recommend_batch
+static const char BATCH_FILE_MAGIC[8] = { 'N', 'M', 'R', 'R', 'E', 'C', '0', '1' };
+
+// Number of users recommended for between two writes to the output file
+static const size_t BATCH_BLOCK_SIZE = 4096;
+
+// recommend_batch writes, with integers in the machine's byte order:
+//   char[8] "NMRREC01"
+//   uint32 number of movies in the catalog, uint32 movie_count, uint32 number of users
+//   for every movie index: uint8 ID length, ID bytes
+//   for every user, in the order given: uint16 email length, email bytes,
+//       uint16 result count, then that many (uint32 movie index, int32 score) pairs, best first
+bool Recommender::recommend_batch(const vector<string>& user_emails, int movie_count,
+    const string& output_filename, unsigned thread_count) const {
+    ofstream outfile(output_filename, ios::binary);
+    if (!outfile) {
+        return false;
+    }
+
+    // Header and the movie ID table, so results can refer to movies by index
+    uint32_t header[3] = { uint32_t(m_movie_database->get_movie_count()), uint32_t(max(movie_count, 0)), uint32_t(user_emails.size()) };
+    outfile.write(BATCH_FILE_MAGIC, sizeof(BATCH_FILE_MAGIC));
+    outfile.write(reinterpret_cast<const char*>(header), sizeof(header));
+    for (int m = 0; m < m_movie_database->get_movie_count(); m++) {
+        string_view id = m_movie_database->get_id_at(m);
+        uint8_t length = uint8_t(min(id.size(), size_t(UINT8_MAX)));
+        outfile.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        outfile.write(id.data(), length);
+    }
+
+    // Each worker ranks into its own thread_local scratch and copies the finalists into the
+    // user's slot in the current block; the block is then written in order
+    ThreadPool pool(thread_count);
+    vector<vector<pair<uint32_t, int32_t>>> block_results(min(BATCH_BLOCK_SIZE, user_emails.size()));
+    for (size_t block_start = 0; block_start < user_emails.size(); block_start += BATCH_BLOCK_SIZE) {
+        size_t block_size = min(BATCH_BLOCK_SIZE, user_emails.size() - block_start);
+
+        pool.parallel_for(block_size, [&](size_t slot, unsigned) {
+            vector<pair<uint32_t, int32_t>>& results = block_results[slot];
+            results.clear();
+
+            User* user = m_user_database->get_user_from_email(user_emails[block_start + slot]);
+            if (m_metrics != nullptr) {
+                m_metrics->requests.fetch_add(1, memory_order_relaxed);
+                m_metrics->unknown_users.fetch_add(user == nullptr, memory_order_relaxed);
+            }
+            if (user == nullptr || movie_count <= 0) {
+                return;
+            }
+
+            ScoringScratch& scratch = thread_scratch();
+            rank_movies(*user, movie_count, RecommendationFilter(), scratch);
+            for (int c = 0; c < scratch.top.size(); c++) {
+                results.emplace_back(scratch.top[c].m_movie_index, scratch.top[c].m_movie_score);
+            }
+        });
+
+        for (size_t slot = 0; slot < block_size; slot++) {
+            const string& email = user_emails[block_start + slot];
+            uint16_t email_length = uint16_t(min(email.size(), size_t(UINT16_MAX)));
+            uint16_t result_count = uint16_t(min(block_results[slot].size(), size_t(UINT16_MAX)));
+            outfile.write(reinterpret_cast<const char*>(&email_length), sizeof(email_length));
+            outfile.write(email.data(), email_length);
+            outfile.write(reinterpret_cast<const char*>(&result_count), sizeof(result_count));
+            outfile.write(reinterpret_cast<const char*>(block_results[slot].data()), result_count * sizeof(pair<uint32_t, int32_t>));
+        }
+    }
+
+    return bool(outfile);
+}
+
+// Scores every movie related to the user's watch history that passes the filter and leaves the
+// best movie_count of them in scratch.top, best first
+void Recommender::rank_movies(const User& user, int movie_count, const RecommendationFilter& filter, ScoringScratch& scratch) const {
+    // With metrics enabled, each stage's time is added up in stage_ns and recorded at the end,
+    // along with the number of index entries each fan-out walked
+    bool measure = m_metrics != nullptr;
+    uint64_t stage_ns[Metrics::STAGE_COUNT] = {};
+    uint64_t postings_touched[Metrics::POSTINGS_COUNT] = {};
+    chrono::steady_clock::time_point query_start = measure ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+    chrono::steady_clock::time_point phase_start = query_start;
+
+    // Grow the scratch arrays if the catalog is bigger than the last one this thread saw
+    if (scratch.scores.size() < m_movie_database->get_movie_count()) {
+        scratch.scores.resize(m_movie_database->get_movie_count(), 0);
+    }
+    if (scratch.candidate_slots.size() < m_movie_database->get_movie_count() + 1) {
+        scratch.candidate_slots.resize(m_movie_database->get_movie_count() + 1);
+    }
+    if (scratch.attribute_weights.size() < m_movie_database->get_incidence_row_count()) {
+        scratch.attribute_weights.resize(m_movie_database->get_incidence_row_count(), 0);
+    }
+    scratch.candidates.clear();
+    scratch.watched.clear();
+    int* scores = scratch.scores.data();
+    uint32_t* candidates = scratch.candidate_slots.data();
+    size_t candidate_count = 0;
+    const uint64_t* excluded = nullptr;
 
-    // Create a vector of movie objects for each watched movie ID
-    vector<Movie*> movies_watched_vector;
-    for (int a = 0; a < movies_watched_ids.size(); a++) {
-        Movie* tempMovie = m_movie_database->get_movie_from_id(movies_watched_ids[a]);
-        movies_watched_vector.push_back(tempMovie);
+    // Resolve each watched movie to its dense index in the catalog
+    resolve_history(user, scratch.watched);
+    if (measure) {
+        stage_ns[Metrics::RESOLVE_HISTORY] = lap_ns(phase_start);
     }
-    
-    // Create an unordered map to keep track of the compatibility score of movies
-    // Key: movie object pointer
-    // Value: compatibility score
-    unordered_map<Movie*, int> compatibility_map;
 
-    // For each movie the user has watched
-    for (int i = 0; i < movies_watched_vector.size(); i++) {
+    // A filtered query marks every movie it must not score, so the fan-outs below skip them
+    bool filtered = !filter.is_empty();
+    if (filtered) {
+        build_exclusions(filter, scratch.watched, scratch);
+        excluded = scratch.excluded.data();
+        if (measure) {
+            stage_ns[Metrics::BUILD_FILTER] = lap_ns(phase_start);
+        }
+    }
 
-        // Find all directors of the movie
-        vector<string> movie_directors_vector = movies_watched_vector[i]->get_directors();
+    // Each movie that gets points is appended to the candidates the first time, so its score can
+    // be reset later; the appends are branch-free (see add_weighted_row)
+    // With a neighbor index the director and actor points come from each watched movie's
+    // precomputed row, and when the genre posting lists would touch a good part of the catalog
+    // the genre points come from one pass of the bitmask kernel below instead
+    bool dense_genres = count_watched_genres(scratch);
+    int first_attribute = m_neighbor_index != nullptr ? MovieDatabase::GENRE : 0;
+    int end_attribute = dense_genres ? MovieDatabase::GENRE : MovieDatabase::ATTRIBUTE_COUNT;
+    if (m_neighbor_index != nullptr) {
+        for (int i = 0; i < scratch.watched.size(); i++) {
+            span<const uint32_t> neighbors = m_neighbor_index->get_neighbors(scratch.watched[i]);
+            span<const uint16_t> points = m_neighbor_index->get_points(scratch.watched[i]);
+            for (int n = 0; n < neighbors.size(); n++) {
+                int add = filtered && is_excluded(scratch.excluded, neighbors[n]) ? 0 : points[n];
+                int score = scores[neighbors[n]];
+                candidates[candidate_count] = neighbors[n];
+                candidate_count += (score == 0) & (add != 0);
+                scores[neighbors[n]] = score + add;
+            }
+            postings_touched[Metrics::NEIGHBOR_POSTINGS] += neighbors.size();
+        }
+        if (measure) {
+            stage_ns[Metrics::NEIGHBOR_FANOUT] += lap_ns(phase_start);
+        }
+    }
 
-        // For every director of the movie
-        for (int q = 0; q < movie_directors_vector.size(); q++) {
-            // Find all movies with that particular director
-            vector<Movie*> movies_with_director = m_movie_database->get_movies_with_director(movie_directors_vector[q]);
+    // For each of directors, actors and genres, fold the watch history into a weight per
+    // attribute (its points times the watched movies that have it), then add each weight to
+    // every movie with that attribute: one sparse matrix-vector product over the incidence
+    // matrix, walking each posting list once however many watched movies share it
+    for (int attribute = first_attribute; attribute < end_attribute; attribute++) {
+        MovieDatabase::Attribute kind = MovieDatabase::Attribute(attribute);
+        int points = ATTRIBUTE_POINTS[attribute];
+        uint32_t base = m_movie_database->get_attribute_base(kind);
 
-            // Add 20 points to their compatibility score and insert into the unordered map
-            for (int v = 0; v < movies_with_director.size(); v++) {
-                compatibility_map[movies_with_director[v]] += 20;
+        scratch.touched_attributes.clear();
+        for (int i = 0; i < scratch.watched.size(); i++) {
+            for (uint32_t attribute_id : m_movie_database->get_attribute_ids(kind, scratch.watched[i])) {
+                if (scratch.attribute_weights[base + attribute_id] == 0) {
+                    scratch.touched_attributes.push_back(base + attribute_id);
+                }
+                scratch.attribute_weights[base + attribute_id] += points;
             }
         }
+        for (uint32_t row : scratch.touched_attributes) {
+            span<const uint32_t> postings = m_movie_database->get_incidence_row(row);
+            int weight = scratch.attribute_weights[row];
+            scratch.attribute_weights[row] = 0;
+            candidate_count = filtered ? add_weighted_row(postings, weight, scores, candidates, candidate_count, excluded)
+                : add_weighted_row(postings, weight, scores, candidates, candidate_count);
+            postings_touched[Metrics::DIRECTOR_POSTINGS + attribute] += postings.size();
+        }
+        if (measure) {
+            stage_ns[Metrics::DIRECTOR_FANOUT + attribute] += lap_ns(phase_start);
+        }
+    }
 
-        // Find all actors of the movie
-        vector<string> movie_actors_vector = movies_watched_vector[i]->get_actors();
-        
-        // For every actor of the movie
-        for (int q = 0; q < movie_actors_vector.size(); q++) {
-            // Find all movies with that actor
-            vector<Movie*> movies_with_actor = m_movie_database->get_movies_with_actor(movie_actors_vector[q]);
+    if (dense_genres) {
+        // Each watched genre is worth GENRE_POINTS for every movie that has it, so a movie's genre
+        // points are the sum of the user's genre counts over the bits of its mask
+        span<const uint64_t> genre_masks = m_movie_database->get_genre_masks();
+        scratch.genre_affinity.resize(genre_masks.size());
+        compute_genre_affinity(genre_masks, scratch.genre_weights, scratch.genre_affinity.data());
+        for (int m = 0; m < genre_masks.size(); m++) {
+            int add = filtered && is_excluded(scratch.excluded, m) ? 0 : GENRE_POINTS * scratch.genre_affinity[m];
+            int score = scores[m];
+            candidates[candidate_count] = m;
+            candidate_count += (score == 0) & (add != 0);
+            scores[m] = score + add;
+        }
+        postings_touched[Metrics::GENRE_POSTINGS] += genre_masks.size();
+        if (measure) {
+            stage_ns[Metrics::GENRE_FANOUT] += lap_ns(phase_start);
+        }
+    }
+
+    // Zero out movies that the user has already watched so they are skipped below
+    for (int i = 0; i < scratch.watched.size(); i++) {
+        scratch.scores[scratch.watched[i]] = 0;
+    }
+    if (measure) {
+        stage_ns[Metrics::FILTER_WATCHED] = lap_ns(phase_start);
+    }
+
+    scratch.candidates.assign(candidates, candidates + candidate_count);
+    take_top_candidates(movie_count, scratch);
 
-            // Add 30 points to their compatibility score and insert into the unordered map if not already in
-            for (int v = 0; v < movies_with_actor.size(); v++) {
-                compatibility_map[movies_with_actor[v]] += 30;
+    if (measure) {
+        stage_ns[Metrics::RANK] = lap_ns(phase_start);
+        // Only the stages that ran: neighbor rows replace the director and actor fan-outs
+        for (int s = 0; s < Metrics::STAGE_COUNT; s++) {
+            bool ran = m_neighbor_index != nullptr ? s != Metrics::DIRECTOR_FANOUT && s != Metrics::ACTOR_FANOUT : s != Metrics::NEIGHBOR_FANOUT;
+            if (ran && (filtered || s != Metrics::BUILD_FILTER)) {
+                m_metrics->stage_latency[s].record(stage_ns[s]);
             }
         }
+        for (int p = 0; p < Metrics::POSTINGS_COUNT; p++) {
+            m_metrics->postings_touched[p].fetch_add(postings_touched[p], memory_order_relaxed);
+        }
+        m_metrics->query_latency.record(uint64_t(chrono::duration_cast<chrono::nanoseconds>(phase_start - query_start).count()));
+        m_metrics->candidate_count.record(scratch.candidates.size());
+        m_metrics->history_misses.fetch_add(user.get_watch_history_view().size() - scratch.watched.size(), memory_order_relaxed);
+    }
+}
 
-        // Find all genres of the movie
-        vector<string> movie_genres_vector = movies_watched_vector[i]->get_genres();
-        
-        // For each genre of the movie
-        for (int q = 0; q < movie_genres_vector.size(); q++) {
+// Scores every movie that users with similar watch histories have watched, and that passes the
+// filter, by the summed similarity of those users (see MinHashIndex), and leaves the best
+// movie_count of them in scratch.top, best first
+void Recommender::rank_by_similar_users(const User& user, int movie_count, const RecommendationFilter& filter, ScoringScratch& scratch) const {
+    bool measure = m_metrics != nullptr;
+    chrono::steady_clock::time_point query_start = measure ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
 
-            // find all movies with that genre
-            vector<Movie*> movies_with_genre = m_movie_database->get_movies_with_genre(movie_genres_vector[q]);
+    if (scratch.scores.size() < m_movie_database->get_movie_count()) {
+        scratch.scores.resize(m_movie_database->get_movie_count(), 0);
+    }
+    scratch.candidates.clear();
+    scratch.watched.clear();
+    scratch.top.clear();
+    if (m_similar_user_index == nullptr) {
+        return;
+    }
 
-            // add 1 point to their compatibility score and insert into the unordered map if not already in
-            for (int v = 0; v < movies_with_genre.size(); v++) {
-                compatibility_map[movies_with_genre[v]] += 1;
+    resolve_history(user, scratch.watched);
+    bool filtered = !filter.is_empty();
+    if (filtered) {
+        build_exclusions(filter, scratch.watched, scratch);
+    }
+
+    m_similar_user_index->find_similar_users(user, SIMILAR_USER_COUNT, scratch.similar_users);
+    for (const MinHashIndex::SimilarUser& similar : scratch.similar_users) {
+        int points = max(1, int(lround(similar.similarity * SIMILARITY_POINTS)));
+
+        // A movie earns a similar user's points once, however often they watched it
+        scratch.similar_watched.clear();
+        resolve_history(*similar.user, scratch.similar_watched);
+        sort(scratch.similar_watched.begin(), scratch.similar_watched.end());
+        scratch.similar_watched.erase(unique(scratch.similar_watched.begin(), scratch.similar_watched.end()), scratch.similar_watched.end());
+        for (int movie_index : scratch.similar_watched) {
+            if (filtered && is_excluded(scratch.excluded, movie_index)) {
+                continue;
+            }
+            if (scratch.scores[movie_index] == 0) {
+                scratch.candidates.push_back(movie_index);
             }
+            scratch.scores[movie_index] += points;
         }
     }
 
-    // Remove movies that the user has already watched from the compatibility map
-    for (unordered_map<Movie*, int>::iterator it = compatibility_map.begin(); it != compatibility_map.end(); ) {
-        if (find(movies_watched_vector.begin(), movies_watched_vector.end(), it->first) != movies_watched_vector.end()) {
-            it = compatibility_map.erase(it);
+    // Zero out movies that the user has already watched so they are skipped
+    for (int i = 0; i < scratch.watched.size(); i++) {
+        scratch.scores[scratch.watched[i]] = 0;
+    }
+    take_top_candidates(movie_count, scratch);
+
+    if (measure) {
+        m_metrics->query_latency.record(uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - query_start).count()));
+        m_metrics->candidate_count.record(scratch.candidates.size());
+    }
+}
+
+// Scores every movie that passes the filter by the dot product of its learned vector with the
+// user's (see EmbeddingIndex) and leaves the best movie_count of them in scratch.top, best first.
+// The index does the scoring and keeps the best movies itself, so scratch.scores is not used.
+void Recommender::rank_by_embedding(const User& user, int movie_count, const RecommendationFilter& filter, ScoringScratch& scratch) const {
+    bool measure = m_metrics != nullptr;
+    chrono::steady_clock::time_point query_start = measure ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+
+    scratch.watched.clear();
+    scratch.top.clear();
+    if (m_embedding_index == nullptr || m_embedding_index->get_movie_count() != m_movie_database->get_movie_count()) {
+        return;
+    }
+    resolve_history(user, scratch.watched);
+    if (scratch.watched.empty()) {
+        return; // nothing to learn the user's taste from
+    }
+
+    // The watched movies are always left out, so the exclusions are built even without a filter
+    build_exclusions(filter, scratch.watched, scratch);
+    m_embedding_index->fold_in(scratch.watched, scratch.user_vector);
+    m_embedding_index->find_top_movies(scratch.user_vector, size_t(movie_count), scratch.excluded, scratch.embedding_top);
+
+    // Rounding to whole points can tie movies the dot products told apart, so the results are
+    // ranked again with the usual tie-breaks
+    auto rankBefore = [this](const AuxiliaryMovieAndRank& movie1, const AuxiliaryMovieAndRank& movie2) {
+        return customCompare(movie1, movie2);
+    };
+    span<const float> ratings = m_movie_database->get_ratings();
+    for (const pair<uint32_t, float>& result : scratch.embedding_top) {
+        int points = int(lround(double(result.second) * EMBEDDING_POINTS));
+        offer_candidate(AuxiliaryMovieAndRank(result.first, points, ratings[result.first]), size_t(movie_count), scratch.top);
+    }
+    sort_heap(scratch.top.begin(), scratch.top.end(), rankBefore);
+
+    if (measure) {
+        m_metrics->query_latency.record(uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - query_start).count()));
+        m_metrics->candidate_count.record(scratch.embedding_top.size());
+    }
+}
+
+// Sets the bit in scratch.excluded of every movie a filtered query must skip: the ones outside the
+// year range, rated below the minimum, in an excluded genre or among the watched movies.
+// Years and ratings are read from the catalog's columns rather than from the Movie objects.
+void Recommender::build_exclusions(const RecommendationFilter& filter, span<const int> watched, ScoringScratch& scratch) const {
+    span<const uint16_t> years = m_movie_database->get_release_years();
+    span<const float> ratings = m_movie_database->get_ratings();
+    bool year_bounded = filter.min_release_year > 0 || filter.max_release_year > 0;
+    int min_year = max(filter.min_release_year, 1); // year 0 means the year is unknown
+    int max_year = filter.max_release_year > 0 ? filter.max_release_year : INT_MAX;
+    bool rating_bounded = filter.min_rating > 0;
+
+    scratch.excluded.assign((years.size() + 63) / 64, 0);
+    for (int m = 0; m < years.size(); m++) {
+        bool outside = (year_bounded && (years[m] < min_year || years[m] > max_year))
+            || (rating_bounded && ratings[m] < filter.min_rating);
+        scratch.excluded[m >> 6] |= uint64_t(outside) << (m & 63);
+    }
+    for (const string& genre : filter.excluded_genres) {
+        for (Movie* movie : m_movie_database->get_movies_with_genre_view(genre)) {
+            scratch.excluded[movie->get_index() >> 6] |= uint64_t(1) << (movie->get_index() & 63);
         }
-        else {
-            ++it;
+    }
+    for (int movie_index : watched) {
+        scratch.excluded[movie_index >> 6] |= uint64_t(1) << (movie_index & 63);
+    }
+}
+
+// Counts the genres of the watched movies into scratch.genre_weights and returns true if scoring
+// them with the bitmask kernel is cheaper than walking their posting lists, that is, if the lists
+// add up to more than a quarter of the catalog
+bool Recommender::count_watched_genres(ScoringScratch& scratch) const {
+    span<const uint64_t> genre_masks = m_movie_database->get_genre_masks();
+    if (genre_masks.empty()) {
+        return false;
+    }
+
+    scratch.genre_weights.assign(MAX_MASK_GENRES, 0);
+    size_t posting_total = 0;
+    for (int i = 0; i < scratch.watched.size(); i++) {
+        for (uint32_t genre_id : m_movie_database->get_attribute_ids(MovieDatabase::GENRE, scratch.watched[i])) {
+            // The fan-out walks each watched genre's posting list once, however often it is watched
+            if (scratch.genre_weights[genre_id]++ == 0) {
+                posting_total += m_movie_database->get_movie_indices_with(MovieDatabase::GENRE, genre_id).size();
+            }
         }
     }
+    return posting_total * 4 >= genre_masks.size();
+}
 
-    // Convert the filtered compatibility map into a vector of auxiliary movie-and-rank objects
-    vector<AuxiliaryMovieAndRank> auxiliary_vector;
-    for (unordered_map<Movie*, int>::iterator m = compatibility_map.begin(); m != compatibility_map.end(); m++) {
-        
-        string func_movie_id = (m->first)->get_id();
-        
-        float func_movie_rating = (m->first)->get_rating();
-        
-        string func_movie_name = (m->first)->get_title();
-        
-        int func_compatibility_score = m->second;
+// Adds a candidate to the bounded heap of the best keep movies, whose front is the worst one kept
+void Recommender::offer_candidate(const AuxiliaryMovieAndRank& candidate, size_t keep, vector<AuxiliaryMovieAndRank>& top) const {
+    auto rankBefore = [this](const AuxiliaryMovieAndRank& movie1, const AuxiliaryMovieAndRank& movie2) {
+        return customCompare(movie1, movie2);
+    };
 
-        AuxiliaryMovieAndRank funcMovieRank(func_movie_id, func_compatibility_score, func_movie_rating, func_movie_name);
-        auxiliary_vector.push_back(funcMovieRank);
+    if (top.size() < keep) {
+        // The heap is not full yet, so every candidate gets in
+        top.push_back(candidate);
+        push_heap(top.begin(), top.end(), rankBefore);
+    }
+    else if (customCompare(candidate, top.front())) {
+        // Better than the worst movie kept so far, so it replaces it
+        pop_heap(top.begin(), top.end(), rankBefore);
+        top.back() = candidate;
+        push_heap(top.begin(), top.end(), rankBefore);
     }
+}
 
-    // Sort the auxiliary vector by decreasing compatibility score and increasing movie ID
-    sort(auxiliary_vector.begin(), auxiliary_vector.end(), &customCompare);
+// Keeps the best movie_count candidates in scratch.top, best first, in a bounded heap whose front
+// is the worst one kept, resetting each score so the scratch array is all zeros for the next query.
+// Candidates whose score is back to zero (watched movies) are skipped.
+void Recommender::take_top_candidates(int movie_count, ScoringScratch& scratch) const {
+    // Heap order for the ranking stage: a movie ranked better sorts first
+    auto rankBefore = [this](const AuxiliaryMovieAndRank& movie1, const AuxiliaryMovieAndRank& movie2) {
+        return customCompare(movie1, movie2);
+    };
 
-    // Create a vector of movie-and-rank objects with at most movie_count recommendations
-    vector<MovieAndRank> recommendations_vector;
-    for (int c = 0; c < movie_count; c++) {
-        string movieID = auxiliary_vector[c].m_movie_id;
-        int compatibilityScore = auxiliary_vector[c].m_movie_score;
+    size_t keep = size_t(movie_count);
+    scratch.top.clear();
+    span<const float> ratings = m_movie_database->get_ratings();
+    for (int i = 0; i < scratch.candidates.size(); i++) {
+        uint32_t movie_index = scratch.candidates[i];
+        int func_compatibility_score = scratch.scores[movie_index];
+        scratch.scores[movie_index] = 0;
+        if (func_compatibility_score == 0) {
+            continue; // watched movie
+        }
+
+        float func_movie_rating = ratings[movie_index];
+        AuxiliaryMovieAndRank funcMovieRank(movie_index, func_compatibility_score, func_movie_rating);
 
-        MovieAndRank temp(movieID, compatibilityScore);
-        recommendations_vector.push_back(temp);
+        offer_candidate(funcMovieRank, keep, scratch.top);
     }
 
-    return recommendations_vector;
+    // Order the finalists from best to worst
+    sort_heap(scratch.top.begin(), scratch.top.end(), rankBefore);
+}
+
+void Recommender::track_user(const string& user_email) {
+    scoped_lock lock(m_tracked_mutex);
+    if (m_tracked.find(user_email) == m_tracked.end()) {
+        m_tracked.emplace(user_email, make_shared<TrackedScores>()); // scored on its first recommendation
+    }
+}
+
+void Recommender::untrack_user(const string& user_email) {
+    scoped_lock lock(m_tracked_mutex);
+    m_tracked.erase(user_email);
+}
+
+// Brings a tracked user's scores up to date with the watch history: only the viewings that were
+// added or removed since the last call are applied, unless a database or the neighbor index
+// changed, in which case the scores are rebuilt from the whole history
+void Recommender::update_tracked_scores(const User& user, TrackedScores& tracked) const {
+    RecommendationCache::Stamp stamp = cache_stamp(user);
+    if (tracked.stamp == stamp && tracked.neighbor_index == m_neighbor_index) {
+        return; // nothing changed
+    }
+
+    // The watched movies as sorted indices, so they can be compared with the last ones as multisets
+    vector<int> watched;
+    resolve_history(user, watched);
+    sort(watched.begin(), watched.end());
+
+    bool rebuild = tracked.stamp.user != stamp.user || tracked.stamp.user_database_version != stamp.user_database_version
+        || tracked.stamp.movie_database_version != stamp.movie_database_version || tracked.neighbor_index != m_neighbor_index;
+    if (rebuild) {
+        tracked.scores.assign(m_movie_database->get_movie_count(), 0);
+        tracked.candidates.clear();
+        tracked.is_candidate.assign(m_movie_database->get_movie_count(), false);
+        tracked.watch_counts.assign(m_movie_database->get_movie_count(), 0);
+        tracked.watched.clear();
+    }
+
+    vector<int> added, removed;
+    set_difference(watched.begin(), watched.end(), tracked.watched.begin(), tracked.watched.end(), back_inserter(added));
+    set_difference(tracked.watched.begin(), tracked.watched.end(), watched.begin(), watched.end(), back_inserter(removed));
+    for (int movie_index : removed) {
+        add_contributions(movie_index, -1, tracked);
+        tracked.watch_counts[movie_index]--;
+    }
+    for (int movie_index : added) {
+        add_contributions(movie_index, 1, tracked);
+        tracked.watch_counts[movie_index]++;
+    }
+
+    tracked.watched = move(watched);
+    tracked.stamp = stamp;
+    tracked.neighbor_index = m_neighbor_index;
+}
+
+// Adds (sign 1) or subtracts (sign -1) the points one viewing of a movie gives every movie that
+// shares a director, actor or genre with it, the same way rank_movies adds them
+void Recommender::add_contributions(int movie_index, int sign, TrackedScores& tracked) const {
+    auto addPoints = [&tracked](uint32_t other, int points) {
+        if (!tracked.is_candidate[other]) {
+            tracked.is_candidate[other] = true;
+            tracked.candidates.push_back(other);
+        }
+        tracked.scores[other] += points;
+    };
+
+    int first_attribute = m_neighbor_index != nullptr ? MovieDatabase::GENRE : 0;
+    if (m_neighbor_index != nullptr) {
+        span<const uint32_t> neighbors = m_neighbor_index->get_neighbors(movie_index);
+        span<const uint16_t> points = m_neighbor_index->get_points(movie_index);
+        for (int n = 0; n < neighbors.size(); n++) {
+            addPoints(neighbors[n], sign * points[n]);
+        }
+    }
+    for (int attribute = first_attribute; attribute < MovieDatabase::ATTRIBUTE_COUNT; attribute++) {
+        MovieDatabase::Attribute kind = MovieDatabase::Attribute(attribute);
+        for (uint32_t attribute_id : m_movie_database->get_attribute_ids(kind, movie_index)) {
+            for (uint32_t other : m_movie_database->get_movie_indices_with(kind, attribute_id)) {
+                addPoints(other, sign * ATTRIBUTE_POINTS[attribute]);
+            }
+        }
+    }
+}
+
+// Ranks a tracked user's kept scores into scratch.top, best first, skipping watched movies and,
+// if filtered, every movie marked in scratch.excluded (which includes the watched ones)
+void Recommender::rank_tracked_movies(const TrackedScores& tracked, int movie_count, bool filtered, ScoringScratch& scratch) const {
+    size_t keep = size_t(movie_count);
+    scratch.top.clear();
+    span<const float> ratings = m_movie_database->get_ratings();
+    for (uint32_t movie_index : tracked.candidates) {
+        int score = tracked.scores[movie_index];
+        if (score == 0) {
+            continue;
+        }
+        bool skipped = filtered ? is_excluded(scratch.excluded, movie_index) : tracked.watch_counts[movie_index] != 0;
+        if (skipped) {
+            continue;
+        }
+        offer_candidate(AuxiliaryMovieAndRank(movie_index, score, ratings[movie_index]), keep, scratch.top);
+    }
+
+    sort_heap(scratch.top.begin(), scratch.top.end(), [this](const AuxiliaryMovieAndRank& movie1, const AuxiliaryMovieAndRank& movie2) {
+        return customCompare(movie1, movie2);
+    });
 }
\ No newline at end of file
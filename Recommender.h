@@ -3,9 +3,41 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <span>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "RecommendationCache.h"
 
 class UserDatabase;
 class MovieDatabase;
+class NeighborIndex;
+class MinHashIndex;
+class EmbeddingIndex;
+class Metrics;
+class User;
+
+// Points a movie earns for each director, actor and genre it shares with a watched movie
+const int DIRECTOR_POINTS = 20;
+const int ACTOR_POINTS = 30;
+const int GENRE_POINTS = 1;
+
+// Points a movie earns under SIMILAR_USERS from each similar user who watched it, times that
+// user's similarity (1 for the very same movies)
+const int SIMILARITY_POINTS = 100;
+
+// Points a movie earns under EMBEDDING per unit of the user's predicted preference for it
+const int EMBEDDING_POINTS = 1000;
+
+// How recommend_movies scores the catalog for a user
+enum RecommendationEngine
+{
+    ATTRIBUTE_OVERLAP, // points for every director, actor and genre shared with a watched movie
+    SIMILAR_USERS, // points for every user with a similar history who watched the movie
+    EMBEDDING, // points for the dot product of the user's and the movie's learned vectors
+};
 
 struct MovieAndRank
 {
@@ -16,30 +48,115 @@ struct MovieAndRank
     int compatibility_score;
 };
 
+// Restricts which movies a recommendation may contain. Movies that fail the filter are dropped
+// before scoring, so a filtered request still returns up to movie_count movies that pass it.
+// The default filter lets every movie through.
+struct RecommendationFilter
+{
+    int min_release_year = 0; // 0 for no lower bound
+    int max_release_year = 0; // 0 for no upper bound; movies without a numeric year fail either bound
+    float min_rating = 0; // movies rated below it are left out; 0 for no bound
+    std::vector<std::string> excluded_genres; // movies with any of these genres are left out
+
+    bool is_empty() const;
+};
+
 class Recommender
 {
 public:
+    // The databases must outlive the recommender. To replace them while serving, publish a new
+    // Catalog with its own recommender instead (see Catalog.h).
     Recommender(const UserDatabase& user_database,
         const MovieDatabase& movie_database);
-    //~Recommender();
+    ~Recommender();
+    // Recommends the best movie_count movies for the user among the ones that pass the filter,
+    // scored by the given engine. Only unfiltered ATTRIBUTE_OVERLAP requests use the result
+    // cache, and only ATTRIBUTE_OVERLAP ones use tracked scores.
     std::vector<MovieAndRank> recommend_movies(const std::string& user_email,
-        int movie_count) const;
+        int movie_count, const RecommendationFilter& filter = RecommendationFilter(),
+        RecommendationEngine engine = ATTRIBUTE_OVERLAP) const;
+
+    // Recommends movie_count movies for every email on a pool of thread_count worker threads
+    // (0 means one per hardware thread) and streams the results to a binary file that a
+    // serving tier can load; the layout is described above recommend_batch in Recommender.cpp.
+    // Unknown emails get an empty result. Returns false if the file cannot be written.
+    bool recommend_batch(const std::vector<std::string>& user_emails, int movie_count,
+        const std::string& output_filename, unsigned thread_count = 0) const;
+
+    // Use precomputed director/actor neighbor rows (built from the same movie database) instead
+    // of walking the posting lists for every watched movie; pass nullptr to go back
+    void set_neighbor_index(const NeighborIndex* neighbor_index);
+
+    // Answer SIMILAR_USERS requests from this index, built from the same user database; without
+    // one they get no recommendations
+    void set_similar_user_index(const MinHashIndex* similar_user_index);
+
+    // Answer EMBEDDING requests from this index, trained on the same movie database; without
+    // one they get no recommendations
+    void set_embedding_index(const EmbeddingIndex* embedding_index);
+
+    // Record per-stage latencies and work counters of every recommendation into metrics,
+    // which may be shared with other recommenders and threads; pass nullptr to stop
+    void set_metrics(Metrics* metrics);
+
+    // Keep the rankings of recently served users in an LRU cache of about max_bytes, so repeat
+    // requests skip scoring; 0 turns the cache off (the default). Only recommend_movies uses it.
+    void set_cache_budget(size_t max_bytes);
+    RecommendationCache::Stats get_cache_stats() const; // all zero while the cache is off
+
+    // Keep a score for every movie for this user between calls. Later calls bring the scores up
+    // to date by adding or subtracting only the movies that entered or left the watch history
+    // (see UserDatabase::add_watch), so a heavy user's next recommendation is a top-K over the
+    // kept scores instead of a fan-out over the whole history. Costs about 13 bytes per catalog
+    // movie per tracked user. Both may be called from any thread; the history changes they pick
+    // up may not (see UserDatabase::add_watch).
+    void track_user(const std::string& user_email);
+    void untrack_user(const std::string& user_email);
 
 private:
-    UserDatabase* m_user_database;
-    MovieDatabase* m_movie_database;
+    const UserDatabase* m_user_database;
+    const MovieDatabase* m_movie_database;
+    const NeighborIndex* m_neighbor_index;
+    const MinHashIndex* m_similar_user_index;
+    const EmbeddingIndex* m_embedding_index;
+    Metrics* m_metrics;
+    std::unique_ptr<RecommendationCache> m_cache;
+
+    // The catalog index of each movie ID number of the user database (-1 if the catalog does
+    // not have the movie), as of the catalog version it was built against
+    std::vector<int> m_movie_of_history_id;
+    uint64_t m_history_table_version;
 
+    struct TrackedScores; // scores kept for a tracked user, defined in Recommender.cpp
+    mutable std::mutex m_tracked_mutex; // guards the map; each entry has its own lock
+    std::unordered_map<std::string, std::shared_ptr<TrackedScores>> m_tracked;
+
+    // A scored candidate in the ranking stage; the title is looked up only to break ties
     struct AuxiliaryMovieAndRank 
     {
-        AuxiliaryMovieAndRank(std::string movie_id, int movie_score, float movie_rating, const std::string movie_name) : m_movie_id(movie_id), m_movie_score(movie_score), m_movie_name(movie_name), m_movie_rating(movie_rating) {}
+        AuxiliaryMovieAndRank(uint32_t movie_index, int movie_score, float movie_rating) : m_movie_index(movie_index), m_movie_score(movie_score), m_movie_rating(movie_rating) {}
 
-        std::string m_movie_id;
+        uint32_t m_movie_index;
         int m_movie_score;
         float m_movie_rating;
-        std::string m_movie_name;
     };
 
-    static bool customCompare(const AuxiliaryMovieAndRank& Movie1, const AuxiliaryMovieAndRank& Movie2);
+    struct ScoringScratch; // per-thread working memory, defined in Recommender.cpp
+    static ScoringScratch& thread_scratch();
+    void resolve_history(const User& user, std::vector<int>& watched) const;
+    void rank_movies(const User& user, int movie_count, const RecommendationFilter& filter, ScoringScratch& scratch) const;
+    void rank_by_similar_users(const User& user, int movie_count, const RecommendationFilter& filter, ScoringScratch& scratch) const;
+    void rank_by_embedding(const User& user, int movie_count, const RecommendationFilter& filter, ScoringScratch& scratch) const;
+    void take_top_candidates(int movie_count, ScoringScratch& scratch) const;
+    void build_exclusions(const RecommendationFilter& filter, std::span<const int> watched, ScoringScratch& scratch) const;
+    bool count_watched_genres(ScoringScratch& scratch) const;
+    void update_tracked_scores(const User& user, TrackedScores& tracked) const;
+    void add_contributions(int movie_index, int sign, TrackedScores& tracked) const;
+    void rank_tracked_movies(const TrackedScores& tracked, int movie_count, bool filtered, ScoringScratch& scratch) const;
+    void offer_candidate(const AuxiliaryMovieAndRank& candidate, size_t keep, std::vector<AuxiliaryMovieAndRank>& top) const;
+    RecommendationCache::Stamp cache_stamp(const User& user) const;
+
+    bool customCompare(const AuxiliaryMovieAndRank& Movie1, const AuxiliaryMovieAndRank& Movie2) const;
 };
 
 #endif // RECOMMENDER_INCLUDED
\ No newline at end of file
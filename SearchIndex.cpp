@@ -0,0 +1,252 @@
+#include "SearchIndex.h"
+#include "MovieDatabase.h"
+#include "Movie.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+using namespace std;
+
+// At most this many keys per wanted result are read from the prefix range, so a one letter
+// query does not walk a large part of the dictionary
+static const size_t PREFIX_SCAN_PER_RESULT = 16;
+static const size_t MIN_PREFIX_SCAN = 256;
+
+// Longer queries are only matched exactly or as prefixes
+static const size_t MAX_FUZZY_QUERY_BYTES = 128;
+
+// The clock is read once per this many keys scanned or compared
+static const size_t BUDGET_CHECK_INTERVAL = 256;
+
+// Per-thread working memory for search: trigrams the query shares with each key, indexed by
+// key, all zero between calls
+struct SearchScratch
+{
+    vector<uint16_t> shared;
+    vector<uint32_t> candidates; // keys with a nonzero count
+    vector<int> rows[2]; // edit distance rows
+};
+
+static SearchScratch& search_scratch() {
+    static thread_local SearchScratch scratch;
+    return scratch;
+}
+
+static string fold_case(string_view text) {
+    string folded(text);
+    for (char& c : folded) {
+        if (c >= 'A' && c <= 'Z') {
+            c = char(c - 'A' + 'a');
+        }
+    }
+    return folded;
+}
+
+// The distinct trigrams of text padded with a space at both ends, sorted
+static vector<uint32_t> trigrams_of(string_view text) {
+    string padded = " " + string(text) + " ";
+    vector<uint32_t> trigrams;
+    for (size_t i = 0; i + 3 <= padded.size(); i++) {
+        trigrams.push_back(uint32_t(uint8_t(padded[i])) << 16 | uint32_t(uint8_t(padded[i + 1])) << 8 | uint8_t(padded[i + 2]));
+    }
+    sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+    return trigrams;
+}
+
+// The Levenshtein distance between a and b if it is at most limit, otherwise limit + 1
+static int bounded_edit_distance(string_view a, string_view b, int limit, vector<int> (&rows)[2]) {
+    if (int(max(a.size(), b.size()) - min(a.size(), b.size())) > limit) {
+        return limit + 1;
+    }
+    rows[0].resize(b.size() + 1);
+    rows[1].resize(b.size() + 1);
+    for (int j = 0; j <= b.size(); j++) {
+        rows[0][j] = j;
+    }
+    for (int i = 1; i <= a.size(); i++) {
+        vector<int>& previous = rows[(i - 1) & 1];
+        vector<int>& current = rows[i & 1];
+        current[0] = i;
+        int row_min = i;
+        for (int j = 1; j <= b.size(); j++) {
+            int substitute = previous[j - 1] + (a[i - 1] != b[j - 1]);
+            current[j] = min({ substitute, previous[j] + 1, current[j - 1] + 1 });
+            row_min = min(row_min, current[j]);
+        }
+        if (row_min > limit) {
+            return limit + 1; // every later row is at least as large
+        }
+    }
+    return min(rows[a.size() & 1][b.size()], limit + 1);
+}
+
+SearchIndex::SearchIndex() {}
+
+void SearchIndex::add_key(string_view text, Field field, uint32_t reference, uint32_t movie_count) {
+    m_keys.push_back(Key{ fold_case(text), field, reference, movie_count, text });
+}
+
+void SearchIndex::build(const MovieDatabase& movie_database) {
+    m_keys.clear();
+    for (int m = 0; m < movie_database.get_movie_count(); m++) {
+        Movie* movie = movie_database.get_movie_at(m);
+        add_key(movie->get_title_view(), TITLE, uint32_t(m), 1);
+        add_key(movie->get_id_view(), ID, uint32_t(m), 1);
+    }
+    const Field attribute_fields[MovieDatabase::ATTRIBUTE_COUNT] = { DIRECTOR, ACTOR, GENRE };
+    for (int attribute = 0; attribute < MovieDatabase::ATTRIBUTE_COUNT; attribute++) {
+        MovieDatabase::Attribute kind = MovieDatabase::Attribute(attribute);
+        for (uint32_t a = 0; a < movie_database.get_attribute_count(kind); a++) {
+            add_key(movie_database.get_attribute_name(kind, a), attribute_fields[attribute], a,
+                uint32_t(movie_database.get_movie_indices_with(kind, a).size()));
+        }
+    }
+
+    sort(m_keys.begin(), m_keys.end(), [](const Key& key1, const Key& key2) {
+        return key1.folded < key2.folded;
+    });
+    build_trigrams();
+}
+
+// Fills the trigram -> key posting lists. IDs are left out: a typo in an ID names another movie.
+void SearchIndex::build_trigrams() {
+    vector<pair<uint32_t, uint32_t>> pairs; // (trigram, key)
+    for (uint32_t k = 0; k < m_keys.size(); k++) {
+        if (m_keys[k].field != ID) {
+            for (uint32_t trigram : trigrams_of(m_keys[k].folded)) {
+                pairs.emplace_back(trigram, k);
+            }
+        }
+    }
+    sort(pairs.begin(), pairs.end());
+
+    m_trigrams.clear();
+    m_trigram_offsets.clear();
+    m_postings.clear();
+    m_postings.reserve(pairs.size());
+    for (int p = 0; p < pairs.size(); p++) {
+        if (m_trigrams.empty() || m_trigrams.back() != pairs[p].first) {
+            m_trigrams.push_back(pairs[p].first);
+            m_trigram_offsets.push_back(uint32_t(m_postings.size()));
+        }
+        m_postings.push_back(pairs[p].second);
+    }
+    m_trigram_offsets.push_back(uint32_t(m_postings.size()));
+}
+
+size_t SearchIndex::get_key_count() const {
+    return m_keys.size();
+}
+
+SearchIndex::Result SearchIndex::make_result(uint32_t key, Match match, int distance) const {
+    return Result{ m_keys[key].field, match, distance, m_keys[key].reference, m_keys[key].movie_count, m_keys[key].text };
+}
+
+vector<SearchIndex::Result> SearchIndex::search(string_view query, size_t max_results,
+    chrono::nanoseconds budget, bool* incomplete) const {
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + budget;
+    bool exceeded = false;
+    bool truncated = false; // the prefix range went on past scan_limit
+    string folded = fold_case(query);
+    vector<Result> results;
+    if (folded.empty() || max_results == 0) {
+        return results;
+    }
+
+    // Exact and prefix matches are one contiguous range of the sorted keys, the exact ones first
+    vector<Key>::const_iterator key = lower_bound(m_keys.begin(), m_keys.end(), folded, [](const Key& key, const string& text) {
+        return key.folded < text;
+    });
+    size_t scan_limit = max(MIN_PREFIX_SCAN, max_results * PREFIX_SCAN_PER_RESULT);
+    for (size_t scanned = 0; key != m_keys.end() && key->folded.starts_with(folded); ++key, scanned++) {
+        if (scanned == scan_limit) {
+            truncated = true;
+            break;
+        }
+        if (scanned % BUDGET_CHECK_INTERVAL == BUDGET_CHECK_INTERVAL - 1 && chrono::steady_clock::now() > deadline) {
+            exceeded = true;
+            break;
+        }
+        results.push_back(make_result(uint32_t(key - m_keys.begin()), key->folded.size() == folded.size() ? EXACT : PREFIX, 0));
+    }
+
+    // Fuzzy matches: count the query's trigrams each key shares, shortest posting lists first.
+    // A key within max_distance edits shares at least threshold of them, so it must be in one of
+    // the first (trigram count - threshold + 1) lists; the longer lists after those only add to
+    // keys that are already candidates.
+    int max_distance = folded.size() >= 6 ? 2 : (folded.size() >= 4 ? 1 : 0);
+    if (max_distance > 0 && folded.size() <= MAX_FUZZY_QUERY_BYTES && !exceeded) {
+        vector<uint32_t> query_trigrams = trigrams_of(folded);
+        vector<pair<uint32_t, uint32_t>> lists; // posting range of each query trigram in the index
+        for (uint32_t trigram : query_trigrams) {
+            vector<uint32_t>::const_iterator found = lower_bound(m_trigrams.begin(), m_trigrams.end(), trigram);
+            if (found != m_trigrams.end() && *found == trigram) {
+                size_t t = size_t(found - m_trigrams.begin());
+                lists.emplace_back(m_trigram_offsets[t], m_trigram_offsets[t + 1]);
+            }
+        }
+        sort(lists.begin(), lists.end(), [](const pair<uint32_t, uint32_t>& list1, const pair<uint32_t, uint32_t>& list2) {
+            return list1.second - list1.first < list2.second - list2.first;
+        });
+        int threshold = max(1, int(query_trigrams.size()) - 3 * max_distance);
+        int seeding_lists = int(lists.size()) - threshold + 1; // trigrams no key has count against it
+
+        SearchScratch& scratch = search_scratch();
+        scratch.shared.resize(m_keys.size(), 0);
+        scratch.candidates.clear();
+        for (int l = 0; l < lists.size() && !exceeded; l++) {
+            for (uint32_t p = lists[l].first; p < lists[l].second; p++) {
+                uint32_t k = m_postings[p];
+                if (scratch.shared[k] == 0) {
+                    if (l >= seeding_lists) {
+                        continue;
+                    }
+                    scratch.candidates.push_back(k);
+                }
+                scratch.shared[k]++;
+            }
+            exceeded = chrono::steady_clock::now() > deadline;
+        }
+
+        for (size_t c = 0; c < scratch.candidates.size(); c++) {
+            uint32_t k = scratch.candidates[c];
+            bool qualifies = scratch.shared[k] >= threshold && !m_keys[k].folded.starts_with(folded);
+            scratch.shared[k] = 0;
+            if (!qualifies || exceeded) {
+                continue; // keep resetting the counts after the budget is spent
+            }
+            int distance = bounded_edit_distance(folded, m_keys[k].folded, max_distance, scratch.rows);
+            if (distance <= max_distance) {
+                results.push_back(make_result(k, FUZZY, distance));
+            }
+            if (c % BUDGET_CHECK_INTERVAL == 0) {
+                exceeded = chrono::steady_clock::now() > deadline;
+            }
+        }
+    }
+
+    // Best first: exact, then prefix, then the closest fuzzy matches; among equals, keys with
+    // more movies first, then alphabetically
+    size_t keep = min(max_results, results.size());
+    partial_sort(results.begin(), results.begin() + keep, results.end(), [](const Result& result1, const Result& result2) {
+        if (result1.match != result2.match) {
+            return result1.match < result2.match;
+        }
+        if (result1.distance != result2.distance) {
+            return result1.distance < result2.distance;
+        }
+        if (result1.movie_count != result2.movie_count) {
+            return result1.movie_count > result2.movie_count;
+        }
+        return result1.text < result2.text;
+    });
+    results.resize(keep);
+
+    if (incomplete != nullptr) {
+        *incomplete = exceeded || truncated;
+    }
+    return results;
+}
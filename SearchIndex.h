@@ -0,0 +1,69 @@
+#ifndef SEARCHINDEX_INCLUDED
+#define SEARCHINDEX_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+class MovieDatabase;
+
+// Search over every movie title, ID, director, actor and genre of a MovieDatabase, ignoring
+// case. The keys are kept in one sorted array, so the keys starting with a prefix are one
+// binary search and a range scan. A trigram index (every three consecutive bytes of a key,
+// padded with a space at both ends) finds the keys within a small edit distance of a query
+// without comparing it to every key: a key that is d edits away shares all but at most 3d of
+// the query's trigrams, so only keys that share enough of them are compared.
+class SearchIndex
+{
+public:
+    enum Field { TITLE, ID, DIRECTOR, ACTOR, GENRE, FIELD_COUNT };
+    enum Match { EXACT, PREFIX, FUZZY }; // best first
+
+    struct Result
+    {
+        Field field;
+        Match match;
+        int distance; // edits between the query and the key; 0 unless match is FUZZY
+        uint32_t reference; // the movie index for TITLE and ID, otherwise the attribute id
+        uint32_t movie_count; // movies with the key
+        std::string_view text; // the key as written in the database
+    };
+
+    SearchIndex();
+
+    // Builds the index from the database, which must outlive it
+    void build(const MovieDatabase& movie_database);
+    size_t get_key_count() const;
+
+    // Returns at most max_results keys that are the query, start with it or are a few edits
+    // away from it (one edit for queries of 4 or 5 bytes, two for longer ones), best first: by
+    // match, distance, then keys with more movies first. Search stops looking for more keys
+    // once budget has passed, and only ranks the first few hundred prefix matches in key order;
+    // either way it sets incomplete if it is given, since better keys may have been left out.
+    std::vector<Result> search(std::string_view query, size_t max_results,
+        std::chrono::nanoseconds budget = std::chrono::milliseconds(2), bool* incomplete = nullptr) const;
+
+private:
+    struct Key
+    {
+        std::string folded; // lower case
+        Field field;
+        uint32_t reference;
+        uint32_t movie_count;
+        std::string_view text;
+    };
+
+    void add_key(std::string_view text, Field field, uint32_t reference, uint32_t movie_count);
+    void build_trigrams();
+    Result make_result(uint32_t key, Match match, int distance) const;
+
+    std::vector<Key> m_keys; // sorted by folded text
+    std::vector<uint32_t> m_trigrams; // every distinct trigram, sorted
+    std::vector<uint32_t> m_trigram_offsets; // keys of m_trigrams[t] are m_postings[offsets[t], offsets[t + 1])
+    std::vector<uint32_t> m_postings;
+};
+
+#endif // SEARCHINDEX_INCLUDED
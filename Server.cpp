@@ -0,0 +1,582 @@
+#include "Server.h"
+#include "Catalog.h"
+#include "User.h"
+#include "Movie.h"
+#include "Metrics.h"
+#include "Json.h"
+#include "TextLoader.h"
+#include "SocketUtil.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <span>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace std;
+
+// Largest count a recommend request may ask for, and the most keys a search returns
+static const int MAX_RECOMMENDATIONS = 1000;
+static const int MAX_SEARCH_RESULTS = 1000;
+static const int DEFAULT_SEARCH_RESULTS = 20;
+
+// Largest release year and rating a recommend request may filter on (ratings run from 0 to 5)
+static const int MAX_FILTER_YEAR = 9999;
+static const float MAX_FILTER_RATING = 5;
+
+// How long a search request may look for matches
+static const chrono::microseconds SEARCH_BUDGET(2000);
+
+#ifdef __linux__
+
+// A client may not send a line longer than this; the connection is closed after an error reply
+static const size_t MAX_REQUEST_BYTES = 1 << 16;
+
+// Answers buffered before they are sent mid-batch
+static const size_t MAX_PENDING_OUTPUT = 1 << 18;
+
+// Reads one wakeup may make before the connection goes back to the end of the epoll ready
+// list, so a client that never stops pipelining cannot keep a worker from everyone else
+static const int MAX_READS_PER_WAKEUP = 16;
+
+// A client that stops reading its answers holds its worker for at most this long
+static const int SEND_TIMEOUT_SECONDS = 5;
+
+// epoll user data of the listening socket and the stop eventfd; connections use their address
+static char LISTENER_TAG;
+static char STOP_TAG;
+
+struct Server::Connection
+{
+    explicit Connection(int fd) : fd(fd) {}
+
+    int fd;
+    string input; // received bytes that do not yet form a complete line
+    string output; // answers not yet sent
+};
+
+Server::Server(const RequestHandler& handler)
+    : m_handler(handler),
+    m_listen_fd(-1), m_epoll_fd(-1), m_stop_fd(-1), m_port(0) {}
+
+Server::~Server() {
+    stop();
+}
+
+bool Server::listen_tcp(uint16_t port) {
+    if (m_listen_fd >= 0) {
+        return false;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0
+        || getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        close(fd);
+        return false;
+    }
+
+    m_listen_fd = fd;
+    m_port = ntohs(address.sin_port);
+    return true;
+}
+
+bool Server::listen_unix(const string& path) {
+    sockaddr_un address = {};
+    if (m_listen_fd >= 0 || path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    unlink(path.c_str()); // left behind by a server that did not shut down cleanly
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return false;
+    }
+
+    m_listen_fd = fd;
+    m_unix_path = path;
+    return true;
+}
+
+uint16_t Server::get_port() const {
+    return m_port;
+}
+
+bool Server::start(unsigned thread_count) {
+    if (m_listen_fd < 0 || !m_workers.empty()) {
+        return false;
+    }
+    if (thread_count == 0) {
+        thread_count = max(1u, thread::hardware_concurrency());
+    }
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_epoll_fd < 0 || m_stop_fd < 0) {
+        return false;
+    }
+
+    // The stop eventfd is level triggered, so once written it wakes every worker; the listener
+    // is one-shot like the connections, so only one worker at a time accepts
+    epoll_event stop_event = {};
+    stop_event.events = EPOLLIN;
+    stop_event.data.ptr = &STOP_TAG;
+    epoll_event listen_event = {};
+    listen_event.events = EPOLLIN | EPOLLONESHOT;
+    listen_event.data.ptr = &LISTENER_TAG;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_stop_fd, &stop_event) != 0
+        || epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &listen_event) != 0) {
+        return false;
+    }
+
+    for (unsigned w = 0; w < thread_count; w++) {
+        m_workers.emplace_back(&Server::worker_main, this);
+    }
+    return true;
+}
+
+void Server::stop() {
+    if (m_stop_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t written = write(m_stop_fd, &one, sizeof(one));
+        (void)written;
+    }
+    for (int w = 0; w < m_workers.size(); w++) {
+        m_workers[w].join();
+    }
+    m_workers.clear();
+
+    // No worker is left to touch the connections
+    for (Connection* connection : m_connections) {
+        close(connection->fd);
+        delete connection;
+    }
+    m_connections.clear();
+
+    for (int* fd : { &m_listen_fd, &m_epoll_fd, &m_stop_fd }) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+    if (!m_unix_path.empty()) {
+        unlink(m_unix_path.c_str());
+        m_unix_path.clear();
+    }
+    m_port = 0;
+}
+
+void Server::worker_main() {
+    while (true) {
+        epoll_event event;
+        int ready = epoll_wait(m_epoll_fd, &event, 1, -1);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0 || event.data.ptr == &STOP_TAG) {
+            return;
+        }
+
+        if (event.data.ptr == &LISTENER_TAG) {
+            accept_connections();
+            epoll_event listen_event = {};
+            listen_event.events = EPOLLIN | EPOLLONESHOT;
+            listen_event.data.ptr = &LISTENER_TAG;
+            epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, m_listen_fd, &listen_event);
+            continue;
+        }
+
+        // Only this worker holds the connection until it is re-armed
+        Connection* connection = static_cast<Connection*>(event.data.ptr);
+        if ((event.events & (EPOLLERR | EPOLLHUP)) != 0 && (event.events & EPOLLIN) == 0) {
+            close_connection(connection);
+        }
+        else if (!serve_connection(*connection)) {
+            close_connection(connection);
+        }
+        else {
+            epoll_event connection_event = {};
+            connection_event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+            connection_event.data.ptr = connection;
+            if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, connection->fd, &connection_event) != 0) {
+                close_connection(connection);
+            }
+        }
+    }
+}
+
+// Accepts every pending connection and adds it to the epoll set, one-shot
+void Server::accept_connections() {
+    while (true) {
+        int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            return; // EAGAIN once the backlog is empty
+        }
+
+        // Reads never block (MSG_DONTWAIT) but writes do, up to the send timeout
+        timeval timeout = { SEND_TIMEOUT_SECONDS, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        Connection* connection = new Connection(fd);
+        {
+            scoped_lock lock(m_connections_mutex);
+            m_connections.insert(connection);
+        }
+        epoll_event connection_event = {};
+        connection_event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        connection_event.data.ptr = connection;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &connection_event) != 0) {
+            close_connection(connection);
+        }
+    }
+}
+
+// Reads what the client has sent so far, up to MAX_READS_PER_WAKEUP chunks, and answers every
+// complete line in order; the rest waits for the next wakeup. Returns false once the
+// connection should be closed.
+bool Server::serve_connection(Connection& connection) {
+    char buffer[READ_CHUNK_BYTES];
+    bool open = true;
+    for (int reads = 0; open && reads < MAX_READS_PER_WAKEUP; reads++) {
+        ssize_t received = recv(connection.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break; // answered everything sent so far
+        }
+        if (received <= 0) {
+            open = false; // end of stream or error: answer what is complete, then close
+        }
+        else {
+            connection.input.append(buffer, size_t(received));
+        }
+
+        size_t line_start = 0;
+        size_t newline;
+        while ((newline = connection.input.find('\n', line_start)) != string::npos) {
+            string_view line(connection.input.data() + line_start, newline - line_start);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            if (!line.empty()) {
+                m_handler.handle_request(line, connection.output);
+            }
+            line_start = newline + 1;
+        }
+        connection.input.erase(0, line_start);
+
+        if (connection.input.size() > MAX_REQUEST_BYTES) {
+            connection.output += "{\"ok\":false,\"error\":\"request line too long\"}\n";
+            open = false;
+        }
+        if (connection.output.size() >= MAX_PENDING_OUTPUT) {
+            if (!send_all(connection.fd, connection.output)) {
+                return false;
+            }
+            connection.output.clear();
+        }
+    }
+
+    bool sent = send_all(connection.fd, connection.output);
+    connection.output.clear();
+    return open && sent;
+}
+
+void Server::close_connection(Connection* connection) {
+    {
+        scoped_lock lock(m_connections_mutex);
+        m_connections.erase(connection);
+    }
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, connection->fd, nullptr);
+    close(connection->fd);
+    delete connection;
+}
+
+#else // the server needs epoll; elsewhere it never listens, so serve mode reports the failure
+
+Server::Server(const RequestHandler& handler)
+    : m_handler(handler),
+    m_listen_fd(-1), m_epoll_fd(-1), m_stop_fd(-1), m_port(0) {}
+
+Server::~Server() {}
+
+bool Server::listen_tcp(uint16_t) {
+    return false;
+}
+
+bool Server::listen_unix(const string&) {
+    return false;
+}
+
+uint16_t Server::get_port() const {
+    return m_port;
+}
+
+bool Server::start(unsigned) {
+    return false;
+}
+
+void Server::stop() {}
+
+#endif // __linux__
+
+CatalogHandler::CatalogHandler(const LiveCatalog& catalog) : m_catalog(catalog), m_metrics(nullptr) {}
+
+void CatalogHandler::set_metrics(Metrics* metrics) {
+    m_metrics = metrics;
+}
+
+void CatalogHandler::handle_request(string_view line, string& response) const {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    JsonObject request;
+    string error;
+    if (!request.parse(line, error)) {
+        if (m_metrics != nullptr) {
+            m_metrics->bad_requests.fetch_add(1, memory_order_relaxed);
+        }
+        append_json_error(JsonObject(), error, response);
+        return;
+    }
+
+    // The generation current now stays valid until this request is answered, even if a reload
+    // publishes a new one meanwhile
+    LiveCatalog::ReadGuard catalog = m_catalog.read();
+    const string* op = request.get_string("op");
+    Metrics::ServedOp kind;
+    if (op != nullptr && *op == "user") {
+        kind = Metrics::SERVED_USER;
+        answer_user(*catalog, request, response);
+    }
+    else if (op != nullptr && *op == "lookup") {
+        kind = Metrics::SERVED_LOOKUP;
+        answer_lookup(*catalog, request, response);
+    }
+    else if (op != nullptr && *op == "search") {
+        kind = Metrics::SERVED_SEARCH;
+        answer_search(*catalog, request, response);
+    }
+    else if (op != nullptr && *op == "recommend") {
+        kind = Metrics::SERVED_RECOMMEND;
+        answer_recommend(*catalog, request, response);
+    }
+    else {
+        if (m_metrics != nullptr) {
+            m_metrics->bad_requests.fetch_add(1, memory_order_relaxed);
+        }
+        append_json_error(request, op == nullptr ? "missing op" : "unknown op", response);
+        return;
+    }
+
+    if (m_metrics != nullptr) {
+        m_metrics->served_latency[kind].record(lap_ns(start));
+    }
+}
+
+void CatalogHandler::answer_user(const Catalog& catalog, const JsonObject& request, string& response) const {
+    const string* email = request.get_string("email");
+    if (email == nullptr) {
+        append_json_error(request, "missing email", response);
+        return;
+    }
+    User* user = catalog.users.get_user_from_email(*email);
+    if (user == nullptr) {
+        append_json_error(request, "no user has that email address", response);
+        return;
+    }
+
+    begin_json_response(request, response);
+    response += "\"ok\":true,\"name\":";
+    append_json_string(response, user->get_full_name_view());
+    response += ",\"watched\":";
+    response += to_string(user->get_watch_history_view().size());
+    response += "}\n";
+}
+
+// Appends one {"field":...,"id":...,"title":...} match, preceded by a comma unless it is the first
+static void append_match(const char* field, const Movie& movie, bool& first, string& response) {
+    if (!first) {
+        response += ',';
+    }
+    first = false;
+    response += "{\"field\":\"";
+    response += field;
+    response += "\",\"id\":";
+    append_json_string(response, movie.get_id_view());
+    response += ",\"title\":";
+    append_json_string(response, movie.get_title_view());
+    response += '}';
+}
+
+// Finds the attribute as a movie ID, director, actor or genre, exactly as written
+void CatalogHandler::answer_lookup(const Catalog& catalog, const JsonObject& request, string& response) const {
+    const string* attribute = request.get_string("attribute");
+    if (attribute == nullptr) {
+        append_json_error(request, "missing attribute", response);
+        return;
+    }
+
+    begin_json_response(request, response);
+    response += "\"ok\":true,\"matches\":[";
+    bool first = true;
+    Movie* movie = catalog.movies.get_movie_from_id(*attribute);
+    if (movie != nullptr) {
+        append_match("id", *movie, first, response);
+    }
+    const pair<const char*, span<Movie* const>> fields[] = {
+        { "director", catalog.movies.get_movies_with_director_view(*attribute) },
+        { "actor", catalog.movies.get_movies_with_actor_view(*attribute) },
+        { "genre", catalog.movies.get_movies_with_genre_view(*attribute) },
+    };
+    for (const pair<const char*, span<Movie* const>>& field : fields) {
+        for (Movie* match : field.second) {
+            append_match(field.first, *match, first, response);
+        }
+    }
+    response += "]}\n";
+}
+
+void CatalogHandler::answer_search(const Catalog& catalog, const JsonObject& request, string& response) const {
+    const string* query = request.get_string("query");
+    double limit = DEFAULT_SEARCH_RESULTS;
+    if (query == nullptr) {
+        append_json_error(request, "missing query", response);
+        return;
+    }
+    if (request.has("limit") && (!request.get_number("limit", limit) || limit < 1 || limit > MAX_SEARCH_RESULTS)) {
+        append_json_error(request, "limit must be a number from 1 to " + to_string(MAX_SEARCH_RESULTS), response);
+        return;
+    }
+
+    bool incomplete = false;
+    vector<SearchIndex::Result> results = catalog.search.search(*query, size_t(limit), SEARCH_BUDGET, &incomplete);
+    const char* const field_names[SearchIndex::FIELD_COUNT] = { "title", "id", "director", "actor", "genre" };
+    const char* const match_names[] = { "exact", "prefix", "fuzzy" };
+
+    begin_json_response(request, response);
+    response += incomplete ? "\"ok\":true,\"complete\":false,\"keys\":[" : "\"ok\":true,\"complete\":true,\"keys\":[";
+    for (int r = 0; r < results.size(); r++) {
+        response += r == 0 ? "{\"field\":\"" : ",{\"field\":\"";
+        response += field_names[results[r].field];
+        response += "\",\"match\":\"";
+        response += match_names[results[r].match];
+        response += "\",\"text\":";
+        append_json_string(response, results[r].text);
+        if (results[r].field == SearchIndex::TITLE || results[r].field == SearchIndex::ID) {
+            response += ",\"id\":";
+            append_json_string(response, catalog.movies.get_movie_at(int(results[r].reference))->get_id_view());
+        }
+        response += ",\"movies\":";
+        response += to_string(results[r].movie_count);
+        response += '}';
+    }
+    response += "]}\n";
+}
+
+void CatalogHandler::answer_recommend(const Catalog& catalog, const JsonObject& request, string& response) const {
+    const string* email = request.get_string("email");
+    double count = 10;
+    if (email == nullptr) {
+        append_json_error(request, "missing email", response);
+        return;
+    }
+    if (request.has("count") && (!request.get_number("count", count) || count < 1 || count > MAX_RECOMMENDATIONS)) {
+        append_json_error(request, "count must be a number from 1 to " + to_string(MAX_RECOMMENDATIONS), response);
+        return;
+    }
+
+    // A year of 0 or a rating of 0 leaves that bound off, as in RecommendationFilter
+    RecommendationFilter filter;
+    double value;
+    for (const char* key : { "min_year", "max_year" }) {
+        if (request.has(key) && (!request.get_number(key, value) || value < 0 || value > MAX_FILTER_YEAR)) {
+            append_json_error(request, string(key) + " must be a number from 0 to " + to_string(MAX_FILTER_YEAR), response);
+            return;
+        }
+    }
+    if (request.has("min_rating") && (!request.get_number("min_rating", value) || value < 0 || value > MAX_FILTER_RATING)) {
+        append_json_error(request, "min_rating must be a number from 0 to " + to_string(int(MAX_FILTER_RATING)), response);
+        return;
+    }
+    if (request.get_number("min_year", value)) {
+        filter.min_release_year = int(value);
+    }
+    if (request.get_number("max_year", value)) {
+        filter.max_release_year = int(value);
+    }
+    if (request.get_number("min_rating", value)) {
+        filter.min_rating = float(value);
+    }
+    if (const vector<string>* genres = request.get_string_array("exclude_genres")) {
+        filter.excluded_genres = *genres;
+    }
+
+    RecommendationEngine engine = ATTRIBUTE_OVERLAP;
+    if (const string* name = request.get_string("engine")) {
+        if (*name == "similar_users") {
+            engine = SIMILAR_USERS;
+        }
+        else if (*name == "embedding") {
+            engine = EMBEDDING;
+            if (!catalog.use_embeddings) {
+                append_json_error(request, "the embedding engine needs movie vectors, which were not loaded", response);
+                return;
+            }
+        }
+        else if (*name != "attributes") {
+            append_json_error(request, "engine must be \"attributes\", \"similar_users\" or \"embedding\"", response);
+            return;
+        }
+    }
+
+    vector<MovieAndRank> recommendations = catalog.recommender->recommend_movies(*email, int(count), filter, engine);
+    if (recommendations.empty() && catalog.users.get_user_from_email(*email) == nullptr) {
+        append_json_error(request, "no user has that email address", response);
+        return;
+    }
+
+    begin_json_response(request, response);
+    response += "\"ok\":true,\"movies\":[";
+    for (int i = 0; i < recommendations.size(); i++) {
+        Movie* movie = catalog.movies.get_movie_from_id(recommendations[i].movie_id);
+        response += i == 0 ? "{\"id\":" : ",{\"id\":";
+        append_json_string(response, recommendations[i].movie_id);
+        response += ",\"title\":";
+        append_json_string(response, movie != nullptr ? movie->get_title_view() : string_view());
+        response += ",\"score\":";
+        response += to_string(recommendations[i].compatibility_score);
+        response += '}';
+    }
+    response += "]}\n";
+}
@@ -0,0 +1,116 @@
+#ifndef SERVER_INCLUDED
+#define SERVER_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <unordered_set>
+#include <cstdint>
+#include "Catalog.h"
+
+class Metrics;
+class JsonObject;
+
+// Answers the requests a Server receives. Called from every worker thread at once.
+class RequestHandler
+{
+public:
+    virtual ~RequestHandler() {}
+    // Answers one request line, appending the response line (with its newline) to response
+    virtual void handle_request(std::string_view line, std::string& response) const = 0;
+};
+
+// Answers requests from the catalog of this process. Each request is one JSON object on one
+// line and gets one line back:
+//   {"op":"user","email":"..."}
+//       -> {"ok":true,"name":"..."}
+//   {"op":"lookup","attribute":"..."}
+//       -> {"ok":true,"matches":[{"field":"id|director|actor|genre","id":"...","title":"..."},...]}
+//   {"op":"search","query":"...","limit":20}
+//       -> {"ok":true,"complete":true,"keys":[{"field":"title|id|director|actor|genre",
+//           "match":"exact|prefix|fuzzy","text":"...","movies":3},...]} (see SearchIndex;
+//           "complete" is false if the search ran out of time or more keys start with the query
+//           than it ranks, titles and IDs carry the movie "id")
+//   {"op":"recommend","email":"...","count":10}
+//       with optional "min_year", "max_year", "min_rating" and "exclude_genres":[...] (see
+//       RecommendationFilter), and "engine":"attributes|similar_users|embedding" (see
+//       RecommendationEngine)
+//       -> {"ok":true,"movies":[{"id":"...","title":"...","score":123},...]}
+// A request may carry an "id" of any type, which is copied into its response. Failed requests
+// get {"ok":false,"error":"..."}.
+//
+// Every request reads the catalog generation that is current when it starts, without locking,
+// so a reload published meanwhile only affects the requests after it.
+class CatalogHandler : public RequestHandler
+{
+public:
+    // The catalog must outlive the handler
+    explicit CatalogHandler(const LiveCatalog& catalog);
+
+    // Record the time taken by every request into metrics; pass nullptr to stop
+    void set_metrics(Metrics* metrics);
+
+    void handle_request(std::string_view line, std::string& response) const override;
+
+private:
+    void answer_user(const Catalog& catalog, const JsonObject& request, std::string& response) const;
+    void answer_lookup(const Catalog& catalog, const JsonObject& request, std::string& response) const;
+    void answer_search(const Catalog& catalog, const JsonObject& request, std::string& response) const;
+    void answer_recommend(const Catalog& catalog, const JsonObject& request, std::string& response) const;
+
+    const LiveCatalog& m_catalog;
+    Metrics* m_metrics;
+};
+
+// Serves line-delimited requests over a localhost TCP port or a Unix socket from a fixed set
+// of worker threads. Every line is answered by the handler with one line, in the order the
+// requests were sent, so a client may pipeline as many as it likes.
+//
+// The workers share one epoll set. A connection is armed one-shot, so only one worker handles
+// it at a time: that worker reads what the client has sent (at most about 1 MiB per turn, so a
+// client that keeps pipelining takes turns with the others), answers every complete line in
+// order and sends all the answers in one write before re-arming it. The server needs Linux;
+// on other platforms listen_tcp and listen_unix always return false.
+class Server
+{
+public:
+    // The handler must outlive the server
+    explicit Server(const RequestHandler& handler);
+    ~Server(); // stops the server
+
+    // Listen on 127.0.0.1 (port 0 picks a free port, see get_port) or on a Unix socket at path,
+    // replacing any stale socket file there. Call one of them before start; false on failure.
+    bool listen_tcp(uint16_t port);
+    bool listen_unix(const std::string& path);
+    uint16_t get_port() const; // the TCP port listened on, or 0
+
+    // Starts thread_count workers (0 means one per hardware thread) and returns; false if the
+    // server is not listening or is already running
+    bool start(unsigned thread_count = 0);
+    // Stops the workers, closes every connection and stops listening
+    void stop();
+
+private:
+    struct Connection; // defined in Server.cpp
+
+    void worker_main();
+    void accept_connections();
+    bool serve_connection(Connection& connection);
+    void close_connection(Connection* connection);
+
+    const RequestHandler& m_handler;
+
+    int m_listen_fd;
+    int m_epoll_fd;
+    int m_stop_fd; // an eventfd that wakes every worker when written
+    uint16_t m_port;
+    std::string m_unix_path;
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_connections_mutex; // guards m_connections
+    std::unordered_set<Connection*> m_connections; // open connections, closed by stop()
+};
+
+#endif // SERVER_INCLUDED
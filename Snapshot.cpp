@@ -0,0 +1,259 @@
+#include "Snapshot.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace std;
+
+static const char SNAPSHOT_MAGIC[8] = { 'N', 'M', 'R', 'S', 'N', 'A', 'P', '\0' };
+
+// Section id of the string pool, which every snapshot has
+static const uint32_t POOL_SECTION = 0;
+
+// Sections start on cache line boundaries so arrays of any element type are aligned
+static const uint64_t SECTION_ALIGNMENT = 64;
+
+MappedFile::MappedFile() : m_data(nullptr), m_size(0) {}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept : m_data(other.m_data), m_size(other.m_size) {
+    other.m_data = nullptr;
+    other.m_size = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        close();
+        swap(m_data, other.m_data);
+        swap(m_size, other.m_size);
+    }
+    return *this;
+}
+
+bool MappedFile::open(const string& filename) {
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return false;
+    }
+    if (info.st_size == 0) {
+        ::close(fd);
+        return true; // an empty file has nothing to map
+    }
+
+    // The mapping keeps the file alive, so the descriptor can be closed right away
+    void* mapping = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    m_data = static_cast<const char*>(mapping);
+    m_size = size_t(info.st_size);
+    return true;
+}
+
+void MappedFile::close() {
+    if (m_data != nullptr) {
+        munmap(const_cast<char*>(m_data), m_size);
+        m_data = nullptr;
+        m_size = 0;
+    }
+}
+
+const char* MappedFile::data() const {
+    return m_data;
+}
+
+size_t MappedFile::size() const {
+    return m_size;
+}
+
+bool read_snapshot_source(const string& filename, SnapshotSource& source) {
+    error_code error;
+    uintmax_t size = filesystem::file_size(filename, error);
+    if (error) {
+        return false;
+    }
+    filesystem::file_time_type modified = filesystem::last_write_time(filename, error);
+    if (error) {
+        return false;
+    }
+    source.size = uint64_t(size);
+    source.modified = int64_t(modified.time_since_epoch().count());
+    return true;
+}
+
+SnapshotWriter::SnapshotWriter(SnapshotKind kind, const SnapshotSource& source) : m_kind(kind), m_source(source) {}
+
+StringRef SnapshotWriter::add_string(string_view value) {
+    unordered_map<string, StringRef>::iterator it = m_pooled.find(string(value));
+    if (it != m_pooled.end()) {
+        return it->second;
+    }
+
+    StringRef ref = { uint32_t(m_pool.size()), uint32_t(value.size()) };
+    m_pool.insert(m_pool.end(), value.begin(), value.end());
+    m_pooled.emplace(string(value), ref);
+    return ref;
+}
+
+bool SnapshotWriter::write(const string& filename) const {
+    // Lay the sections out after the header and section table, the pool first
+    vector<const vector<char>*> contents;
+    vector<SnapshotSection> table;
+    contents.push_back(&m_pool);
+    table.push_back(SnapshotSection{ POOL_SECTION, 1, 0, m_pool.size() });
+    for (int s = 0; s < m_sections.size(); s++) {
+        contents.push_back(&m_sections[s].bytes);
+        table.push_back(SnapshotSection{ m_sections[s].id, m_sections[s].element_size, 0, m_sections[s].bytes.size() });
+    }
+
+    uint64_t offset = sizeof(SnapshotHeader) + table.size() * sizeof(SnapshotSection);
+    for (int s = 0; s < table.size(); s++) {
+        offset = (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+        table[s].offset = offset;
+        offset += table[s].size;
+    }
+
+    ofstream outfile(filename, ios::binary | ios::trunc);
+    if (!outfile) {
+        return false;
+    }
+
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.kind = m_kind;
+    header.section_count = uint32_t(table.size());
+    header.source = m_source;
+    outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    outfile.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(SnapshotSection));
+
+    // Pad up to each section's offset, then write its bytes
+    uint64_t written = sizeof(SnapshotHeader) + table.size() * sizeof(SnapshotSection);
+    const char padding[SECTION_ALIGNMENT] = {};
+    for (int s = 0; s < table.size(); s++) {
+        outfile.write(padding, table[s].offset - written);
+        outfile.write(contents[s]->data(), contents[s]->size());
+        written = table[s].offset + table[s].size;
+    }
+    return bool(outfile);
+}
+
+bool SnapshotReader::open(const string& filename, SnapshotKind kind, const string& source_filename) {
+    close();
+    if (!m_file.open(filename) || m_file.size() < sizeof(SnapshotHeader)) {
+        close();
+        return false;
+    }
+
+    // Check that this is a snapshot of the right kind, version and byte order
+    const SnapshotHeader* header = reinterpret_cast<const SnapshotHeader*>(m_file.data());
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->version != SNAPSHOT_VERSION
+        || header->byte_order != SNAPSHOT_BYTE_ORDER || header->kind != uint32_t(kind)
+        || (m_file.size() - sizeof(SnapshotHeader)) / sizeof(SnapshotSection) < header->section_count) {
+        close();
+        return false;
+    }
+
+    // A snapshot of an older version of its text file would serve stale data
+    SnapshotSource source;
+    if (!source_filename.empty() && read_snapshot_source(source_filename, source)
+        && (source.size != header->source.size || source.modified != header->source.modified)) {
+        close();
+        return false;
+    }
+
+    // Every section has to lie inside the file
+    m_sections = span<const SnapshotSection>(reinterpret_cast<const SnapshotSection*>(m_file.data() + sizeof(SnapshotHeader)), header->section_count);
+    for (int s = 0; s < m_sections.size(); s++) {
+        if (m_sections[s].offset > m_file.size() || m_sections[s].size > m_file.size() - m_sections[s].offset
+            || m_sections[s].offset % SECTION_ALIGNMENT != 0) {
+            close();
+            return false;
+        }
+    }
+
+    m_pool = section<char>(POOL_SECTION);
+    return true;
+}
+
+void SnapshotReader::close() {
+    m_sections = span<const SnapshotSection>();
+    m_pool = span<const char>();
+    m_file.close();
+}
+
+bool SnapshotReader::is_open() const {
+    return m_file.data() != nullptr;
+}
+
+string_view SnapshotReader::get_string(StringRef ref) const {
+    if (ref.offset > m_pool.size() || ref.length > m_pool.size() - ref.offset) {
+        return string_view();
+    }
+    return string_view(m_pool.data() + ref.offset, ref.length);
+}
+
+span<const char> SnapshotReader::get_pool() const {
+    return m_pool;
+}
+
+const SnapshotSection* SnapshotReader::find_section(uint32_t id) const {
+    for (int s = 0; s < m_sections.size(); s++) {
+        if (m_sections[s].id == id) {
+            return &m_sections[s];
+        }
+    }
+    return nullptr;
+}
+
+bool all_below(span<const uint32_t> values, size_t limit) {
+    for (uint32_t value : values) {
+        if (value >= limit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool valid_offsets(span<const uint32_t> offsets, size_t total) {
+    if (offsets.empty() || offsets.front() != 0 || offsets.back() != total) {
+        return false;
+    }
+    for (int i = 1; i < offsets.size(); i++) {
+        if (offsets[i] < offsets[i - 1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool valid_strings(span<const StringRef> refs, size_t pool_size) {
+    for (StringRef ref : refs) {
+        if (ref.offset > pool_size || ref.length > pool_size - ref.offset) {
+            return false;
+        }
+    }
+    return true;
+}
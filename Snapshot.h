@@ -0,0 +1,160 @@
+#ifndef SNAPSHOT_INCLUDED
+#define SNAPSHOT_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+// A read-only memory mapping of a whole file. The pages are shared with every other process
+// that maps the same file, and only the ones actually touched are read from disk.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& filename);
+    void close();
+
+    const char* data() const;
+    size_t size() const;
+
+private:
+    const char* m_data;
+    size_t m_size;
+};
+
+// Binary snapshots hold a database as flat arrays ("sections") that can be used straight from
+// a MappedFile. Layout, with integers in the machine's byte order:
+//   SnapshotHeader
+//   SnapshotSection[section_count]
+//   section contents, each starting on a 64-byte boundary
+// Strings are stored once each in a pool section and referred to by StringRef.
+const uint32_t SNAPSHOT_VERSION = 5;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304; // reads differently on a machine of the other endianness
+
+// What a snapshot holds, so a movie snapshot cannot be opened as a user snapshot
+enum SnapshotKind { SNAPSHOT_MOVIES = 1, SNAPSHOT_USERS = 2 };
+
+// The size and modification time of the text file a snapshot was compiled from, so a snapshot
+// can be refused once its source has changed
+struct SnapshotSource
+{
+    uint64_t size = 0;
+    int64_t modified = 0; // in the file clock's ticks
+};
+
+// Reads the size and modification time of a file; false if it does not exist
+bool read_snapshot_source(const std::string& filename, SnapshotSource& source);
+
+struct SnapshotHeader
+{
+    char magic[8]; // "NMRSNAP\0"
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t kind;
+    uint32_t section_count;
+    SnapshotSource source;
+};
+
+struct SnapshotSection
+{
+    uint32_t id;
+    uint32_t element_size;
+    uint64_t offset; // from the start of the file
+    uint64_t size; // in bytes
+};
+
+struct StringRef
+{
+    uint32_t offset; // into the string pool
+    uint32_t length;
+};
+
+// Builds a snapshot in memory and writes it out
+class SnapshotWriter
+{
+public:
+    // source is that of the text file the database was loaded from, as it was when loaded
+    SnapshotWriter(SnapshotKind kind, const SnapshotSource& source);
+
+    // Adds a string to the pool; equal strings are stored only once
+    StringRef add_string(std::string_view value);
+
+    // Adds a section holding a copy of the given array
+    template <typename T>
+    void add_section(uint32_t id, std::span<const T> values) {
+        const char* bytes = reinterpret_cast<const char*>(values.data());
+        m_sections.push_back(Section{ id, uint32_t(sizeof(T)), std::vector<char>(bytes, bytes + values.size_bytes()) });
+    }
+
+    bool write(const std::string& filename) const;
+
+private:
+    struct Section
+    {
+        uint32_t id;
+        uint32_t element_size;
+        std::vector<char> bytes;
+    };
+
+    SnapshotKind m_kind;
+    SnapshotSource m_source;
+    std::vector<char> m_pool;
+    std::unordered_map<std::string, StringRef> m_pooled;
+    std::vector<Section> m_sections;
+};
+
+// Maps a snapshot and hands out its sections as spans over the mapping
+class SnapshotReader
+{
+public:
+    // Returns false if the file is missing, truncated, of another kind, or of another version,
+    // or if source_filename names a file that has changed since the snapshot was compiled from it
+    bool open(const std::string& filename, SnapshotKind kind, const std::string& source_filename = std::string());
+    void close();
+    bool is_open() const;
+
+    // Returns the section as an array of T, or an empty span if it is missing or malformed
+    template <typename T>
+    std::span<const T> section(uint32_t id) const {
+        const SnapshotSection* found = find_section(id);
+        if (found == nullptr || found->element_size != sizeof(T) || found->size % sizeof(T) != 0) {
+            return std::span<const T>();
+        }
+        return std::span<const T>(reinterpret_cast<const T*>(m_file.data() + found->offset), found->size / sizeof(T));
+    }
+
+    // Returns the pooled string, or an empty string if the reference is out of range
+    std::string_view get_string(StringRef ref) const;
+    // The whole string pool, for columns of StringRef checked with valid_strings() and then
+    // read in place
+    std::span<const char> get_pool() const;
+
+private:
+    const SnapshotSection* find_section(uint32_t id) const;
+
+    MappedFile m_file;
+    std::span<const SnapshotSection> m_sections;
+    std::span<const char> m_pool;
+};
+
+// Checks for arrays read from a snapshot, so a damaged file is rejected instead of indexing
+// out of bounds later
+// Returns true if every value in the array is less than limit
+bool all_below(std::span<const uint32_t> values, size_t limit);
+// Returns true if offsets is a valid CSR offset array over total values: starting at 0,
+// never decreasing, and ending at total
+bool valid_offsets(std::span<const uint32_t> offsets, size_t total);
+// Returns true if every reference lies inside a string pool of pool_size bytes
+bool valid_strings(std::span<const StringRef> refs, size_t pool_size);
+
+#endif // SNAPSHOT_INCLUDED
@@ -0,0 +1,26 @@
+#include "SocketUtil.h"
+#include <string_view>
+#include <cerrno>
+#include <sys/socket.h>
+using namespace std;
+
+bool send_all(int fd, string_view data) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0; // macOS has no MSG_NOSIGNAL, only the per-socket option
+    int no_sigpipe = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+    while (!data.empty()) {
+        ssize_t sent = send(fd, data.data(), data.size(), flags);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data.remove_prefix(size_t(sent));
+    }
+    return true;
+}
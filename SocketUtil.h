@@ -0,0 +1,14 @@
+#ifndef SOCKETUTIL_INCLUDED
+#define SOCKETUTIL_INCLUDED
+
+#include <string_view>
+#include <cstddef>
+
+// Bytes read from a socket at a time by the server and the coordinator
+const size_t READ_CHUNK_BYTES = 1 << 16;
+
+// Sends all of data on a blocking (or send-timeout) socket, retrying after signals. Returns false
+// if the peer is gone or stopped reading; a closed peer never raises SIGPIPE.
+bool send_all(int fd, std::string_view data);
+
+#endif // SOCKETUTIL_INCLUDED
@@ -0,0 +1,182 @@
+#include "TextLoader.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <algorithm>
+using namespace std;
+
+RecordReader::RecordReader(string_view text) : m_text(text), m_position(0), m_line_count(0) {}
+
+bool RecordReader::next_line(string_view& line) {
+    if (m_position >= m_text.size()) {
+        return false;
+    }
+
+    size_t end = m_text.find('\n', m_position);
+    if (end == string_view::npos) {
+        end = m_text.size(); // last line without a line break
+    }
+    line = m_text.substr(m_position, end - m_position);
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+
+    m_position = end + 1;
+    m_line_count++;
+    return true;
+}
+
+bool RecordReader::next_record(vector<string_view>& lines, size_t& first_line) {
+    lines.clear();
+
+    // Skip the blank lines before the record
+    string_view line;
+    do {
+        if (!next_line(line)) {
+            return false;
+        }
+    } while (line.empty());
+    first_line = m_line_count;
+
+    // The record runs up to the next blank line or the end of the text
+    do {
+        lines.push_back(line);
+    } while (next_line(line) && !line.empty());
+    return true;
+}
+
+bool RecordReader::next_record(size_t line_count, vector<string_view>& lines, size_t& first_line) {
+    lines.clear();
+
+    // Skip the blank lines before the record
+    string_view line;
+    do {
+        if (!next_line(line)) {
+            return false;
+        }
+    } while (line.empty());
+    first_line = m_line_count;
+
+    // Take the lines by position, blank or not
+    lines.push_back(line);
+    while (lines.size() < line_count && next_line(line)) {
+        lines.push_back(line);
+    }
+
+    // Step over the blank line after the record, but not over the start of the next one
+    size_t position = m_position;
+    size_t line_number = m_line_count;
+    if (next_line(line) && !line.empty()) {
+        m_position = position;
+        m_line_count = line_number;
+    }
+    return true;
+}
+
+size_t RecordReader::get_line_count() const {
+    return m_line_count;
+}
+
+size_t RecordReader::get_position() const {
+    return m_position;
+}
+
+// Returns the position just after the first blank line at or after position, or the end
+static size_t next_record_boundary(string_view text, size_t position) {
+    // Move to the start of the next line unless we are already at one
+    if (position > 0 && text[position - 1] != '\n') {
+        position = text.find('\n', position);
+        if (position == string_view::npos) {
+            return text.size();
+        }
+        position++;
+    }
+
+    while (position < text.size()) {
+        size_t end = text.find('\n', position);
+        if (end == string_view::npos) {
+            return text.size();
+        }
+        if (end == position || (end == position + 1 && text[position] == '\r')) {
+            return end + 1; // blank line
+        }
+        position = end + 1;
+    }
+    return text.size();
+}
+
+// Returns the position just after the first fixed-length record that ends at or after target,
+// reading records from position, which must be at the start of one, or the end
+static size_t next_fixed_record_boundary(RecordReader& reader, size_t record_line_count, size_t target, size_t end) {
+    vector<string_view> lines;
+    size_t first_line;
+    while (reader.get_position() < min(target, end) && reader.next_record(record_line_count, lines, first_line)) {}
+    return min(reader.get_position(), end);
+}
+
+vector<string_view> split_into_record_chunks(string_view text, size_t chunk_count, size_t record_line_count) {
+    vector<string_view> chunks;
+    if (chunk_count == 0) {
+        chunk_count = 1;
+    }
+
+    if (record_line_count > 0) {
+        RecordReader reader(text);
+        size_t start = 0;
+        for (size_t c = 1; c <= chunk_count && start < text.size(); c++) {
+            size_t end = c == chunk_count ? text.size() : next_fixed_record_boundary(reader, record_line_count, text.size() / chunk_count * c, text.size());
+            if (end > start) {
+                chunks.push_back(text.substr(start, end - start));
+            }
+            start = end;
+        }
+        return chunks;
+    }
+
+    size_t start = 0;
+    for (size_t c = 1; c <= chunk_count && start < text.size(); c++) {
+        // Aim for an even split, then move forward to a record boundary
+        size_t end = c == chunk_count ? text.size() : next_record_boundary(text, max(start, text.size() / chunk_count * c));
+        if (end > start) {
+            chunks.push_back(text.substr(start, end - start));
+        }
+        start = end;
+    }
+    return chunks;
+}
+
+void split_commas(string_view line, vector<string_view>& fields) {
+    fields.clear();
+    size_t start = 0;
+    while (start < line.size()) {
+        size_t comma = line.find(',', start);
+        if (comma == string_view::npos) {
+            comma = line.size();
+        }
+        fields.push_back(line.substr(start, comma - start));
+        start = comma + 1;
+    }
+}
+
+// Removes leading and trailing spaces and tabs
+static string_view trim(string_view text) {
+    size_t begin = text.find_first_not_of(" \t");
+    if (begin == string_view::npos) {
+        return string_view();
+    }
+    size_t end = text.find_last_not_of(" \t");
+    return text.substr(begin, end - begin + 1);
+}
+
+bool parse_float(string_view text, float& value) {
+    text = trim(text);
+    from_chars_result result = from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == errc() && result.ptr == text.data() + text.size() && !text.empty();
+}
+
+bool parse_int(string_view text, int& value) {
+    text = trim(text);
+    from_chars_result result = from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == errc() && result.ptr == text.data() + text.size() && !text.empty();
+}
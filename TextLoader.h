@@ -0,0 +1,110 @@
+#ifndef TEXTLOADER_INCLUDED
+#define TEXTLOADER_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include "ThreadPool.h"
+
+// Helpers for parsing the blank-line separated record files (users.txt, movies.txt) straight
+// out of a memory-mapped buffer, so chunks of records can be parsed on separate threads.
+
+// A malformed record found while loading, with the line it was found on (counting from 1)
+struct LoadError
+{
+    size_t line;
+    std::string message;
+};
+
+// How long each phase of the last load took, in nanoseconds. Opening a snapshot has no parse phase.
+struct LoadTimings
+{
+    uint64_t map_ns = 0; // opening and mapping the file
+    uint64_t parse_ns = 0; // parsing the records, on all threads
+    uint64_t build_ns = 0; // creating the movies or users and interning their attributes
+    uint64_t index_ns = 0; // building the lookup indices
+    uint64_t slowest_index_ns = 0; // the longest single index build, when index_ns built them in parallel
+};
+
+// Returns the nanoseconds since phase_start and moves phase_start to now, for timing
+// consecutive phases with one clock read each
+inline uint64_t lap_ns(std::chrono::steady_clock::time_point& phase_start) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    uint64_t elapsed = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now - phase_start).count());
+    phase_start = now;
+    return elapsed;
+}
+
+// Walks the records in a piece of text. A record is either a run of non-blank lines, records
+// separated by one or more blank lines, or a fixed number of lines read by position, any of
+// which may be blank. The CR of CRLF line endings is dropped.
+class RecordReader
+{
+public:
+    explicit RecordReader(std::string_view text);
+
+    // Fills lines with the next record's lines and returns true, or returns false at the end.
+    // first_line is set to the record's first line number, relative to the start of the text.
+    bool next_record(std::vector<std::string_view>& lines, size_t& first_line);
+
+    // The same for a record of exactly line_count lines (fewer only at the end of the text),
+    // skipping the blank lines before it and one blank line after it if there is one. Blank
+    // lines inside the record are empty fields, not separators.
+    bool next_record(size_t line_count, std::vector<std::string_view>& lines, size_t& first_line);
+
+    // Number of lines in the text read so far, and where in the text the next one starts
+    size_t get_line_count() const;
+    size_t get_position() const;
+
+private:
+    bool next_line(std::string_view& line);
+
+    std::string_view m_text;
+    size_t m_position;
+    size_t m_line_count;
+};
+
+// Splits text into at most chunk_count pieces of about equal size, each ending on a record
+// boundary, so that every record lies entirely inside one piece. With a record_line_count the
+// records are the fixed-length ones of RecordReader, whose boundaries cannot be told from a
+// blank line alone, so the text is walked from the start to find them.
+std::vector<std::string_view> split_into_record_chunks(std::string_view text, size_t chunk_count, size_t record_line_count = 0);
+
+// Files with less than this much text per chunk are not worth splitting across threads
+const size_t MIN_CHUNK_BYTES = 1 << 20;
+
+// Splits text into chunks of whole records and runs parse(chunk, result) on each of them
+// using thread_count threads (0 means one per hardware thread); small texts are parsed on
+// the calling thread. Returns the results in the same order as the chunks in the text.
+// record_line_count is that of fixed-length records, or 0 for blank-line separated ones.
+template <typename ParsedChunk, typename Parse>
+std::vector<ParsedChunk> parse_record_chunks(std::string_view text, unsigned thread_count, Parse parse, size_t record_line_count = 0) {
+    std::vector<ParsedChunk> parsed;
+    if (text.size() < 2 * MIN_CHUNK_BYTES) {
+        parsed.resize(1);
+        parse(text, parsed[0]);
+        return parsed;
+    }
+
+    ThreadPool pool(thread_count);
+    std::vector<std::string_view> chunks = split_into_record_chunks(text,
+        std::min(size_t(pool.get_thread_count()) * 4, text.size() / MIN_CHUNK_BYTES), record_line_count);
+    parsed.resize(chunks.size());
+    pool.parallel_for(chunks.size(), [&](size_t c, unsigned) {
+        parse(chunks[c], parsed[c]);
+    });
+    return parsed;
+}
+
+// Splits a comma separated line into its fields, replacing the contents of fields
+void split_commas(std::string_view line, std::vector<std::string_view>& fields);
+
+// Parse a whole field (ignoring surrounding spaces) as a number; false if it is not one
+bool parse_float(std::string_view text, float& value);
+bool parse_int(std::string_view text, int& value);
+
+#endif // TEXTLOADER_INCLUDED
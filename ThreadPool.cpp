@@ -0,0 +1,123 @@
+#include "ThreadPool.h"
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+using namespace std;
+
+ThreadPool::ThreadPool(unsigned thread_count)
+    : m_task(nullptr), m_generation(0), m_active(0), m_stopping(false) {
+    if (thread_count == 0) {
+        thread_count = max(1u, thread::hardware_concurrency());
+    }
+
+    m_queues.reset(new WorkerQueue[thread_count]);
+    for (unsigned w = 0; w < thread_count; w++) {
+        m_threads.emplace_back(&ThreadPool::worker_main, this, w);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> guard(m_lock);
+        m_stopping = true;
+    }
+    m_work_ready.notify_all();
+    for (int t = 0; t < m_threads.size(); t++) {
+        m_threads[t].join();
+    }
+}
+
+unsigned ThreadPool::get_thread_count() const {
+    return unsigned(m_threads.size());
+}
+
+void ThreadPool::parallel_for(size_t task_count, const function<void(size_t, unsigned)>& task) {
+    if (task_count == 0) {
+        return;
+    }
+
+    // Deal the indices out in equal contiguous slices
+    unsigned workers = get_thread_count();
+    for (unsigned w = 0; w < workers; w++) {
+        lock_guard<mutex> guard(m_queues[w].lock);
+        m_queues[w].begin = task_count * w / workers;
+        m_queues[w].end = task_count * (w + 1) / workers;
+    }
+
+    // Wake the workers and wait for all of them to run out of work
+    unique_lock<mutex> guard(m_lock);
+    m_task = &task;
+    m_active = workers;
+    m_generation++;
+    m_work_ready.notify_all();
+    m_work_done.wait(guard, [this] { return m_active == 0; });
+    m_task = nullptr;
+}
+
+void ThreadPool::worker_main(unsigned worker) {
+    uint64_t seen_generation = 0;
+    while (true) {
+        // Sleep until there is a new loop to run or the pool is shutting down
+        const function<void(size_t, unsigned)>* task;
+        {
+            unique_lock<mutex> guard(m_lock);
+            m_work_ready.wait(guard, [&] { return m_stopping || m_generation != seen_generation; });
+            if (m_stopping) {
+                return;
+            }
+            seen_generation = m_generation;
+            task = m_task;
+        }
+
+        // Run our own indices, then keep stealing until nobody has any left
+        size_t index;
+        while (pop_task(worker, index) || (steal_tasks(worker) && pop_task(worker, index))) {
+            (*task)(index, worker);
+        }
+
+        // The last worker to finish wakes up parallel_for
+        lock_guard<mutex> guard(m_lock);
+        if (--m_active == 0) {
+            m_work_done.notify_one();
+        }
+    }
+}
+
+// Takes the next index from the front of this worker's own slice
+bool ThreadPool::pop_task(unsigned worker, size_t& index) {
+    WorkerQueue& queue = m_queues[worker];
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.begin == queue.end) {
+        return false;
+    }
+    index = queue.begin++;
+    return true;
+}
+
+// Moves the back half of another worker's slice into this worker's (empty) slice
+// Returns false once every other slice is empty
+bool ThreadPool::steal_tasks(unsigned worker) {
+    unsigned workers = get_thread_count();
+    for (unsigned offset = 1; offset < workers; offset++) {
+        unsigned victim = (worker + offset) % workers;
+
+        // Lock both slices so the stolen indices are never in neither of them
+        scoped_lock guard(m_queues[worker].lock, m_queues[victim].lock);
+        WorkerQueue& theirs = m_queues[victim];
+        size_t remaining = theirs.end - theirs.begin;
+        if (remaining == 0) {
+            continue;
+        }
+
+        // The victim keeps the front half, which is where it takes its next index from
+        size_t middle = theirs.begin + remaining / 2;
+        m_queues[worker].begin = middle;
+        m_queues[worker].end = theirs.end;
+        theirs.end = middle;
+        return true;
+    }
+    return false;
+}
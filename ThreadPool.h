@@ -0,0 +1,56 @@
+#ifndef THREADPOOL_INCLUDED
+#define THREADPOOL_INCLUDED
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+// A fixed set of worker threads that run parallel loops with work stealing.
+// Each worker starts with an even slice of the loop's indices and takes them from the front;
+// a worker that runs out steals the back half of the next non-empty slice it finds, so
+// uneven tasks (users with long watch histories) do not leave the other workers idle.
+class ThreadPool
+{
+public:
+    // thread_count 0 means one worker per hardware thread
+    explicit ThreadPool(unsigned thread_count = 0);
+    ~ThreadPool();
+
+    unsigned get_thread_count() const;
+
+    // Calls task(index, worker) for every index in [0, task_count), where worker is the
+    // number (0 to get_thread_count() - 1) of the thread running it, and returns once all
+    // calls have finished. Only one parallel_for may run at a time.
+    void parallel_for(size_t task_count, const std::function<void(size_t, unsigned)>& task);
+
+private:
+    // The indices a worker still has to run, [begin, end)
+    struct alignas(64) WorkerQueue
+    {
+        std::mutex lock;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    void worker_main(unsigned worker);
+    bool pop_task(unsigned worker, size_t& index);
+    bool steal_tasks(unsigned worker);
+
+    std::vector<std::thread> m_threads;
+    std::unique_ptr<WorkerQueue[]> m_queues;
+
+    std::mutex m_lock; // guards everything below
+    std::condition_variable m_work_ready;
+    std::condition_variable m_work_done;
+    const std::function<void(size_t, unsigned)>* m_task;
+    uint64_t m_generation; // bumped for every parallel_for so workers know there is new work
+    unsigned m_active; // workers still running the current loop
+    bool m_stopping;
+};
+
+#endif // THREADPOOL_INCLUDED
@@ -1,26 +1,95 @@
 #include "User.h"
+#include "WatchHistory.h"
 #include <string>
 #include <vector>
+#include <string_view>
+#include <span>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <cstdint>
 using namespace std;
 
+struct User::OwnedHistory
+{
+    vector<string> ids; // every distinct movie ID, in order of first viewing
+    vector<string_view> id_views;
+    vector<uint8_t> bytes;
+};
+
 User::User(const string& full_name, const string& email,
     const vector<string>& watch_history)
-    : m_name(full_name), m_email(email), m_watch_history(watch_history)
+    : m_name(full_name), m_email(email), m_movie_ids(nullptr), m_owned(new OwnedHistory), m_history_version(0)
+{
+    // Number the user's own movies, like UserDatabase does for all of its users
+    unordered_map<string, uint32_t> numbers;
+    vector<uint32_t> indices;
+    for (const string& movie_id : watch_history) {
+        auto inserted = numbers.emplace(movie_id, uint32_t(m_owned->ids.size()));
+        if (inserted.second) {
+            m_owned->ids.push_back(movie_id);
+        }
+        indices.push_back(inserted.first->second);
+    }
+    for (const string& movie_id : m_owned->ids) {
+        m_owned->id_views.push_back(movie_id);
+    }
+    WatchHistory::encode(indices, WatchHistory::PLAIN, m_owned->bytes);
+    m_watch_history = WatchHistory(m_owned->bytes.data(), uint32_t(m_owned->bytes.size()), uint32_t(indices.size()), WatchHistory::PLAIN);
+    m_movie_ids = &m_owned->id_views;
+}
+
+User::User(string_view full_name, string_view email, WatchHistory watch_history,
+    const vector<string_view>* movie_ids, pmr::memory_resource* resource)
+    : m_name(full_name, resource), m_email(email, resource),
+    m_watch_history(watch_history), m_movie_ids(movie_ids), m_history_version(0)
 {
     // nothing
 }
 
+User::~User() {}
+
 string User::get_full_name() const
 {
-    return m_name;
+    return string(m_name);
 }
 
 string User::get_email() const
 {
-    return m_email;
+    return string(m_email);
 }
 
 vector<string> User::get_watch_history() const
+{
+    vector<string> movie_ids;
+    movie_ids.reserve(m_watch_history.size());
+    for (uint32_t index : m_watch_history) {
+        movie_ids.emplace_back((*m_movie_ids)[index]);
+    }
+    return movie_ids;
+}
+
+string_view User::get_full_name_view() const
+{
+    return m_name;
+}
+
+string_view User::get_email_view() const
+{
+    return m_email;
+}
+
+WatchHistory User::get_watch_history_view() const
 {
     return m_watch_history;
+}
+
+span<const string_view> User::get_movie_ids() const
+{
+    return *m_movie_ids;
+}
+
+uint64_t User::get_history_version() const
+{
+    return m_history_version;
 }
\ No newline at end of file
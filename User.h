@@ -3,20 +3,51 @@
 
 #include <string>
 #include <vector>
+#include <string_view>
+#include <span>
+#include <memory>
+#include <memory_resource>
+#include <cstdint>
+#include "WatchHistory.h"
 
 class User
 {
 public:
     User(const std::string& full_name, const std::string& email,
         const std::vector<std::string>& watch_history);
+    // Same, but with the name and email copied into memory from the given resource (e.g. the
+    // arena of the UserDatabase that holds the user). The watch history is the indices of the
+    // user's movies in movie_ids, stored elsewhere; both must outlive the user.
+    User(std::string_view full_name, std::string_view email, WatchHistory watch_history,
+        const std::vector<std::string_view>* movie_ids, std::pmr::memory_resource* resource);
+    ~User();
     std::string get_full_name() const;
     std::string get_email() const;
     std::vector<std::string> get_watch_history() const;
 
+    // Same data as the getters above, as views into the user's own storage (no copies).
+    // The views stay valid for as long as the user does; the watch history view only until the
+    // history is changed through UserDatabase::add_watch or remove_watch.
+    std::string_view get_full_name_view() const;
+    std::string_view get_email_view() const;
+    // The watched movies as indices into get_movie_ids()
+    WatchHistory get_watch_history_view() const;
+    std::span<const std::string_view> get_movie_ids() const;
+
+    // Changes every time the watch history does, so results computed from it can be checked
+    uint64_t get_history_version() const;
+
 private:
-    std::string m_name;
-    std::string m_email;
-    std::vector<std::string> m_watch_history;
+    friend class UserDatabase;
+
+    struct OwnedHistory; // the history of a user made outside a UserDatabase, defined in User.cpp
+
+    std::pmr::string m_name;
+    std::pmr::string m_email;
+    WatchHistory m_watch_history;
+    const std::vector<std::string_view>* m_movie_ids;
+    std::unique_ptr<OwnedHistory> m_owned; // null for users of a UserDatabase
+    uint64_t m_history_version;
 };
 
 #endif // USER_INCLUDED
\ No newline at end of file
@@ -1,87 +1,262 @@
 #include "User.h"
 #include "UserDatabase.h"
 #include "treemm.h"
+#include "TextLoader.h"
+#include "WatchHistory.h"
 #include <string>
+#include <string_view>
 #include <iostream>
-#include <fstream>
 #include <vector>
+#include <span>
+#include <algorithm>
+#include <memory_resource>
+#include <unordered_map>
+#include <chrono>
+#include <cstring>
 using namespace std;
 
-UserDatabase::UserDatabase() {}
+UserDatabase::UserDatabase() : m_version(0), m_shard(0), m_shard_count(1), m_history_encoding(WatchHistory::PLAIN), m_history_bytes(0) {}
 
-UserDatabase::~UserDatabase() {
-    for (int i = 0; i < m_users.size(); i++) {
-        delete m_users[i];
+// Like the movies, the users are released all at once with m_arena rather than one by one
+UserDatabase::~UserDatabase() {}
+
+// The fields of one user record, as views into the mapped file
+// The watch history is history[first_movie, first_movie + movie_count)
+struct ParsedUser
+{
+    string_view name;
+    string_view email;
+    size_t first_movie;
+    size_t movie_count;
+};
+
+// The users and errors found in one chunk of the file, with line numbers relative to the chunk
+struct ParsedUserChunk
+{
+    vector<ParsedUser> users;
+    vector<string_view> history;
+    vector<LoadError> errors;
+    size_t line_count = 0;
+};
+
+// Parses every record in a chunk of users.txt; malformed records are reported and skipped
+// Each record is the user's name, email, the number of movies watched and then one movie ID
+// per line, followed by a blank line
+static void parse_user_chunk(string_view chunk, ParsedUserChunk& parsed) {
+    RecordReader reader(chunk);
+    vector<string_view> lines;
+    size_t first_line;
+
+    while (reader.next_record(lines, first_line)) {
+        if (lines.size() < 3) {
+            parsed.errors.push_back(LoadError{ first_line, "user record has " + to_string(lines.size()) + " lines, expected at least 3" });
+            continue;
+        }
+
+        int num_movies_watched;
+        if (!parse_int(lines[2], num_movies_watched) || num_movies_watched < 0) {
+            parsed.errors.push_back(LoadError{ first_line + 2, "movie count \"" + string(lines[2]) + "\" is not a number" });
+            continue;
+        }
+        if (lines.size() != 3 + size_t(num_movies_watched)) {
+            parsed.errors.push_back(LoadError{ first_line, "user record lists " + to_string(lines.size() - 3) + " movies but says it has " + to_string(num_movies_watched) });
+            continue;
+        }
+
+        parsed.users.push_back(ParsedUser{ lines[0], lines[1], parsed.history.size(), size_t(num_movies_watched) });
+        parsed.history.insert(parsed.history.end(), lines.begin() + 3, lines.end());
     }
+    parsed.line_count = reader.get_line_count();
 }
 
-// Load user data from a file specified by filename and construct a binary search tree of users
-// Returns true if the file was successfully loaded, false otherwise
-bool UserDatabase::load(const string& filename) {
-    // Open the file for reading
-    ifstream infile(filename);
+// Load user data from a file specified by filename and build the email index of users
+// Malformed records are skipped and listed by get_load_errors()
+// Returns true if the file was read, false if it could not be
+bool UserDatabase::load(const string& filename, unsigned thread_count) {
+    // A database backed by a snapshot cannot take more users
+    if (m_snapshot.is_open()) {
+        return false;
+    }
 
-    // If the file could not be opened, return false
-    if (!infile) {
+    // Map the file; if it could not be opened, return false
+    chrono::steady_clock::time_point phase_start = chrono::steady_clock::now();
+    m_load_timings = LoadTimings();
+    MappedFile file;
+    if (!read_snapshot_source(filename, m_source) || !file.open(filename)) {
         return false;
     }
+    m_load_timings.map_ns = lap_ns(phase_start);
 
-    // Read the file line by line
-    string tempStr;
-    while (getline(infile, tempStr)) {
-        // The first line of each record contains the user's name
-        string tempName = tempStr;
+    // Split the file into chunks of whole records and parse them in parallel
+    vector<ParsedUserChunk> parsed = parse_record_chunks<ParsedUserChunk>(string_view(file.data(), file.size()), thread_count, parse_user_chunk);
+    m_load_timings.parse_ns = lap_ns(phase_start);
 
-        // The second line contains the user's email address
-        string tempEmail;
-        if (!getline(infile, tempEmail)) {
-            // If there is no second line, return false
-            return false;
+    // Number every movie ID the kept users watched, in file order, and number the errors by
+    // their line in the whole file
+    m_load_errors.clear();
+    vector<const ParsedUser*> kept;
+    vector<uint32_t> history_indices; // the watch histories of the kept users, back to back
+    uint32_t first_new_id = uint32_t(m_movie_ids.size());
+    size_t line_base = 0;
+    for (int c = 0; c < parsed.size(); c++) {
+        for (const ParsedUser& user : parsed[c].users) {
+            if (m_shard_count > 1 && shard_of_email(user.email, m_shard_count) != m_shard) {
+                continue;
+            }
+            kept.push_back(&user);
+            for (size_t h = 0; h < user.movie_count; h++) {
+                history_indices.push_back(number_movie_id(parsed[c].history[user.first_movie + h]));
+            }
         }
-
-        // The third line contains the number of movies watched by the user
-        string num_movies_watched;
-        if (!getline(infile, num_movies_watched)) {
-            // If there is no third line, return false
-            return false;
+        for (const LoadError& error : parsed[c].errors) {
+            m_load_errors.push_back(LoadError{ line_base + error.line, error.message });
         }
-        // Convert the string to an integer
-        int int_num_movies_watched = stoi(num_movies_watched);
-
-        // Read the IDs of the movies watched by the user
-        vector<string> history_movies;
-        for (int q = 0; q < int_num_movies_watched; q++) {
-            string ID_mov;
-            if (!getline(infile, ID_mov)) {
-                // If there are not enough lines, return false
-                return false;
-            }
-            // Add the ID to the user's list of watched movies
-            history_movies.push_back(ID_mov);
+        line_base += parsed[c].line_count;
+    }
+
+    // Renumber the IDs first seen in this load in sorted order, so a catalog sorted by ID
+    // numbers its movies the same way and the deltas between them stay small
+    vector<uint32_t> renumbered(m_movie_ids.size() - first_new_id);
+    for (uint32_t i = 0; i < renumbered.size(); i++) {
+        renumbered[i] = first_new_id + i;
+    }
+    sort(renumbered.begin(), renumbered.end(), [this](uint32_t a, uint32_t b) {
+        return m_movie_ids[a] < m_movie_ids[b];
+    });
+    vector<string_view> sorted_ids(renumbered.size());
+    vector<uint32_t> new_number(renumbered.size());
+    for (uint32_t rank = 0; rank < renumbered.size(); rank++) {
+        sorted_ids[rank] = m_movie_ids[renumbered[rank]];
+        new_number[renumbered[rank] - first_new_id] = first_new_id + rank;
+        m_movie_id_numbers[sorted_ids[rank]] = first_new_id + rank;
+    }
+    copy(sorted_ids.begin(), sorted_ids.end(), m_movie_ids.begin() + first_new_id);
+    for (uint32_t& index : history_indices) {
+        if (index >= first_new_id) {
+            index = new_number[index - first_new_id];
         }
+    }
 
-        // Create a new User object with the data read from the file
-        User* m_user = new User(tempName, tempEmail, history_movies);
+    // Add the users in file order, each with its history encoded into the arena
+    size_t history_begin = 0;
+    for (const ParsedUser* user : kept) {
+        WatchHistory history = store_history(span<const uint32_t>(history_indices.data() + history_begin, user->movie_count));
+        history_begin += user->movie_count;
 
-        // Insert users into m_users vector to be deleted later
-        m_users.push_back(m_user);
+        // Create the user in the arena, right after its history
+        User* m_user = pmr::polymorphic_allocator<User>(&m_arena).new_object<User>(user->name, user->email, history, &m_movie_ids, &m_arena);
 
-        // Add the user to the binary search tree
-        m_TMM.insert(tempEmail, m_user);
+        // Keep the user in load order
+        m_users.push_back(m_user);
 
-        // Skip the newline character after the current record
-        getline(infile, tempStr);
+        // Add the user to the email index
+        m_TMM.insert(m_user->get_email_view(), m_user);
     }
-    // Return true to indicate that the file was successfully loaded
+    m_load_timings.build_ns = lap_ns(phase_start);
+
+    // Sort the staged email index so it can be searched
+    m_TMM.freeze();
+    m_load_timings.index_ns = lap_ns(phase_start);
+    m_version++;
     return true;
 }
 
+// Returns the malformed records skipped by the last load(), in file order
+const vector<LoadError>& UserDatabase::get_load_errors() const {
+    return m_load_errors;
+}
+
+const LoadTimings& UserDatabase::get_load_timings() const {
+    return m_load_timings;
+}
+
+void UserDatabase::set_shard(uint32_t shard, uint32_t shard_count) {
+    m_shard_count = max(shard_count, 1u);
+    m_shard = shard % m_shard_count;
+}
+
+uint32_t UserDatabase::get_shard() const {
+    return m_shard;
+}
+
+uint32_t UserDatabase::get_shard_count() const {
+    return m_shard_count;
+}
+
+int UserDatabase::get_user_count() const {
+    return int(m_users.size());
+}
+
+User* UserDatabase::get_user_at(int index) const {
+    return m_users[index];
+}
+
+// 64-bit FNV-1a of the email, so the shard of a user does not depend on the standard library
+// that built the process
+uint32_t UserDatabase::shard_of_email(string_view email, uint32_t shard_count) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : email) {
+        hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+    }
+    return shard_count <= 1 ? 0 : uint32_t(hash % shard_count);
+}
+
+void UserDatabase::set_history_encoding(WatchHistory::Encoding encoding) {
+    m_history_encoding = encoding;
+}
+
+uint32_t UserDatabase::get_movie_id_count() const {
+    return uint32_t(m_movie_ids.size());
+}
+
+string_view UserDatabase::get_movie_id(uint32_t index) const {
+    return m_movie_ids[index];
+}
+
+size_t UserDatabase::get_history_byte_count() const {
+    return m_history_bytes;
+}
+
+// Returns the number of the movie ID, numbering it next (with its text copied into the arena)
+// if no history has named it yet
+uint32_t UserDatabase::number_movie_id(string_view movie_id) {
+    unordered_map<string_view, uint32_t>::iterator found = m_movie_id_numbers.find(movie_id);
+    if (found != m_movie_id_numbers.end()) {
+        return found->second;
+    }
+    char* text = static_cast<char*>(m_arena.allocate(max<size_t>(movie_id.size(), 1), 1));
+    if (!movie_id.empty()) {
+        memcpy(text, movie_id.data(), movie_id.size());
+    }
+    string_view stored(text, movie_id.size());
+    m_movie_ids.push_back(stored);
+    m_movie_id_numbers.emplace(stored, uint32_t(m_movie_ids.size() - 1));
+    return uint32_t(m_movie_ids.size() - 1);
+}
+
+// Encodes a history into a new block of the arena. Blocks of histories that are later
+// replaced are only released with the arena.
+WatchHistory UserDatabase::store_history(span<const uint32_t> indices) {
+    m_encode_buffer.clear();
+    WatchHistory::encode(indices, m_history_encoding, m_encode_buffer);
+    uint8_t* bytes = static_cast<uint8_t*>(m_arena.allocate(max<size_t>(m_encode_buffer.size(), 1), alignof(uint32_t)));
+    if (!m_encode_buffer.empty()) {
+        memcpy(bytes, m_encode_buffer.data(), m_encode_buffer.size());
+    }
+    m_history_bytes += m_encode_buffer.size();
+    return WatchHistory(bytes, uint32_t(m_encode_buffer.size()), uint32_t(indices.size()), m_history_encoding);
+}
+
+uint64_t UserDatabase::get_version() const {
+    return m_version;
+}
+
 // Find and return a User object based on their email address
 // If a user with the specified email is found, return a pointer to the User object
 // If a user with the specified email is not found, return a nullptr
-User* UserDatabase::get_user_from_email(const string& email) const {
-    // Search for the user in the binary search tree using their email address as the key
-    TreeMultimap<string, User*>::Iterator it = m_TMM.find(email);
+User* UserDatabase::get_user_from_email(string_view email) const {
+    // Search for the user in the email index using their email address as the key
+    TreeMultimap<string_view, User*>::Iterator it = m_TMM.find(email);
 
     // If the iterator is valid (i.e., the user was found), return a pointer to the User object
     if (it.is_valid()) {
@@ -92,4 +267,176 @@ User* UserDatabase::get_user_from_email(const string& email) const {
         // If the iterator is not valid (i.e., the user was not found), return nullptr
         return nullptr;
     }
+}
+
+// Appends the movie to the user's watch history, which is stored again at the end of the arena
+bool UserDatabase::add_watch(string_view email, string_view movie_id) {
+    User* user = get_user_from_email(email);
+    if (user == nullptr) {
+        return false;
+    }
+
+    vector<uint32_t> history(user->m_watch_history.begin(), user->m_watch_history.end());
+    history.push_back(number_movie_id(movie_id));
+    m_history_bytes -= user->m_watch_history.get_byte_count();
+    user->m_watch_history = store_history(history);
+    user->m_history_version++;
+    return true;
+}
+
+// Removes the most recent viewing of the movie from the user's watch history
+bool UserDatabase::remove_watch(string_view email, string_view movie_id) {
+    User* user = get_user_from_email(email);
+    if (user == nullptr) {
+        return false;
+    }
+
+    unordered_map<string_view, uint32_t>::const_iterator number = m_movie_id_numbers.find(movie_id);
+    if (number == m_movie_id_numbers.end()) {
+        return false;
+    }
+    vector<uint32_t> history(user->m_watch_history.begin(), user->m_watch_history.end());
+    for (int h = int(history.size()) - 1; h >= 0; h--) {
+        if (history[h] == number->second) {
+            history.erase(history.begin() + h);
+            m_history_bytes -= user->m_watch_history.get_byte_count();
+            user->m_watch_history = store_history(history);
+            user->m_history_version++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sections of a user snapshot
+enum UserSnapshotSection
+{
+    USER_RECORDS = 1, // UserRecord per user, in load order
+    USER_HISTORY, // movie ID number per watched movie, for all users back to back
+    USER_EMAIL_ORDER, // user indices sorted by email
+    USER_MOVIE_IDS, // StringRef per movie ID number
+};
+
+// One user in a snapshot
+struct UserRecord
+{
+    StringRef name;
+    StringRef email;
+    uint32_t history_begin; // watch history is USER_HISTORY[history_begin, history_begin + history_count)
+    uint32_t history_count;
+};
+
+bool UserDatabase::compile(const string& snapshot_filename) const {
+    SnapshotWriter writer(SNAPSHOT_USERS, m_source);
+
+    // The user records, with every name, email and movie ID stored once in the pool. Histories
+    // are stored plain whatever their encoding here, so opening the snapshot can use them in place.
+    vector<UserRecord> records;
+    vector<uint32_t> history;
+    for (int u = 0; u < m_users.size(); u++) {
+        UserRecord record;
+        record.name = writer.add_string(m_users[u]->get_full_name_view());
+        record.email = writer.add_string(m_users[u]->get_email_view());
+        record.history_begin = uint32_t(history.size());
+        WatchHistory watched = m_users[u]->get_watch_history_view();
+        history.insert(history.end(), watched.begin(), watched.end());
+        record.history_count = uint32_t(history.size()) - record.history_begin;
+        records.push_back(record);
+    }
+    vector<StringRef> movie_ids;
+    for (string_view movie_id : m_movie_ids) {
+        movie_ids.push_back(writer.add_string(movie_id));
+    }
+    writer.add_section<UserRecord>(USER_RECORDS, records);
+    writer.add_section<uint32_t>(USER_HISTORY, history);
+    writer.add_section<StringRef>(USER_MOVIE_IDS, movie_ids);
+
+    // The email index, prebuilt so opening the snapshot does not sort
+    vector<uint32_t> email_order(m_users.size());
+    for (uint32_t u = 0; u < email_order.size(); u++) {
+        email_order[u] = u;
+    }
+    stable_sort(email_order.begin(), email_order.end(), [this](uint32_t a, uint32_t b) {
+        return m_users[a]->get_email_view() < m_users[b]->get_email_view();
+    });
+    writer.add_section<uint32_t>(USER_EMAIL_ORDER, email_order);
+
+    return writer.write(snapshot_filename);
+}
+
+bool UserDatabase::open_snapshot(const string& snapshot_filename, const string& source_filename) {
+    chrono::steady_clock::time_point phase_start = chrono::steady_clock::now();
+    if (!m_users.empty() || !m_snapshot.open(snapshot_filename, SNAPSHOT_USERS, source_filename)) {
+        return false;
+    }
+
+    // Check that the arrays agree with each other before trusting them
+    span<const UserRecord> records = m_snapshot.section<UserRecord>(USER_RECORDS);
+    span<const uint32_t> history = m_snapshot.section<uint32_t>(USER_HISTORY);
+    span<const uint32_t> email_order = m_snapshot.section<uint32_t>(USER_EMAIL_ORDER);
+    span<const StringRef> movie_ids = m_snapshot.section<StringRef>(USER_MOVIE_IDS);
+    bool valid = email_order.size() == records.size() && all_below(email_order, records.size()) && all_below(history, movie_ids.size());
+    for (int u = 0; valid && u < records.size(); u++) {
+        valid = records[u].history_begin <= history.size() && records[u].history_count <= history.size() - records[u].history_begin;
+    }
+    if (!valid) {
+        m_snapshot.close();
+        return false;
+    }
+
+    m_load_timings = LoadTimings();
+    m_load_timings.map_ns = lap_ns(phase_start);
+
+    // The movie IDs stay in the snapshot's pool
+    for (uint32_t i = 0; i < movie_ids.size(); i++) {
+        m_movie_ids.push_back(m_snapshot.get_string(movie_ids[i]));
+        m_movie_id_numbers.emplace(m_movie_ids.back(), i);
+    }
+
+    // User owns its name and email, so those are copied out of the pool into User objects.
+    // Plain histories are used where they are in the mapping; others are encoded into the arena.
+    // Records of other shards are skipped and have no User.
+    vector<User*> record_users(records.size(), nullptr);
+    m_users.reserve(m_shard_count > 1 ? records.size() / m_shard_count + 1 : records.size());
+    for (int u = 0; u < records.size(); u++) {
+        if (m_shard_count > 1 && shard_of_email(m_snapshot.get_string(records[u].email), m_shard_count) != m_shard) {
+            continue;
+        }
+        span<const uint32_t> watched = history.subspan(records[u].history_begin, records[u].history_count);
+        WatchHistory stored;
+        if (m_history_encoding == WatchHistory::PLAIN) {
+            stored = WatchHistory(reinterpret_cast<const uint8_t*>(watched.data()), uint32_t(watched.size_bytes()), uint32_t(watched.size()), WatchHistory::PLAIN);
+            m_history_bytes += watched.size_bytes();
+        }
+        else {
+            stored = store_history(watched);
+        }
+        m_users.push_back(pmr::polymorphic_allocator<User>(&m_arena).new_object<User>(m_snapshot.get_string(records[u].name),
+            m_snapshot.get_string(records[u].email), stored, &m_movie_ids, &m_arena));
+        record_users[u] = m_users.back();
+    }
+
+    m_load_timings.build_ns = lap_ns(phase_start);
+
+    // Rebuild the email index from the prebuilt order, without sorting
+    vector<string_view> keys;
+    vector<size_t> offsets;
+    vector<User*> values;
+    for (int k = 0; k < email_order.size(); k++) {
+        User* user = record_users[email_order[k]];
+        if (user == nullptr) {
+            continue;
+        }
+        if (keys.empty() || keys.back() != user->get_email_view()) { // first value of a new key
+            keys.push_back(user->get_email_view());
+            offsets.push_back(values.size());
+        }
+        values.push_back(user);
+    }
+    offsets.push_back(values.size());
+    m_TMM.assign_sorted(move(keys), move(offsets), move(values));
+    m_load_timings.index_ns = lap_ns(phase_start);
+    m_version++;
+
+    return true;
 }
\ No newline at end of file
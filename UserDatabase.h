@@ -2,7 +2,16 @@
 #define USERDATABASE_INCLUDED
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <memory_resource>
+#include <unordered_map>
+#include <span>
+#include <cstdint>
 #include "treemm.h"
+#include "Snapshot.h"
+#include "TextLoader.h"
+#include "WatchHistory.h"
 
 class User;
 
@@ -11,12 +20,69 @@ class UserDatabase
 public:
 	UserDatabase();
 	~UserDatabase();
-	bool load(const std::string& filename);
-	User* get_user_from_email(const std::string& email) const;
+	// Loads users.txt, parsing it on thread_count threads (0 means one per hardware thread).
+	// Malformed records are skipped and listed by get_load_errors(); returns false only if
+	// the file cannot be read.
+	bool load(const std::string& filename, unsigned thread_count = 0);
+	const std::vector<LoadError>& get_load_errors() const;
+	const LoadTimings& get_load_timings() const; // phases of the last load() or open_snapshot()
+	uint64_t get_version() const; // changes every time users are loaded
+
+	// Makes the next load() or open_snapshot() keep only the users of one shard: those whose
+	// email shard_of_email() puts in shard out of shard_count. The rest are skipped as they are
+	// read, so a process serving one shard never holds the others.
+	void set_shard(uint32_t shard, uint32_t shard_count);
+	uint32_t get_shard() const;
+	uint32_t get_shard_count() const;
+	int get_user_count() const;
+	User* get_user_at(int index) const; // in load order, from 0 to get_user_count() - 1
+	// The shard of shard_count an email belongs to; the same for every process and run
+	static uint32_t shard_of_email(std::string_view email, uint32_t shard_count);
+
+	// Watch histories are movie ID numbers, stored in this encoding from the next load() or
+	// open_snapshot() on (PLAIN unless changed). Each distinct movie ID is stored once; the IDs
+	// first seen in a load are numbered in sorted order, and a number never changes after that.
+	void set_history_encoding(WatchHistory::Encoding encoding);
+	uint32_t get_movie_id_count() const;
+	std::string_view get_movie_id(uint32_t index) const;
+	size_t get_history_byte_count() const; // taken by every user's encoded history
+
+	// Writes the loaded users to a binary snapshot, or opens one written earlier instead of
+	// calling load(); see MovieDatabase::compile and MovieDatabase::open_snapshot
+	bool compile(const std::string& snapshot_filename) const;
+	bool open_snapshot(const std::string& snapshot_filename, const std::string& source_filename = std::string());
+	User* get_user_from_email(std::string_view email) const;
+
+	// Record that a user watched a movie, or take one viewing of it back out of the history.
+	// Both bump the user's history version; they return false if the email is unknown (or, for
+	// remove_watch, the movie is not in the history). They change the user in place without a
+	// lock, so no other thread may read the database meanwhile: in serve mode every worker reads
+	// the published catalog unlocked, so viewings can only be applied to a generation that has
+	// not been published yet (see Catalog.h).
+	bool add_watch(std::string_view email, std::string_view movie_id);
+	bool remove_watch(std::string_view email, std::string_view movie_id);
 
 private:
-	TreeMultimap<std::string, User*> m_TMM;
+	uint32_t number_movie_id(std::string_view movie_id);
+	WatchHistory store_history(std::span<const uint32_t> indices);
+
+	// The users, their strings and their encoded histories live in m_arena in load order and
+	// are released with it; the email index keys view the users' own emails
+	std::pmr::monotonic_buffer_resource m_arena;
+	TreeMultimap<std::string_view, User*> m_TMM;
 	std::vector<User*> m_users;
+	std::vector<LoadError> m_load_errors;
+	LoadTimings m_load_timings;
+	SnapshotSource m_source; // of the file the last load() read, for compile()
+	uint64_t m_version;
+	uint32_t m_shard;
+	uint32_t m_shard_count; // 1 keeps every user
+	WatchHistory::Encoding m_history_encoding;
+	std::vector<std::string_view> m_movie_ids; // by number; the text is in m_arena or the snapshot
+	std::unordered_map<std::string_view, uint32_t> m_movie_id_numbers;
+	std::vector<uint8_t> m_encode_buffer; // reused by store_history
+	size_t m_history_bytes;
+	SnapshotReader m_snapshot; // open while the database is backed by a snapshot
 };
 
 #endif // USERDATABASE_INCLUDED
\ No newline at end of file
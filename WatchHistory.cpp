@@ -0,0 +1,31 @@
+#include "WatchHistory.h"
+#include <span>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+using namespace std;
+
+void WatchHistory::encode(span<const uint32_t> indices, Encoding encoding, vector<uint8_t>& out) {
+    if (encoding == PLAIN) {
+        size_t start = out.size();
+        out.resize(start + indices.size_bytes());
+        if (!indices.empty()) {
+            memcpy(out.data() + start, indices.data(), indices.size_bytes());
+        }
+        return;
+    }
+
+    uint32_t previous = 0;
+    for (uint32_t index : indices) {
+        // The difference wraps around, which decoding undoes; zigzag keeps small negative
+        // differences small
+        int32_t delta = int32_t(index - previous);
+        uint32_t zigzag = (uint32_t(delta) << 1) ^ uint32_t(delta >> 31);
+        while (zigzag >= 0x80) {
+            out.push_back(uint8_t(zigzag | 0x80));
+            zigzag >>= 7;
+        }
+        out.push_back(uint8_t(zigzag));
+        previous = index;
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef WATCHHISTORY_INCLUDED
+#define WATCHHISTORY_INCLUDED
+
+#include <span>
+#include <vector>
+#include <iterator>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+// A view of one user's watch history as movie ID indices (see UserDatabase::get_movie_id), in
+// the order the movies were watched. The indices are stored in bytes owned by someone else (the
+// user database's history pool) in one of two encodings:
+//   PLAIN: four bytes per index
+//   DELTA_VARINT: each index as its difference from the one before (from 0 for the first),
+//     zigzag mapped to an unsigned number and written 7 bits per byte, low bits first, with the
+//     top bit set on every byte but the last. Usually two bytes per index for a few thousand
+//     distinct movies, at the cost of decoding serially.
+// Iterating decodes one index at a time without allocating.
+class WatchHistory
+{
+public:
+    enum Encoding : uint8_t { PLAIN, DELTA_VARINT };
+
+    class iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = uint32_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const uint32_t*;
+        using reference = uint32_t;
+
+        iterator() : m_next(nullptr), m_remaining(0), m_value(0), m_encoding(PLAIN) {}
+
+        uint32_t operator*() const {
+            return m_value;
+        }
+        iterator& operator++() {
+            if (--m_remaining > 0) {
+                decode_next();
+            }
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+        // Only iterators over the same history may be compared
+        bool operator==(const iterator& other) const {
+            return m_remaining == other.m_remaining;
+        }
+
+    private:
+        friend class WatchHistory;
+
+        iterator(const uint8_t* data, uint32_t count, Encoding encoding)
+            : m_next(data), m_remaining(count), m_value(0), m_encoding(encoding) {
+            if (m_remaining > 0) {
+                decode_next();
+            }
+        }
+
+        void decode_next() {
+            if (m_encoding == PLAIN) {
+                memcpy(&m_value, m_next, sizeof(m_value));
+                m_next += sizeof(m_value);
+                return;
+            }
+            uint32_t zigzag = 0;
+            for (int shift = 0;; shift += 7) {
+                uint8_t byte = *m_next++;
+                zigzag |= uint32_t(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0) {
+                    break;
+                }
+            }
+            m_value += (zigzag >> 1) ^ (0u - (zigzag & 1));
+        }
+
+        const uint8_t* m_next; // the bytes of the index after m_value
+        uint32_t m_remaining; // indices left, counting m_value
+        uint32_t m_value;
+        Encoding m_encoding;
+    };
+
+    WatchHistory() : m_data(nullptr), m_byte_count(0), m_count(0), m_encoding(PLAIN) {}
+    WatchHistory(const uint8_t* data, uint32_t byte_count, uint32_t count, Encoding encoding)
+        : m_data(data), m_byte_count(byte_count), m_count(count), m_encoding(encoding) {}
+
+    iterator begin() const {
+        return iterator(m_data, m_count, m_encoding);
+    }
+    iterator end() const {
+        return iterator();
+    }
+    size_t size() const {
+        return m_count;
+    }
+    bool empty() const {
+        return m_count == 0;
+    }
+
+    Encoding get_encoding() const {
+        return m_encoding;
+    }
+    const uint8_t* get_data() const {
+        return m_data;
+    }
+    size_t get_byte_count() const {
+        return m_byte_count;
+    }
+
+    // Appends indices to out in the given encoding
+    static void encode(std::span<const uint32_t> indices, Encoding encoding, std::vector<uint8_t>& out);
+
+private:
+    const uint8_t* m_data;
+    uint32_t m_byte_count;
+    uint32_t m_count;
+    Encoding m_encoding;
+};
+
+#endif // WATCHHISTORY_INCLUDED
@@ -0,0 +1,68 @@
+// Measures Recommender::recommend_batch throughput over the whole user base at 1 to N threads.
+// Build from the repository root:
+//   g++ -std=c++20 -O2 -pthread -I. bench/batch_bench.cpp $(ls *.cpp | grep -v main.cpp) -o batch_bench
+// Run: ./batch_bench users.txt movies.txt [max_threads] [movie_count]
+#include "UserDatabase.h"
+#include "MovieDatabase.h"
+#include "Recommender.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+using namespace std;
+
+// Reads the email (second line) of every record in users.txt
+static vector<string> readEmails(const string& filename) {
+    ifstream infile(filename);
+    vector<string> emails;
+    string name, email, count, line;
+    while (getline(infile, name) && getline(infile, email) && getline(infile, count)) {
+        emails.push_back(email);
+        for (int i = stoi(count); i > 0 && getline(infile, line); i--) {
+        }
+        getline(infile, line); // blank line between records
+    }
+    return emails;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "usage: " << argv[0] << " users.txt movies.txt [max_threads] [movie_count]" << endl;
+        return 1;
+    }
+    unsigned maxThreads = argc > 3 ? stoul(argv[3]) : max(1u, thread::hardware_concurrency());
+    int movieCount = argc > 4 ? stoi(argv[4]) : 10;
+
+    UserDatabase userDb;
+    MovieDatabase movieDb;
+    if (!userDb.load(argv[1]) || !movieDb.load(argv[2])) {
+        cerr << "Failed to load the data files" << endl;
+        return 1;
+    }
+    vector<string> emails = readEmails(argv[1]);
+    Recommender recommender(userDb, movieDb);
+
+    cout << emails.size() << " users, " << movieDb.get_movie_count() << " movies, top " << movieCount << endl;
+    double singleThreadMs = 0;
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+        auto start = chrono::steady_clock::now();
+        if (!recommender.recommend_batch(emails, movieCount, "batch_bench_output.bin", threads)) {
+            cerr << "Failed to write batch_bench_output.bin" << endl;
+            return 1;
+        }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (threads == 1) {
+            singleThreadMs = ms;
+        }
+        printf("%3u threads  %10.1f ms  %10.0f users/s  speedup %.2fx\n",
+            threads, ms, emails.size() * 1000.0 / ms, singleThreadMs / ms);
+        if (threads < maxThreads && threads * 2 > maxThreads) {
+            threads = maxThreads / 2; // make sure max_threads itself is measured
+        }
+    }
+    remove("batch_bench_output.bin");
+    return 0;
+}
@@ -0,0 +1,206 @@
+// Benchmark suite for the main code paths: TreeMultimap insert/freeze and find, MovieDatabase::load,
+// UserDatabase::load and Recommender::recommend_movies. Every benchmark is repeated and the
+// results are printed as a table and, optionally, written as JSON so runs can be compared.
+// Build from the repository root:
+//   g++ -std=c++20 -O2 -pthread -I. bench/bench_suite.cpp $(ls *.cpp | grep -v main.cpp) -o bench_suite
+// Run: ./bench_suite users.txt movies.txt [repetitions] [results.json]
+// tools/generate_dataset.cpp writes data files of any size to run it on.
+#include "UserDatabase.h"
+#include "MovieDatabase.h"
+#include "Recommender.h"
+#include "Movie.h"
+#include "treemm.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <ctime>
+#include <cstdio>
+using namespace std;
+
+// The timings of one benchmark: each repetition performs operations operations
+struct BenchmarkResult
+{
+    string name;
+    size_t operations;
+    vector<double> repetition_ns;
+};
+
+// Runs body repetitions times and records how long each run took
+static BenchmarkResult run_benchmark(const string& name, size_t operations, int repetitions, const function<void()>& body) {
+    BenchmarkResult result{ name, operations, {} };
+    for (int r = 0; r < repetitions; r++) {
+        auto start = chrono::steady_clock::now();
+        body();
+        result.repetition_ns.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+    }
+    return result;
+}
+
+static double median(vector<double> values) {
+    sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 == 1 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+// Writes s as a JSON string literal
+static void write_json_string(ostream& out, string_view s) {
+    out << '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out << escape;
+        }
+        else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+static bool write_json(const string& filename, const string& users_file, const string& movies_file,
+    int user_count, int movie_count, int repetitions, const vector<BenchmarkResult>& results) {
+    ofstream out(filename);
+    if (!out) {
+        return false;
+    }
+
+    out << "{\n  \"timestamp\": " << time(nullptr) << ",\n  \"users_file\": ";
+    write_json_string(out, users_file);
+    out << ",\n  \"movies_file\": ";
+    write_json_string(out, movies_file);
+    out << ",\n  \"user_count\": " << user_count << ",\n  \"movie_count\": " << movie_count
+        << ",\n  \"repetitions\": " << repetitions << ",\n  \"benchmarks\": [";
+    for (size_t b = 0; b < results.size(); b++) {
+        const BenchmarkResult& result = results[b];
+        double best = *min_element(result.repetition_ns.begin(), result.repetition_ns.end());
+        double mean = accumulate(result.repetition_ns.begin(), result.repetition_ns.end(), 0.0) / result.repetition_ns.size();
+        out << (b == 0 ? "\n" : ",\n") << "    {\"name\": ";
+        write_json_string(out, result.name);
+        out << ", \"operations\": " << result.operations << ", \"min_ns\": " << best << ", \"median_ns\": " << median(result.repetition_ns)
+            << ", \"mean_ns\": " << mean << ", \"ns_per_operation\": " << median(result.repetition_ns) / result.operations
+            << ", \"repetition_ns\": [";
+        for (size_t r = 0; r < result.repetition_ns.size(); r++) {
+            out << (r == 0 ? "" : ", ") << result.repetition_ns[r];
+        }
+        out << "]}";
+    }
+    out << "\n  ]\n}\n";
+    return bool(out);
+}
+
+// Reads the email (second line) of every record in users.txt
+static vector<string> readEmails(const string& filename) {
+    ifstream infile(filename);
+    vector<string> emails;
+    string name, email, count, line;
+    while (getline(infile, name) && getline(infile, email) && getline(infile, count)) {
+        emails.push_back(email);
+        for (int i = stoi(count); i > 0 && getline(infile, line); i--) {
+        }
+        getline(infile, line); // blank line between records
+    }
+    return emails;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "usage: " << argv[0] << " users.txt movies.txt [repetitions] [results.json]" << endl;
+        return 1;
+    }
+    string usersFile = argv[1], moviesFile = argv[2];
+    int repetitions = argc > 3 ? max(1, stoi(argv[3])) : 5;
+
+    UserDatabase userDb;
+    MovieDatabase movieDb;
+    if (!userDb.load(usersFile) || !movieDb.load(moviesFile)) {
+        cerr << "Failed to load the data files" << endl;
+        return 1;
+    }
+    vector<string> emails = readEmails(usersFile);
+    Recommender recommender(userDb, movieDb);
+
+    // Keys for the multimap benchmarks: every movie's ID and actors, in file order, and the
+    // same keys shuffled as lookups
+    vector<string> keys;
+    for (int m = 0; m < movieDb.get_movie_count(); m++) {
+        Movie* movie = movieDb.get_movie_at(m);
+        keys.emplace_back(movie->get_id_view());
+        for (string_view actor : movie->get_actors_view()) {
+            keys.emplace_back(actor);
+        }
+    }
+    vector<string> lookups = keys;
+    shuffle(lookups.begin(), lookups.end(), mt19937(12345));
+    TreeMultimap<string, int> frozenMap;
+    for (int k = 0; k < keys.size(); k++) {
+        frozenMap.insert(keys[k], k);
+    }
+    frozenMap.freeze();
+
+    // Recommend for at most 1000 users spread over the whole file
+    vector<string> sampleEmails;
+    size_t step = max<size_t>(1, emails.size() / 1000);
+    for (size_t u = 0; u < emails.size(); u += step) {
+        sampleEmails.push_back(emails[u]);
+    }
+
+    vector<BenchmarkResult> results;
+    results.push_back(run_benchmark("treemm_insert_freeze", keys.size(), repetitions, [&] {
+        TreeMultimap<string, int> map;
+        for (int k = 0; k < keys.size(); k++) {
+            map.insert(keys[k], k);
+        }
+        map.freeze();
+    }));
+    size_t found = 0;
+    results.push_back(run_benchmark("treemm_find", lookups.size(), repetitions, [&] {
+        for (const string& key : lookups) {
+            found += frozenMap.find(key).is_valid();
+        }
+    }));
+    results.push_back(run_benchmark("movie_database_load", movieDb.get_movie_count(), repetitions, [&] {
+        MovieDatabase db;
+        db.load(moviesFile);
+    }));
+    results.push_back(run_benchmark("user_database_load", emails.size(), repetitions, [&] {
+        UserDatabase db;
+        db.load(usersFile);
+    }));
+    size_t recommended = 0;
+    results.push_back(run_benchmark("recommend_movies_top10", sampleEmails.size(), repetitions, [&] {
+        for (const string& email : sampleEmails) {
+            recommended += recommender.recommend_movies(email, 10).size();
+        }
+    }));
+    results.push_back(run_benchmark("recommend_movies_top100", sampleEmails.size(), repetitions, [&] {
+        for (const string& email : sampleEmails) {
+            recommended += recommender.recommend_movies(email, 100).size();
+        }
+    }));
+
+    cout << emails.size() << " users, " << movieDb.get_movie_count() << " movies, " << repetitions << " repetitions"
+        << " (" << found + recommended << " results)" << endl;
+    printf("%-26s %12s %14s %14s %14s\n", "benchmark", "operations", "min ms", "median ms", "ns/operation");
+    for (const BenchmarkResult& result : results) {
+        double medianNs = median(result.repetition_ns);
+        printf("%-26s %12zu %14.2f %14.2f %14.1f\n", result.name.c_str(), result.operations,
+            *min_element(result.repetition_ns.begin(), result.repetition_ns.end()) / 1e6, medianNs / 1e6, medianNs / result.operations);
+    }
+
+    if (argc > 4 && !write_json(argv[4], usersFile, moviesFile, int(emails.size()), movieDb.get_movie_count(), repetitions, results)) {
+        cerr << "Failed to write " << argv[4] << endl;
+        return 1;
+    }
+    return 0;
+}
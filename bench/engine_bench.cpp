@@ -0,0 +1,262 @@
+// Compares the recommendation engines: ATTRIBUTE_OVERLAP (shared directors, actors and genres,
+// optionally with a NeighborIndex), SIMILAR_USERS (what users with similar histories watched,
+// found through a MinHashIndex) and EMBEDDING (dot products with learned movie vectors, scanning
+// the whole catalog or a few inverted file lists). Reports the time and memory each engine's
+// index takes to build and the latency percentiles of recommend_movies under each. For the
+// similar-user engine it also checks the neighbors LSH finds against an exact scan of every
+// user, on a smaller sample, and times that scan as the linear-cost baseline; for the embedding
+// engine, how many of the exact scan's movies probing the inverted file finds. Last, it tracks
+// the heaviest user, adds and removes viewings with UserDatabase::add_watch and remove_watch, and
+// checks every tracked recommendation against a full rescore while timing both.
+// The movie vectors are trained with the default options unless embeddings.bin is given.
+// Build from the repository root:
+//   g++ -std=c++20 -O2 -pthread -I. bench/engine_bench.cpp $(ls *.cpp | grep -v main.cpp) -o engine_bench
+// Run: ./engine_bench users.txt movies.txt [bands] [rows_per_band] [queries] [embeddings.bin]
+#include "UserDatabase.h"
+#include "MovieDatabase.h"
+#include "Recommender.h"
+#include "NeighborIndex.h"
+#include "MinHashIndex.h"
+#include "EmbeddingIndex.h"
+#include "User.h"
+#include "Movie.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <cstdio>
+using namespace std;
+
+// Recommendations asked for per query, and similar users compared against the exact scan
+static const int MOVIE_COUNT = 10;
+static const size_t NEIGHBOR_COUNT = 50;
+static const size_t EXACT_SAMPLE = 200;
+
+// Watch history changes applied to the tracked user; every third one takes a viewing back out
+static const int HISTORY_STEPS = 300;
+
+static double elapsedMs(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Prints the percentiles of latencies taken by queries that found results between them
+static void printLatency(const string& name, vector<double> latencyUs, size_t results) {
+    sort(latencyUs.begin(), latencyUs.end());
+    auto percentile = [&](double p) {
+        return latencyUs[min(latencyUs.size() - 1, size_t(p * latencyUs.size()))];
+    };
+    printf("%-28s p50 %9.1f us  p90 %9.1f us  p99 %9.1f us  max %9.1f us  %.1f results/query\n", name.c_str(),
+        percentile(0.5), percentile(0.9), percentile(0.99), latencyUs.back(), double(results) / latencyUs.size());
+}
+
+// Times one call of query per email and prints the latency percentiles
+static void reportLatency(const string& name, const vector<string>& emails, const function<size_t(const string&)>& query) {
+    vector<double> latencyUs;
+    size_t results = 0;
+    for (const string& email : emails) {
+        auto start = chrono::steady_clock::now();
+        results += query(email);
+        latencyUs.push_back(elapsedMs(start) * 1000);
+    }
+    printLatency(name, latencyUs, results);
+}
+
+// The movie ID numbers of a user's history, sorted and without repeats
+static vector<uint32_t> movieSet(const User& user) {
+    vector<uint32_t> movies(user.get_watch_history_view().begin(), user.get_watch_history_view().end());
+    sort(movies.begin(), movies.end());
+    movies.erase(unique(movies.begin(), movies.end()), movies.end());
+    return movies;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "usage: " << argv[0] << " users.txt movies.txt [bands] [rows_per_band] [queries] [embeddings.bin]" << endl;
+        return 1;
+    }
+    int bands = argc > 3 ? stoi(argv[3]) : 32;
+    int rows = argc > 4 ? stoi(argv[4]) : 2;
+    size_t queryCount = argc > 5 ? stoul(argv[5]) : 2000;
+
+    UserDatabase userDb;
+    MovieDatabase movieDb;
+    if (!userDb.load(argv[1]) || !movieDb.load(argv[2])) {
+        cerr << "Failed to load the data files" << endl;
+        return 1;
+    }
+    cout << userDb.get_user_count() << " users, " << movieDb.get_movie_count() << " movies, "
+        << bands << " bands of " << rows << " rows" << endl;
+
+    // Index builds: the attribute engine needs none, the neighbor rows are its optional speedup
+    auto start = chrono::steady_clock::now();
+    NeighborIndex neighbors;
+    neighbors.build(movieDb, 0);
+    double neighborMs = elapsedMs(start);
+    size_t neighborBytes = (neighbors.get_movie_count() + 1) * sizeof(uint32_t) + neighbors.get_entry_count() * (sizeof(uint32_t) + sizeof(uint16_t));
+    start = chrono::steady_clock::now();
+    MinHashIndex minHash;
+    minHash.build(userDb, bands, rows);
+    double minHashMs = elapsedMs(start);
+    printf("%-28s %9.1f ms  %9.1f MB\n", "build NeighborIndex", neighborMs, neighborBytes / 1e6);
+    printf("%-28s %9.1f ms  %9.1f MB\n", "build MinHashIndex", minHashMs, minHash.get_memory_bytes() / 1e6);
+    start = chrono::steady_clock::now();
+    EmbeddingIndex embeddings;
+    bool trained = !(argc > 6 && embeddings.load(argv[6]) && embeddings.get_fingerprint() == movieDb.get_fingerprint());
+    if (trained) {
+        embeddings.train(userDb, movieDb, EmbeddingIndex::TrainingOptions());
+    }
+    printf("%-28s %9.1f ms  %9.1f MB\n", trained ? "train EmbeddingIndex" : "load EmbeddingIndex", elapsedMs(start), embeddings.get_memory_bytes() / 1e6);
+
+    // Query users spread over the whole database
+    vector<string> emails;
+    size_t step = max<size_t>(1, userDb.get_user_count() / max<size_t>(1, queryCount));
+    for (size_t u = 0; u < userDb.get_user_count() && emails.size() < queryCount; u += step) {
+        emails.emplace_back(userDb.get_user_at(int(u))->get_email_view());
+    }
+
+    Recommender attributes(userDb, movieDb);
+    Recommender attributesWithNeighbors(userDb, movieDb);
+    attributesWithNeighbors.set_neighbor_index(&neighbors);
+    Recommender similarUsers(userDb, movieDb);
+    similarUsers.set_similar_user_index(&minHash);
+    reportLatency("ATTRIBUTE_OVERLAP", emails, [&](const string& email) {
+        return attributes.recommend_movies(email, MOVIE_COUNT).size();
+    });
+    reportLatency("ATTRIBUTE_OVERLAP+neighbors", emails, [&](const string& email) {
+        return attributesWithNeighbors.recommend_movies(email, MOVIE_COUNT).size();
+    });
+    reportLatency("SIMILAR_USERS", emails, [&](const string& email) {
+        return similarUsers.recommend_movies(email, MOVIE_COUNT, RecommendationFilter(), SIMILAR_USERS).size();
+    });
+
+    // The embedding engine scanning every movie, then probing fewer and fewer lists
+    Recommender embedding(userDb, movieDb);
+    embedding.set_embedding_index(&embeddings);
+    vector<vector<MovieAndRank>> exactResults;
+    reportLatency("EMBEDDING", emails, [&](const string& email) {
+        exactResults.push_back(embedding.recommend_movies(email, MOVIE_COUNT, RecommendationFilter(), EMBEDDING));
+        return exactResults.back().size();
+    });
+    for (int probes : { 32, 16, 8, 4 }) {
+        if (probes >= embeddings.get_list_count()) {
+            continue;
+        }
+        embeddings.set_probe_count(probes);
+        size_t e = 0, expected = 0, matched = 0;
+        string name = "EMBEDDING, " + to_string(probes) + "/" + to_string(embeddings.get_list_count()) + " lists";
+        reportLatency(name, emails, [&](const string& email) {
+            vector<MovieAndRank> results = embedding.recommend_movies(email, MOVIE_COUNT, RecommendationFilter(), EMBEDDING);
+            for (const MovieAndRank& exact : exactResults[e]) {
+                matched += any_of(results.begin(), results.end(), [&](const MovieAndRank& r) { return r.movie_id == exact.movie_id; });
+            }
+            expected += exactResults[e++].size();
+            return results.size();
+        });
+        printf("%-28s recall of the full scan's top %d: %.1f%%\n", "", MOVIE_COUNT, expected > 0 ? 100.0 * matched / expected : 0.0);
+    }
+    embeddings.set_probe_count(0);
+
+    // How many of the truly most similar users (by exact Jaccard, over every user) LSH finds
+    vector<vector<uint32_t>> sets(userDb.get_user_count());
+    for (int u = 0; u < userDb.get_user_count(); u++) {
+        sets[u] = movieSet(*userDb.get_user_at(u));
+    }
+    vector<MinHashIndex::SimilarUser> similar;
+    vector<pair<double, int>> exact;
+    size_t sampleCount = 0, found = 0, relevant = 0, withNeighbors = 0;
+    double lshMs = 0, scanMs = 0;
+    for (size_t e = 0; e < emails.size() && sampleCount < EXACT_SAMPLE; e += max<size_t>(1, emails.size() / EXACT_SAMPLE), sampleCount++) {
+        User* user = userDb.get_user_from_email(emails[e]);
+        start = chrono::steady_clock::now();
+        minHash.find_similar_users(*user, NEIGHBOR_COUNT, similar);
+        lshMs += elapsedMs(start);
+        withNeighbors += !similar.empty();
+
+        start = chrono::steady_clock::now();
+        vector<uint32_t> mine = movieSet(*user);
+        exact.clear();
+        for (int u = 0; u < userDb.get_user_count(); u++) {
+            if (userDb.get_user_at(u) == user) {
+                continue;
+            }
+            size_t shared = 0;
+            for (size_t a = 0, b = 0; a < mine.size() && b < sets[u].size();) {
+                if (mine[a] == sets[u][b]) {
+                    shared++, a++, b++;
+                }
+                else if (mine[a] < sets[u][b]) {
+                    a++;
+                }
+                else {
+                    b++;
+                }
+            }
+            if (shared > 0) {
+                exact.emplace_back(double(shared) / (mine.size() + sets[u].size() - shared), u);
+            }
+        }
+        size_t keep = min(NEIGHBOR_COUNT, exact.size());
+        partial_sort(exact.begin(), exact.begin() + keep, exact.end(), greater<pair<double, int>>());
+        scanMs += elapsedMs(start);
+
+        relevant += keep;
+        for (size_t x = 0; x < keep; x++) {
+            User* expected = userDb.get_user_at(exact[x].second);
+            found += any_of(similar.begin(), similar.end(), [&](const MinHashIndex::SimilarUser& s) { return s.user == expected; });
+        }
+    }
+    printf("%-28s %9.1f us per query, recall of the exact top %zu: %.1f%%, users with neighbors: %.1f%%\n",
+        "MinHash LSH neighbors", lshMs * 1000 / sampleCount, NEIGHBOR_COUNT, relevant > 0 ? 100.0 * found / relevant : 0.0,
+        100.0 * withNeighbors / sampleCount);
+    printf("%-28s %9.1f us per query\n", "exact Jaccard scan", scanMs * 1000 / sampleCount);
+
+    // Tracked scores: the heaviest user's history changes one viewing at a time, and every
+    // recommendation after a change is checked against a recommender that scores from scratch.
+    // This changes the user database, so it runs after everything else.
+    User* heaviest = userDb.get_user_at(0);
+    for (int u = 1; u < userDb.get_user_count(); u++) {
+        if (userDb.get_user_at(u)->get_watch_history_view().size() > heaviest->get_watch_history_view().size()) {
+            heaviest = userDb.get_user_at(u);
+        }
+    }
+    string heavyEmail(heaviest->get_email_view());
+    size_t heavyHistory = heaviest->get_watch_history_view().size();
+    Recommender tracking(userDb, movieDb);
+    tracking.track_user(heavyEmail);
+    tracking.recommend_movies(heavyEmail, MOVIE_COUNT); // the first one scores the whole history
+
+    mt19937 random(1);
+    vector<string> added;
+    vector<double> trackedUs, rescoreUs;
+    size_t trackedResults = 0, rescoreResults = 0, mismatches = 0;
+    for (int s = 0; s < HISTORY_STEPS; s++) {
+        if (s % 3 == 2) {
+            userDb.remove_watch(heavyEmail, added.back());
+            added.pop_back();
+        }
+        else {
+            added.emplace_back(movieDb.get_movie_at(int(random() % movieDb.get_movie_count()))->get_id_view());
+            userDb.add_watch(heavyEmail, added.back());
+        }
+
+        start = chrono::steady_clock::now();
+        vector<MovieAndRank> tracked = tracking.recommend_movies(heavyEmail, MOVIE_COUNT);
+        trackedUs.push_back(elapsedMs(start) * 1000);
+        start = chrono::steady_clock::now();
+        vector<MovieAndRank> rescored = attributes.recommend_movies(heavyEmail, MOVIE_COUNT);
+        rescoreUs.push_back(elapsedMs(start) * 1000);
+
+        trackedResults += tracked.size();
+        rescoreResults += rescored.size();
+        mismatches += !equal(tracked.begin(), tracked.end(), rescored.begin(), rescored.end(),
+            [](const MovieAndRank& a, const MovieAndRank& b) { return a.movie_id == b.movie_id && a.compatibility_score == b.compatibility_score; });
+    }
+    printf("tracked user with %zu viewings, %d history changes, %zu results differ from a full rescore\n",
+        heavyHistory, HISTORY_STEPS, mismatches);
+    printLatency("ATTRIBUTE_OVERLAP tracked", trackedUs, trackedResults);
+    printLatency("ATTRIBUTE_OVERLAP rescored", rescoreUs, rescoreResults);
+    return mismatches == 0 ? 0 : 1;
+}
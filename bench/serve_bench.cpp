@@ -0,0 +1,186 @@
+// Load-tests a running serve mode (Netflix-Movie-Recommender serve) from local clients and reports
+// queries per second and latency percentiles. Every connection keeps pipeline_depth requests in
+// flight; a request's latency runs from when it was sent until its answer line arrives.
+// Build from the repository root:
+//   g++ -std=c++20 -O2 -pthread -I. bench/serve_bench.cpp $(ls *.cpp | grep -v main.cpp) -o serve_bench
+// Run: ./serve_bench port|unix:path users.txt [connections] [pipeline_depth] [seconds] [user|recommend] [movie_count]
+#include "Metrics.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+using namespace std;
+
+// Reads the email (second line) of every record in users.txt
+static vector<string> readEmails(const string& filename) {
+    ifstream infile(filename);
+    vector<string> emails;
+    string name, email, count, line;
+    while (getline(infile, name) && getline(infile, email) && getline(infile, count)) {
+        emails.push_back(email);
+        for (int i = stoi(count); i > 0 && getline(infile, line); i--) {
+        }
+        getline(infile, line); // blank line between records
+    }
+    return emails;
+}
+
+// Connects to 127.0.0.1:port or to unix:path; -1 on failure
+static int connectTo(const string& address) {
+    if (address.rfind("unix:", 0) == 0) {
+        sockaddr_un target = {};
+        string path = address.substr(5);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || path.size() >= sizeof(target.sun_path)) {
+            return -1;
+        }
+        target.sun_family = AF_UNIX;
+        memcpy(target.sun_path, path.c_str(), path.size() + 1);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&target), sizeof(target)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    sockaddr_in target = {};
+    target.sin_family = AF_INET;
+    target.sin_port = htons(uint16_t(stoi(address)));
+    target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&target), sizeof(target)) != 0) {
+        return -1;
+    }
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return fd;
+}
+
+static bool sendAll(int fd, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += size_t(n);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "usage: " << argv[0] << " port|unix:path users.txt [connections] [pipeline_depth] [seconds] [user|recommend] [movie_count]" << endl;
+        return 1;
+    }
+    string address = argv[1];
+    vector<string> emails = readEmails(argv[2]);
+    int connections = argc > 3 ? stoi(argv[3]) : 8;
+    int depth = argc > 4 ? stoi(argv[4]) : 4;
+    double seconds = argc > 5 ? stod(argv[5]) : 10;
+    string op = argc > 6 ? argv[6] : "recommend";
+    int movieCount = argc > 7 ? stoi(argv[7]) : 10;
+    if (emails.empty() || connections < 1 || depth < 1) {
+        cerr << "Need at least one user, connection and request in flight" << endl;
+        return 1;
+    }
+
+    Histogram latency; // nanoseconds per request, all connections
+    atomic<uint64_t> errors(0);
+    atomic<bool> failed(false);
+    auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+
+    auto client = [&](int c) {
+        int fd = connectTo(address);
+        if (fd < 0) {
+            failed = true;
+            return;
+        }
+
+        // Each connection walks the users from its own starting point
+        size_t next = size_t(c) * emails.size() / size_t(connections);
+        auto makeRequest = [&]() {
+            const string& email = emails[next++ % emails.size()];
+            return op == "user" ? "{\"op\":\"user\",\"email\":\"" + email + "\"}\n"
+                : "{\"op\":\"recommend\",\"email\":\"" + email + "\",\"count\":" + to_string(movieCount) + "}\n";
+        };
+
+        deque<chrono::steady_clock::time_point> inFlight;
+        string batch;
+        for (int d = 0; d < depth; d++) {
+            batch += makeRequest();
+            inFlight.push_back(chrono::steady_clock::now());
+        }
+        if (!sendAll(fd, batch)) {
+            failed = true;
+        }
+
+        string input;
+        char buffer[1 << 16];
+        while (!failed && !inFlight.empty()) {
+            ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                failed = true;
+                break;
+            }
+            input.append(buffer, size_t(received));
+
+            // Record every complete answer and replace it with a new request until the time is up
+            size_t lineStart = 0, newline;
+            bool sending = chrono::steady_clock::now() < deadline;
+            batch.clear();
+            while ((newline = input.find('\n', lineStart)) != string::npos) {
+                auto now = chrono::steady_clock::now();
+                latency.record(uint64_t(chrono::duration_cast<chrono::nanoseconds>(now - inFlight.front()).count()));
+                if (input.compare(lineStart, 11, "{\"ok\":false") == 0) {
+                    errors++;
+                }
+                inFlight.pop_front();
+                lineStart = newline + 1;
+                if (sending) {
+                    batch += makeRequest();
+                    inFlight.push_back(now);
+                }
+            }
+            input.erase(0, lineStart);
+            if (!batch.empty() && !sendAll(fd, batch)) {
+                failed = true;
+            }
+        }
+        close(fd);
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> clients;
+    for (int c = 0; c < connections; c++) {
+        clients.emplace_back(client, c);
+    }
+    for (thread& t : clients) {
+        t.join();
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (failed) {
+        cerr << "Lost the connection to " << address << endl;
+        return 1;
+    }
+
+    printf("%d connections x %d in flight, %s requests, %.1f s\n", connections, depth, op.c_str(), elapsed);
+    printf("%10llu requests  %10.0f QPS  %llu errors\n", (unsigned long long)latency.get_count(),
+        latency.get_count() / elapsed, (unsigned long long)errors.load());
+    printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+        latency.get_value_at_quantile(0.5) / 1e3, latency.get_value_at_quantile(0.9) / 1e3,
+        latency.get_value_at_quantile(0.99) / 1e3, latency.get_value_at_quantile(0.999) / 1e3, latency.get_max() / 1e3);
+    return 0;
+}
@@ -0,0 +1,132 @@
+// Compares the flat TreeMultimap against the old unbalanced binary search tree on
+// sorted and shuffled keys.
+// Build from the repository root:
+//   g++ -std=c++20 -O2 -I. bench/treemm_bench.cpp -o treemm_bench
+// Run: ./treemm_bench [key_count]
+#include "treemm.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+using namespace std;
+
+// The original node-per-key binary search tree, kept here only as a baseline
+template <typename KeyType, typename ValueType>
+class LegacyTreeMultimap
+{
+public:
+    LegacyTreeMultimap() : m_root(nullptr) {}
+    ~LegacyTreeMultimap() { deleteNodes(m_root); }
+
+    void insert(const KeyType& key, const ValueType& value) {
+        Node** link = &m_root;
+        while (*link != nullptr) {
+            if (key == (*link)->m_key) {
+                (*link)->m_values.push_back(value);
+                return;
+            }
+            link = key < (*link)->m_key ? &(*link)->left : &(*link)->right;
+        }
+        *link = new Node(key, value);
+    }
+
+    const ValueType* find(const KeyType& key) const {
+        Node* nodePtr = m_root;
+        while (nodePtr != nullptr) {
+            if (key == nodePtr->m_key) {
+                return &nodePtr->m_values[0];
+            }
+            nodePtr = key < nodePtr->m_key ? nodePtr->left : nodePtr->right;
+        }
+        return nullptr;
+    }
+
+private:
+    struct Node
+    {
+        Node(const KeyType& key, const ValueType& value) : m_key(key), left(nullptr), right(nullptr) {
+            m_values.push_back(value);
+        }
+        KeyType m_key;
+        vector<ValueType> m_values;
+        Node* left;
+        Node* right;
+    };
+
+    void deleteNodes(Node* node) {
+        // iterative so that a degenerate (list shaped) tree cannot overflow the stack
+        vector<Node*> stack;
+        if (node != nullptr) {
+            stack.push_back(node);
+        }
+        while (!stack.empty()) {
+            Node* top = stack.back();
+            stack.pop_back();
+            if (top->left != nullptr) stack.push_back(top->left);
+            if (top->right != nullptr) stack.push_back(top->right);
+            delete top;
+        }
+    }
+
+    Node* m_root;
+};
+
+static double millisecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Inserts every key, then looks every key up in a shuffled order, and prints the timings
+template <typename Map, typename Freeze, typename Found>
+static void runCase(const char* mapName, const char* orderName, const vector<string>& keys,
+    const vector<string>& probes, Freeze freeze, Found found) {
+    Map map;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < keys.size(); i++) {
+        map.insert(keys[i], int(i));
+    }
+    freeze(map);
+    double insertMs = millisecondsSince(start);
+
+    start = chrono::steady_clock::now();
+    size_t hits = 0;
+    for (const string& probe : probes) {
+        hits += found(map, probe);
+    }
+    double findMs = millisecondsSince(start);
+
+    printf("%-8s %-9s insert %10.2f ms   find %10.2f ms   %8.1f ns/find   hits %zu\n",
+        mapName, orderName, insertMs, findMs, findMs * 1e6 / probes.size(), hits);
+}
+
+int main(int argc, char* argv[]) {
+    size_t count = argc > 1 ? stoul(argv[1]) : 20000;
+
+    // IDs in the same shape as movies.txt ("ID00042"), generated in sorted order
+    vector<string> sorted;
+    for (size_t i = 0; i < count; i++) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "ID%07zu", i);
+        sorted.push_back(buffer);
+    }
+    mt19937 rng(42);
+    vector<string> shuffled = sorted;
+    shuffle(shuffled.begin(), shuffled.end(), rng);
+    vector<string> probes = shuffled;
+    shuffle(probes.begin(), probes.end(), rng);
+
+    cout << count << " keys, " << probes.size() << " lookups" << endl;
+
+    auto freezeFlat = [](TreeMultimap<string, int>& map) { map.freeze(); };
+    auto foundFlat = [](const TreeMultimap<string, int>& map, const string& key) { return size_t(map.find(key).is_valid()); };
+    auto freezeLegacy = [](LegacyTreeMultimap<string, int>&) {};
+    auto foundLegacy = [](const LegacyTreeMultimap<string, int>& map, const string& key) { return size_t(map.find(key) != nullptr); };
+
+    runCase<TreeMultimap<string, int>>("flat", "sorted", sorted, probes, freezeFlat, foundFlat);
+    runCase<TreeMultimap<string, int>>("flat", "shuffled", shuffled, probes, freezeFlat, foundFlat);
+    runCase<LegacyTreeMultimap<string, int>>("bst", "sorted", sorted, probes, freezeLegacy, foundLegacy);
+    runCase<LegacyTreeMultimap<string, int>>("bst", "shuffled", shuffled, probes, freezeLegacy, foundLegacy);
+    return 0;
+}
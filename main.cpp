@@ -3,16 +3,43 @@
 #include "Movie.h"
 #include "MovieDatabase.h"
 #include "Recommender.h"
+#include "NeighborIndex.h"
+#include "Metrics.h"
+#include "Server.h"
+#include "SearchIndex.h"
+#include "Catalog.h"
+#include "Coordinator.h"
 #include <iostream>
 #include <string>
 #include <chrono>
 #include <cassert>
 #include <list>
 #include <vector>
+#include <span>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <csignal>
+#include <filesystem>
+#include <cstdint>
+#include <pthread.h>
+#include <unistd.h>
 using namespace std;
 
 const string USER_DATAFILE = "users.txt";
 const string MOVIE_DATAFILE = "movies.txt";
+const string USER_SNAPSHOT = "users.snap"; // optional, written by running with "compile"
+const string MOVIE_SNAPSHOT = "movies.snap";
+const string NEIGHBOR_DATAFILE = "neighbors.bin"; // optional, written by tools/build_neighbors
+const string EMBEDDING_DATAFILE = "embeddings.bin"; // optional, written by tools/train_embeddings
+const string METRICS_FILE = "metrics.prom"; // rewritten after every recommendation
+const size_t RESULT_CACHE_BYTES = 16 << 20; // rankings of recently served users
+const size_t SEARCH_RESULTS = 20; // movie lookup adds at most this many keys it may have meant
+const chrono::microseconds SEARCH_BUDGET(2000); // and stops looking for more after this long
+const uint16_t DEFAULT_SERVE_PORT = 7878; // serve mode listens on 127.0.0.1 here unless told otherwise
+const uint32_t DEFAULT_SHARD_COUNT = 2; // coordinate mode starts this many workers unless told otherwise
+const int SIMILAR_USER_BANDS = 32; // MinHash signatures of 32 bands of 2 rows find users about 20% alike
+const int SIMILAR_USER_ROWS = 2;
 
 
 // This function finds movie recommendations for a given user using a Recommender object and a MovieDatabase object
@@ -52,40 +79,327 @@ void findMatches(const Recommender& r,
 
 }
 
-int main()
-{
-    // Load user database
-    cout << "Loading user database..." << endl;
-    auto startUser = chrono::steady_clock::now();
-    UserDatabase userDb;
-    if (!userDb.load(USER_DATAFILE)) {
-        cout << "Failed to load user data file " << USER_DATAFILE << "!" << endl;
-        return 1;
+// Prints the malformed records that were skipped while loading a data file
+void printLoadErrors(const string& filename, const vector<LoadError>& errors) {
+    for (int i = 0; i < errors.size(); i++) {
+        cout << filename << ":" << errors[i].line << ": skipped record: " << errors[i].message << endl;
+    }
+}
+
+// Says so when a snapshot was passed over, usually because its text file has changed since it was
+// compiled, so a reload after publishing a new text file visibly reads that file
+void reportSkippedSnapshot(bool compileMode, bool usedSnapshot, const string& snapshot, const string& source) {
+    if (!compileMode && !usedSnapshot && filesystem::exists(snapshot)) {
+        cout << "Ignoring snapshot " << snapshot << ": it does not match the current " << source << endl;
     }
+}
+
+// Prints how long each phase of loading a database took
+void printLoadTimings(const string& database, const LoadTimings& timings) {
+    auto ms = [](uint64_t ns) { return ns / 1000000; };
+    cout << database << ": map " << ms(timings.map_ns) << "ms, parse " << ms(timings.parse_ns) << "ms, build "
+        << ms(timings.build_ns) << "ms, index " << ms(timings.index_ns) << "ms";
+    if (timings.slowest_index_ns > 0) {
+        cout << " (slowest single index " << ms(timings.slowest_index_ns) << "ms)";
+    }
+    cout << endl;
+}
+
+// Loads both databases at the same time (from their snapshots unless compiling) and, unless compiling, builds the
+// indices and the recommender of a new catalog generation. Only the users of shard out of
+// shardCount are kept. Returns nullptr if a file cannot be read.
+unique_ptr<Catalog> loadCatalog(bool compileMode, Metrics& metrics, uint64_t generation, uint32_t shard = 0, uint32_t shardCount = 1) {
+    unique_ptr<Catalog> catalog(new Catalog);
+    catalog->generation = generation;
+    catalog->users.set_shard(shard, shardCount);
+
+    // Load the movie database on a thread of its own while this one loads the user database, each
+    // from its snapshot if one has been compiled; neither needs the other until both are done
+    cout << "Loading user and movie databases..." << endl;
+    auto startLoad = chrono::steady_clock::now();
+    bool movieSnapshot = false, moviesLoaded = false;
+    chrono::steady_clock::time_point stopMovie;
+    thread movieLoader([&] {
+        movieSnapshot = !compileMode && catalog->movies.open_snapshot(MOVIE_SNAPSHOT, MOVIE_DATAFILE);
+        moviesLoaded = movieSnapshot || catalog->movies.load(MOVIE_DATAFILE);
+        stopMovie = chrono::steady_clock::now();
+    });
+    bool userSnapshot = !compileMode && catalog->users.open_snapshot(USER_SNAPSHOT, USER_DATAFILE);
+    bool usersLoaded = userSnapshot || catalog->users.load(USER_DATAFILE);
     auto stopUser = chrono::steady_clock::now();
+    movieLoader.join();
+    auto stopLoad = chrono::steady_clock::now();
+
+    if (userSnapshot) {
+        cout << "Using snapshot " << USER_SNAPSHOT << endl;
+    }
+    reportSkippedSnapshot(compileMode, userSnapshot, USER_SNAPSHOT, USER_DATAFILE);
+    if (!usersLoaded) {
+        cout << "Failed to load user data file " << USER_DATAFILE << "!" << endl;
+        return nullptr;
+    }
+    printLoadErrors(USER_DATAFILE, catalog->users.get_load_errors());
+    if (shardCount > 1) {
+        cout << "Holding " << catalog->users.get_user_count() << " users of shard " << shard << "/" << shardCount << endl;
+    }
     cout << "User database loaded" << endl;
-    cout << "Took " << chrono::duration_cast<chrono::milliseconds>(stopUser - startUser).count() << "ms" << endl;
+    cout << "Took " << chrono::duration_cast<chrono::milliseconds>(stopUser - startLoad).count() << "ms" << endl;
 
-    // Load movie database
-    cout << "Loading movie database..." << endl;
-    auto startMovie = chrono::steady_clock::now();
-    MovieDatabase movieDb;
-    if (!movieDb.load(MOVIE_DATAFILE)) {
+    if (movieSnapshot) {
+        cout << "Using snapshot " << MOVIE_SNAPSHOT << endl;
+    }
+    reportSkippedSnapshot(compileMode, movieSnapshot, MOVIE_SNAPSHOT, MOVIE_DATAFILE);
+    if (!moviesLoaded) {
         cout << "Failed to load movie data file " << MOVIE_DATAFILE << "!" << endl;
-        return 1;
+        return nullptr;
     }
-    auto stopMovie = chrono::steady_clock::now();
+    printLoadErrors(MOVIE_DATAFILE, catalog->movies.get_load_errors());
     cout << "Movie database loaded" << endl;
-    cout << "Took " << chrono::duration_cast<chrono::milliseconds>(stopMovie - startMovie).count() << "ms" << endl;
+    cout << "Took " << chrono::duration_cast<chrono::milliseconds>(stopMovie - startLoad).count() << "ms" << endl;
+
+    printLoadTimings("users", catalog->users.get_load_timings());
+    printLoadTimings("movies", catalog->movies.get_load_timings());
+    cout << "Both databases loaded in " << chrono::duration_cast<chrono::milliseconds>(stopLoad - startLoad).count() << "ms" << endl;
+
+    if (compileMode) {
+        return catalog;
+    }
+    metrics.set_load_timings("users", catalog->users.get_load_timings());
+    metrics.set_load_timings("movies", catalog->movies.get_load_timings());
+
+    // Load the precomputed neighbor lists if they were built for this movie file
+    catalog->use_neighbors = catalog->neighbors.load(NEIGHBOR_DATAFILE) && catalog->neighbors.get_movie_count() == catalog->movies.get_movie_count()
+        && catalog->neighbors.get_fingerprint() == catalog->movies.get_fingerprint();
+    if (catalog->use_neighbors) {
+        cout << "Using precomputed neighbor lists from " << NEIGHBOR_DATAFILE << endl;
+    }
+    catalog->use_embeddings = catalog->embeddings.load(EMBEDDING_DATAFILE) && catalog->embeddings.get_movie_count() == catalog->movies.get_movie_count()
+        && catalog->embeddings.get_fingerprint() == catalog->movies.get_fingerprint();
+    if (catalog->use_embeddings) {
+        cout << "Using movie vectors from " << EMBEDDING_DATAFILE << endl;
+    }
+
+    // One recommender per generation, so repeat requests are served from its cache
+    catalog->recommender.reset(new Recommender(catalog->users, catalog->movies));
+    if (catalog->use_neighbors) {
+        catalog->recommender->set_neighbor_index(&catalog->neighbors);
+    }
+
+    // MinHash signatures of every user's history, for recommendations from similar users
+    auto startSimilar = chrono::steady_clock::now();
+    catalog->similar_users.build(catalog->users, SIMILAR_USER_BANDS, SIMILAR_USER_ROWS);
+    catalog->recommender->set_similar_user_index(&catalog->similar_users);
+    if (catalog->use_embeddings) {
+        catalog->recommender->set_embedding_index(&catalog->embeddings);
+    }
+    auto stopSimilar = chrono::steady_clock::now();
+    cout << "Similar user index of " << catalog->similar_users.get_memory_bytes() / 1024 << " KiB built in "
+        << chrono::duration_cast<chrono::milliseconds>(stopSimilar - startSimilar).count() << "ms" << endl;
+    catalog->recommender->set_metrics(&metrics);
+    catalog->recommender->set_cache_budget(RESULT_CACHE_BYTES);
+
+    // Prefix and typo tolerant search over titles, IDs, directors, actors and genres
+    auto startSearch = chrono::steady_clock::now();
+    catalog->search.build(catalog->movies);
+    auto stopSearch = chrono::steady_clock::now();
+    cout << "Search index of " << catalog->search.get_key_count() << " keys built in "
+        << chrono::duration_cast<chrono::milliseconds>(stopSearch - startSearch).count() << "ms" << endl;
+    return catalog;
+}
+
+// Loads a new generation of the catalog (of the same user shard) next to the one being served
+// and publishes it. Requests already running finish on the old generation, which is freed once
+// they have.
+bool reloadCatalog(LiveCatalog& liveCatalog, Metrics& metrics) {
+    uint64_t generation;
+    uint32_t shard, shardCount;
+    {
+        LiveCatalog::ReadGuard current = liveCatalog.read();
+        generation = current->generation + 1;
+        shard = current->users.get_shard();
+        shardCount = current->users.get_shard_count();
+    }
+    unique_ptr<Catalog> catalog = loadCatalog(false, metrics, generation, shard, shardCount);
+    if (catalog == nullptr) {
+        cout << "Reload failed, still serving generation " << generation - 1 << endl;
+        return false;
+    }
+    liveCatalog.publish(move(catalog));
+    metrics.catalog_reloads.fetch_add(1, memory_order_relaxed);
+    cout << "Now serving generation " << generation << endl;
+    return true;
+}
+
+// Blocks SIGINT, SIGTERM and SIGHUP in the calling thread and every thread it starts later, so
+// only a sigwait on the returned set receives them
+sigset_t blockHandledSignals() {
+    sigset_t handledSignals;
+    sigemptyset(&handledSignals);
+    sigaddset(&handledSignals, SIGINT);
+    sigaddset(&handledSignals, SIGTERM);
+    sigaddset(&handledSignals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &handledSignals, nullptr);
+    return handledSignals;
+}
+
+// Listens on 127.0.0.1:port or on unix:path (the default port if address is empty) and starts
+// the server's threads
+bool startServer(Server& server, const string& address, unsigned threads) {
+    bool listening = address.rfind("unix:", 0) == 0 ? server.listen_unix(address.substr(5))
+        : server.listen_tcp(address.empty() ? DEFAULT_SERVE_PORT : uint16_t(stoi(address)));
+    if (!listening || !server.start(threads)) {
+        cout << "Failed to listen on " << (address.empty() ? to_string(DEFAULT_SERVE_PORT) : address) << "!" << endl;
+        return false;
+    }
+    if (server.get_port() != 0) {
+        cout << "Serving on 127.0.0.1:" << server.get_port() << endl;
+    }
+    else {
+        cout << "Serving on " << address << endl;
+    }
+    return true;
+}
+
+// Serve mode: answers line-delimited JSON requests (see Server.h) on 127.0.0.1:port or on
+// unix:path until SIGINT or SIGTERM, then writes the metrics once more to metricsFile. SIGHUP
+// reloads the data files on a background thread while the old catalog keeps serving.
+int serve(LiveCatalog& liveCatalog, Metrics& metrics, const string& address, unsigned threads, const string& metricsFile) {
+    // Block the signals before any worker starts, so they all inherit the mask
+    sigset_t handledSignals = blockHandledSignals();
+
+    CatalogHandler handler(liveCatalog);
+    handler.set_metrics(&metrics);
+    Server server(handler);
+    if (!startServer(server, address, threads)) {
+        return 1;
+    }
+
+    // At most one reload runs at a time; a SIGHUP during one is ignored
+    thread reloader;
+    atomic<bool> reloading(false);
+    int signal;
+    while (sigwait(&handledSignals, &signal) == 0 && signal == SIGHUP) {
+        if (reloading.exchange(true)) {
+            cout << "Already reloading" << endl;
+            continue;
+        }
+        if (reloader.joinable()) {
+            reloader.join();
+        }
+        reloader = thread([&liveCatalog, &metrics, &reloading] {
+            reloadCatalog(liveCatalog, metrics);
+            reloading = false;
+        });
+    }
+    cout << "Stopping" << endl;
+    if (reloader.joinable()) {
+        reloader.join();
+    }
+    server.stop();
+    if (!metrics.write_prometheus(metricsFile)) {
+        cout << "Failed to write " << metricsFile << endl;
+    }
+    return 0;
+}
+
+// Coordinate mode: starts shardCount serve mode workers of this program, each holding the users
+// of one shard, and answers the same requests on address by routing them to the workers (see
+// Coordinator.h) until SIGINT or SIGTERM. SIGHUP makes every worker reload its shard.
+int coordinate(const string& address, uint32_t shardCount, unsigned workerThreads, unsigned threads) {
+    sigset_t handledSignals = blockHandledSignals();
+
+    // The workers listen on sockets private to this run
+    Coordinator coordinator;
+    string socketPrefix = "/tmp/netflix-recommender-" + to_string(getpid()) + "-shard";
+    cout << "Starting " << shardCount << " shard workers..." << endl;
+    if (!coordinator.start_workers("/proc/self/exe", shardCount, workerThreads, socketPrefix)) {
+        cout << "A shard worker failed to start!" << endl;
+        return 1;
+    }
+    Server server(coordinator);
+    if (!startServer(server, address, threads)) {
+        return 1;
+    }
+
+    int signal;
+    while (sigwait(&handledSignals, &signal) == 0 && signal == SIGHUP) {
+        coordinator.reload_workers();
+    }
+    cout << "Stopping" << endl;
+    server.stop();
+    for (uint32_t s = 0; s < coordinator.get_shard_count(); s++) {
+        cout << "Shard " << s << " answered " << coordinator.get_forwarded_count(s) << " requests" << endl;
+    }
+    coordinator.stop_workers();
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    // In compile mode the text files are parsed and written out as binary snapshots, which
+    // later runs map instead of parsing the text again
+    bool compileMode = argc > 1 && string(argv[1]) == "compile";
+    // In serve mode the program answers requests from other processes instead of the menu. A
+    // shard worker holds only the users of shard i out of n:
+    //   Netflix-Movie-Recommender serve [port | unix:path] [threads] [i/n]
+    bool serveMode = argc > 1 && string(argv[1]) == "serve";
+    // In coordinate mode it starts shard workers and routes requests to them, loading nothing itself:
+    //   Netflix-Movie-Recommender coordinate [port | unix:path] [shards] [threads per shard] [threads]
+    if (argc > 1 && string(argv[1]) == "coordinate") {
+        return coordinate(argc > 2 ? argv[2] : "", argc > 3 ? uint32_t(stoul(argv[3])) : DEFAULT_SHARD_COUNT,
+            argc > 4 ? unsigned(stoul(argv[4])) : 0, argc > 5 ? unsigned(stoul(argv[5])) : 0);
+    }
+    uint32_t shard = 0, shardCount = 1;
+    string metricsFile = METRICS_FILE;
+    if (serveMode && argc > 4) {
+        string shardArgument = argv[4];
+        size_t slash = shardArgument.find('/');
+        shard = uint32_t(stoul(shardArgument.substr(0, slash)));
+        shardCount = slash == string::npos ? 1 : uint32_t(stoul(shardArgument.substr(slash + 1)));
+        if (shardCount == 0 || shard >= shardCount) {
+            cout << "Shard must be i/n with i below n" << endl;
+            return 1;
+        }
+        metricsFile = "metrics-shard" + to_string(shard) + ".prom"; // one file per worker
+    }
+
+    // Latency histograms and counters of every recommendation, plus the load timings
+    Metrics metrics;
+    unique_ptr<Catalog> loaded = loadCatalog(compileMode, metrics, 1, shard, shardCount);
+    if (loaded == nullptr) {
+        return 1;
+    }
+
+    if (compileMode) {
+        if (!loaded->users.compile(USER_SNAPSHOT) || !loaded->movies.compile(MOVIE_SNAPSHOT)) {
+            cout << "Failed to write the snapshots!" << endl;
+            return 1;
+        }
+        cout << "Wrote " << USER_SNAPSHOT << " and " << MOVIE_SNAPSHOT << endl;
+        return 0;
+    }
+
+    // The catalog generation being served; option 4 (or SIGHUP in serve mode) replaces it
+    LiveCatalog liveCatalog(move(loaded));
+    if (serveMode) {
+        return serve(liveCatalog, metrics, argc > 2 ? argv[2] : "", argc > 3 ? unsigned(stoul(argv[3])) : 0, metricsFile);
+    }
 
     // User interface loop
     while (true) {
         // Display options
-        cout << "1. User lookup\n2. Movie lookup\n3. Recommendation generator\n9. Exit" << endl;
+        cout << "1. User lookup\n2. Movie lookup\n3. Recommendation generator\n4. Reload data files\n9. Exit" << endl;
         cout << "Enter a number: ";
         string choice;
         getline(cin, choice);
 
+        // Reload outside of any read of the catalog, since publishing waits for all of them
+        if (choice == "4") {
+            reloadCatalog(liveCatalog, metrics);
+            continue;
+        }
+        LiveCatalog::ReadGuard catalog = liveCatalog.read();
+
         // Handle user lookup option
         if (choice == "1") {
             while (true) {
@@ -98,7 +412,7 @@ int main()
 
                 // Perform lookup and measure duration
                 auto start = chrono::steady_clock::now();
-                User* user = userDb.get_user_from_email(email);
+                User* user = catalog->users.get_user_from_email(email);
                 auto stop = chrono::steady_clock::now();
 
                 // Display result and duration
@@ -108,7 +422,7 @@ int main()
                 else {
                     cout << "Found " << user->get_full_name() << endl;
                 }
-                cout << "Took " << chrono::duration_cast<chrono::microseconds>(stop - start).count() << "s" << endl;
+                cout << "Took " << chrono::duration_cast<chrono::microseconds>(stop - start).count() << "µs" << endl;
             }
         }
         // Handle movie lookup option
@@ -124,27 +438,53 @@ int main()
 
                 // Perform lookup and measure duration
                 auto start = chrono::steady_clock::now();
-                Movie* movie1 = movieDb.get_movie_from_id(string_val);
+                size_t matchCount = 0;
+                Movie* movie1 = catalog->movies.get_movie_from_id(string_val);
                 if (movie1 != nullptr) {
                     outputBuf.push_back("ID: Found " + movie1->get_title());
+                    matchCount++;
                 }
-                vector<Movie*> movie2 = movieDb.get_movies_with_actor(string_val);
-                for (auto movie : movie2) {
-                    outputBuf.push_back("Actor: Found " + movie->get_title());
+                const pair<const char*, span<Movie* const>> attributeMatches[] = {
+                    { "Actor", catalog->movies.get_movies_with_actor_view(string_val) },
+                    { "Director", catalog->movies.get_movies_with_director_view(string_val) },
+                    { "Genre", catalog->movies.get_movies_with_genre_view(string_val) },
+                };
+                for (const pair<const char*, span<Movie* const>>& attributeMatch : attributeMatches) {
+                    for (auto movie : attributeMatch.second) {
+                        outputBuf.push_back(string(attributeMatch.first) + ": Found " + movie->get_title());
+                    }
+                    matchCount += attributeMatch.second.size();
                 }
-                vector<Movie*> movie3 = movieDb.get_movies_with_director(string_val);
-                for (auto movie : movie3) {
-                    outputBuf.push_back("Director: Found " + movie->get_title());
+
+                // Titles that are the text, then other titles, IDs and names that match it up to
+                // case, start with it or are a typo or two away
+                bool searchIncomplete = false;
+                vector<SearchIndex::Result> results = catalog->search.search(string_val, SEARCH_RESULTS, SEARCH_BUDGET, &searchIncomplete);
+                const char* const fieldNames[SearchIndex::FIELD_COUNT] = { "Title", "ID", "Director", "Actor", "Genre" };
+                for (const SearchIndex::Result& result : results) {
+                    bool exactText = result.match == SearchIndex::EXACT && result.text == string_val;
+                    if (exactText && result.field != SearchIndex::TITLE) {
+                        continue; // listed movie by movie above
+                    }
+                    string line = string(fieldNames[result.field]) + (exactText ? ": Found " : ": Did you mean ");
+                    if (result.field == SearchIndex::TITLE || result.field == SearchIndex::ID) {
+                        Movie* movie = catalog->movies.get_movie_at(int(result.reference));
+                        line += movie->get_title() + " (" + movie->get_id() + ")";
+                    }
+                    else {
+                        line += string(result.text) + " (" + to_string(result.movie_count) + " movies)";
+                    }
+                    outputBuf.push_back(line);
+                    matchCount += exactText ? 1 : 0;
                 }
-                vector<Movie*> movie4 = movieDb.get_movies_with_genre(string_val);
-                for (auto movie : movie4) {
-                    outputBuf.push_back("Genre: Found " + movie->get_title());
+                if (searchIncomplete) {
+                    outputBuf.push_back("(search stopped early, there may be more suggestions)");
                 }
                 auto stop = chrono::steady_clock::now();
                 for (auto tempVal : outputBuf) {
                     cout << tempVal << endl;
                 }
-                cout << "Found a total of " << outputBuf.size() << " matches." << endl;
+                cout << "Found a total of " << matchCount << " matches." << endl;
                 cout << "Took (*very* roughly) " << (chrono::duration_cast<chrono::microseconds>(stop - start).count()) << "?s" << endl;
                 outputBuf.clear();
             }
@@ -159,12 +499,12 @@ int main()
                 cin >> num_recommendations;
                 cin.ignore(10000, '\n');
 
-                // Initialize a Recommender object with the user and movie databases
-                Recommender recommender(userDb, movieDb);
-
                 // Call the findMatches function with the recommender object, movie database,
                 // user email, and number of recommendations
-                findMatches(recommender, movieDb, user_email, num_recommendations);
+                findMatches(*catalog->recommender, catalog->movies, user_email, num_recommendations);
+                if (!metrics.write_prometheus(METRICS_FILE)) {
+                    cout << "Failed to write " << METRICS_FILE << endl;
+                }
         }
         else if (choice == "9") {
             return 0;
@@ -0,0 +1,42 @@
+// Offline build step for the precomputed similar-movie lists used by Recommender.
+// Build from the repository root:
+//   g++ -std=c++20 -O2 -pthread -I. tools/build_neighbors.cpp $(ls *.cpp | grep -v main.cpp) -o build_neighbors
+// Run: ./build_neighbors movies.txt neighbors.bin [max_neighbors]
+// With max_neighbors 0 (the default) the rows are complete and recommendations are unchanged.
+#include "MovieDatabase.h"
+#include "NeighborIndex.h"
+#include <iostream>
+#include <string>
+#include <chrono>
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "usage: " << argv[0] << " movies.txt neighbors.bin [max_neighbors]" << endl;
+        return 1;
+    }
+    int max_neighbors = argc > 3 ? stoi(argv[3]) : 0;
+
+    MovieDatabase movieDb;
+    if (!movieDb.load(argv[1])) {
+        cerr << "Failed to load movie data file " << argv[1] << "!" << endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    NeighborIndex neighbors;
+    neighbors.build(movieDb, max_neighbors);
+    auto stop = chrono::steady_clock::now();
+
+    size_t bytes = (neighbors.get_movie_count() + 1) * sizeof(uint32_t) + neighbors.get_entry_count() * (sizeof(uint32_t) + sizeof(uint16_t));
+    cout << "Built neighbor lists for " << neighbors.get_movie_count() << " movies in "
+        << chrono::duration_cast<chrono::milliseconds>(stop - start).count() << "ms" << endl;
+    cout << neighbors.get_entry_count() << " entries, " << bytes / 1024 << " KiB"
+        << (neighbors.is_exact() ? " (exact)" : " (capped, scores are approximate)") << endl;
+
+    if (!neighbors.save(argv[2])) {
+        cerr << "Failed to write " << argv[2] << "!" << endl;
+        return 1;
+    }
+    return 0;
+}
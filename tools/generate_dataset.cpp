@@ -0,0 +1,251 @@
+// Writes a synthetic movies.txt and users.txt in the same format as the real data files, for
+// benchmarking at sizes the shipped data does not reach.
+// Build from the repository root:
+//   g++ -std=c++20 -O2 -I. tools/generate_dataset.cpp -o generate_dataset
+// Run: ./generate_dataset movie_count user_count [seed] [output_directory]
+// The same seed always produces the same files. Actors, directors and genres are credited with a
+// power-law (Zipf) frequency, and so is how often each movie is watched, so a few names and movies
+// are very common and most are rare, like in real catalogs. Watch history lengths are heavy tailed.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <cstdio>
+using namespace std;
+
+// A small, fully specified generator, so the output depends only on the seed and not on the
+// standard library's distributions
+class Random
+{
+public:
+    explicit Random(uint64_t seed) : m_state(seed) {}
+
+    // splitmix64
+    uint64_t next() {
+        uint64_t z = (m_state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // uniform in [0, 1)
+    double uniform() {
+        return (next() >> 11) * 0x1.0p-53;
+    }
+
+    // uniform in [low, high]
+    int between(int low, int high) {
+        return low + int(next() % uint64_t(high - low + 1));
+    }
+
+private:
+    uint64_t m_state;
+};
+
+// Draws ranks 0..n-1 with probability proportional to 1 / (rank + 1)^exponent
+class ZipfSampler
+{
+public:
+    ZipfSampler(size_t n, double exponent) : m_cdf(n) {
+        double total = 0;
+        for (size_t r = 0; r < n; r++) {
+            total += 1.0 / pow(double(r + 1), exponent);
+            m_cdf[r] = total;
+        }
+        for (size_t r = 0; r < n; r++) {
+            m_cdf[r] /= total;
+        }
+    }
+
+    size_t operator()(Random& random) const {
+        size_t rank = upper_bound(m_cdf.begin(), m_cdf.end(), random.uniform()) - m_cdf.begin();
+        return min(rank, m_cdf.size() - 1);
+    }
+
+private:
+    vector<double> m_cdf;
+};
+
+static const char* const GENRES[] = { "Drama", "Comedy", "Thriller", "Action", "Romance", "Crime", "Horror",
+    "Documentary", "Adventure", "Sci-Fi", "Family", "Mystery", "Fantasy", "Animation", "Biography", "History",
+    "Music", "War", "Sport", "Musical", "Western", "Film-Noir", "Short", "News" };
+static const char* const FIRST_NAMES[] = { "James", "Mary", "Robert", "Patricia", "John", "Jennifer", "Michael",
+    "Linda", "David", "Elizabeth", "William", "Barbara", "Richard", "Susan", "Joseph", "Jessica", "Thomas", "Sarah",
+    "Charles", "Karen", "Abdullah", "Mei", "Carlos", "Aisha", "Hiroshi", "Olga", "Kwame", "Priya", "Lars", "Fatima" };
+static const char* const LAST_NAMES[] = { "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller",
+    "Davis", "Rodriguez", "Martinez", "Hernandez", "Lopez", "Wilson", "Anderson", "Taylor", "Moore", "Fowler",
+    "Nguyen", "Kim", "Chen", "Okafor", "Ivanova", "Tanaka", "Schmidt", "Rossi", "Singh", "Haddad", "Larsen" };
+static const char* const TITLE_WORDS[] = { "The", "Last", "Night", "City", "Love", "Dark", "House", "King", "Lost",
+    "River", "Secret", "Man", "Woman", "Story", "Return", "Blood", "Summer", "Dream", "Home", "War", "Girl", "Boy",
+    "Road", "Star", "Shadow", "Fire", "Island", "Heart", "Day", "Stranger", "Garden", "Ghost", "Winter", "Empire" };
+static const char* const DOMAINS[] = { "gmail.com", "yahoo.com", "hotmail.com", "aol.com", "charter.net", "comcast.net", "outlook.com" };
+
+template <typename T, size_t N>
+static const T& pick(const T (&items)[N], Random& random) {
+    return items[random.next() % N];
+}
+
+// Movie IDs are "ID" followed by the zero padded index, at least five digits like the real data
+static string movie_id(size_t index, int digits) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "ID%0*zu", digits, index);
+    return buffer;
+}
+
+// A distinct person name for every index: a first and last name plus a suffix once those run out
+static string person_name(size_t index) {
+    const size_t firsts = size(FIRST_NAMES), lasts = size(LAST_NAMES);
+    string name = string(FIRST_NAMES[index % firsts]) + " " + LAST_NAMES[(index / firsts) % lasts];
+    if (index >= firsts * lasts) {
+        name += " " + to_string(index / (firsts * lasts) + 1);
+    }
+    return name;
+}
+
+// Appends count distinct ranks drawn from sampler, comma separated
+static void append_names(string& line, const vector<string>& names, const ZipfSampler& sampler, int count, Random& random) {
+    vector<size_t> chosen;
+    for (int attempt = 0; chosen.size() < size_t(count) && attempt < count * 8; attempt++) {
+        size_t rank = sampler(random);
+        if (find(chosen.begin(), chosen.end(), rank) == chosen.end()) {
+            chosen.push_back(rank);
+        }
+    }
+    for (size_t c = 0; c < chosen.size(); c++) {
+        line += c == 0 ? "" : ",";
+        line += names[chosen[c]];
+    }
+}
+
+static bool write_movies(const string& filename, size_t movie_count, int id_digits, Random& random) {
+    ofstream out(filename, ios::binary);
+    if (!out) {
+        return false;
+    }
+
+    // Roughly one director per six movies and three actors per four, like the original catalog
+    vector<string> directors(max<size_t>(1, movie_count / 6));
+    for (size_t d = 0; d < directors.size(); d++) {
+        directors[d] = person_name(d);
+    }
+    vector<string> actors(max<size_t>(1, movie_count * 3 / 4));
+    for (size_t a = 0; a < actors.size(); a++) {
+        actors[a] = person_name(a);
+    }
+    vector<string> genres(begin(GENRES), end(GENRES));
+
+    // Shuffle the names so popularity does not follow alphabetical order
+    for (vector<string>* names : { &directors, &actors, &genres }) {
+        for (size_t i = names->size(); i > 1; i--) {
+            swap((*names)[i - 1], (*names)[random.next() % i]);
+        }
+    }
+    ZipfSampler director_sampler(directors.size(), 0.9);
+    ZipfSampler actor_sampler(actors.size(), 1.0);
+    ZipfSampler genre_sampler(genres.size(), 1.1);
+
+    string record;
+    for (size_t m = 0; m < movie_count; m++) {
+        record.clear();
+        record += movie_id(m, id_digits) + "\n";
+
+        int title_words = random.between(1, 4);
+        for (int w = 0; w < title_words; w++) {
+            record += w == 0 ? "" : " ";
+            record += pick(TITLE_WORDS, random);
+        }
+        record += "\n";
+
+        // newer years are more common
+        record += to_string(2024 - int(104 * random.uniform() * random.uniform())) + "\n";
+
+        append_names(record, directors, director_sampler, random.uniform() < 0.9 ? 1 : 2, random);
+        record += "\n";
+        append_names(record, actors, actor_sampler, random.between(1, 8), random);
+        record += "\n";
+        append_names(record, genres, genre_sampler, random.between(1, 3), random);
+        record += "\n";
+
+        char rating[16];
+        snprintf(rating, sizeof(rating), "%.1f", 5.0 * random.uniform());
+        record += rating;
+        record += "\n\n";
+        out << record;
+    }
+    return bool(out);
+}
+
+static bool write_users(const string& filename, size_t user_count, size_t movie_count, int id_digits, Random& random) {
+    ofstream out(filename, ios::binary);
+    if (!out) {
+        return false;
+    }
+
+    // Popular movies are watched far more often; a random permutation decides which ones are popular
+    vector<size_t> by_popularity(movie_count);
+    for (size_t m = 0; m < movie_count; m++) {
+        by_popularity[m] = m;
+    }
+    for (size_t i = movie_count; i > 1; i--) {
+        swap(by_popularity[i - 1], by_popularity[random.next() % i]);
+    }
+    ZipfSampler movie_sampler(movie_count, 0.8);
+
+    string record;
+    vector<size_t> history;
+    for (size_t u = 0; u < user_count; u++) {
+        string first = pick(FIRST_NAMES, random), last = pick(LAST_NAMES, random);
+        record.clear();
+        record += first + " " + last + "\n";
+        record += first.substr(0, 2) + last.substr(0, 3) + to_string(u) + "@" + pick(DOMAINS, random) + "\n";
+
+        // Pareto distributed history length of at least 8 and at most 500 movies
+        size_t length = min<size_t>({ 500, movie_count, size_t(8.0 / pow(1.0 - random.uniform(), 1.0 / 1.5)) });
+        history.clear();
+        for (size_t attempt = 0; history.size() < length && attempt < length * 8; attempt++) {
+            size_t movie = by_popularity[movie_sampler(random)];
+            if (find(history.begin(), history.end(), movie) == history.end()) {
+                history.push_back(movie);
+            }
+        }
+        record += to_string(history.size()) + "\n";
+        for (size_t movie : history) {
+            record += movie_id(movie, id_digits) + "\n";
+        }
+        record += "\n";
+        out << record;
+    }
+    return bool(out);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "usage: " << argv[0] << " movie_count user_count [seed] [output_directory]" << endl;
+        return 1;
+    }
+    size_t movie_count = stoull(argv[1]);
+    size_t user_count = stoull(argv[2]);
+    uint64_t seed = argc > 3 ? stoull(argv[3]) : 1;
+    string directory = argc > 4 ? string(argv[4]) + "/" : "";
+    if (movie_count == 0) {
+        cerr << "movie_count must be at least 1" << endl;
+        return 1;
+    }
+
+    int id_digits = max(5, int(to_string(movie_count - 1).size()));
+    Random movie_random(seed);
+    Random user_random(seed ^ 0x5bd1e995ULL); // independent streams, so user_count does not change movies.txt
+    if (!write_movies(directory + "movies.txt", movie_count, id_digits, movie_random)) {
+        cerr << "Failed to write " << directory << "movies.txt" << endl;
+        return 1;
+    }
+    if (!write_users(directory + "users.txt", user_count, movie_count, id_digits, user_random)) {
+        cerr << "Failed to write " << directory << "users.txt" << endl;
+        return 1;
+    }
+    cout << "Wrote " << movie_count << " movies and " << user_count << " users (seed " << seed << ")" << endl;
+    return 0;
+}
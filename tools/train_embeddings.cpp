@@ -0,0 +1,55 @@
+// Offline training step for the movie vectors used by the EMBEDDING recommendation engine.
+// Build from the repository root:
+//   g++ -std=c++20 -O2 -pthread -I. tools/train_embeddings.cpp $(ls *.cpp | grep -v main.cpp) -o train_embeddings
+// Run: ./train_embeddings users.txt movies.txt embeddings.bin [dimensions] [iterations] [lists]
+// The program loads embeddings.bin at startup if it was trained for the same movies file.
+#include "UserDatabase.h"
+#include "MovieDatabase.h"
+#include "EmbeddingIndex.h"
+#include <iostream>
+#include <string>
+#include <chrono>
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "usage: " << argv[0] << " users.txt movies.txt embeddings.bin [dimensions] [iterations] [lists]" << endl;
+        return 1;
+    }
+    EmbeddingIndex::TrainingOptions options;
+    if (argc > 4) {
+        options.dimensions = stoi(argv[4]);
+    }
+    if (argc > 5) {
+        options.iterations = stoi(argv[5]);
+    }
+    if (argc > 6) {
+        options.list_count = stoi(argv[6]);
+    }
+
+    UserDatabase userDb;
+    MovieDatabase movieDb;
+    if (!userDb.load(argv[1])) {
+        cerr << "Failed to load user data file " << argv[1] << "!" << endl;
+        return 1;
+    }
+    if (!movieDb.load(argv[2])) {
+        cerr << "Failed to load movie data file " << argv[2] << "!" << endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    EmbeddingIndex embeddings;
+    embeddings.train(userDb, movieDb, options);
+    auto stop = chrono::steady_clock::now();
+
+    cout << "Trained " << embeddings.get_dimensions() << "-dimensional vectors for " << embeddings.get_movie_count() << " movies from "
+        << userDb.get_user_count() << " users in " << chrono::duration_cast<chrono::milliseconds>(stop - start).count() << "ms" << endl;
+    cout << embeddings.get_list_count() << " lists, " << embeddings.get_memory_bytes() / 1024 << " KiB" << endl;
+
+    if (!embeddings.save(argv[3])) {
+        cerr << "Failed to write " << argv[3] << "!" << endl;
+        return 1;
+    }
+    return 0;
+}
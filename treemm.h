@@ -2,7 +2,18 @@
 #define TREEMULTIMAP_INCLUDED
 
 #include <vector>
-
+#include <string>
+#include <utility>
+#include <algorithm>
+#include <cstddef>
+#include <span>
+
+// A multimap stored as a sorted, flat array of keys with the values for each key kept
+// contiguously in a single value array. Inserts are staged and become visible to find()
+// once freeze() has been called, which sorts and merges them into the flat arrays.
+// Lookups are a binary search over the key array, so they stay O(log n) no matter what
+// order the keys were inserted in, and touch a handful of cache lines instead of chasing
+// one heap-allocated node per level.
 template <typename KeyType, typename ValueType>
 class TreeMultimap
 {
@@ -10,17 +21,17 @@ public:
     class Iterator
     {
     public:
-        Iterator() : m_isValid(false) {} // default constructor, invalid iterator
+        Iterator() : m_isValid(false), m_valueIt(nullptr), m_end(nullptr) {} // default constructor, invalid iterator
 
-        Iterator(typename std::vector<ValueType>::iterator it, typename std::vector<ValueType>::const_iterator end)
-            : m_valueIt(it), m_end(end), m_isValid(true) {} // constructor for a valid iterator
+        Iterator(ValueType* it, const ValueType* end)
+            : m_isValid(it != end), m_valueIt(it), m_end(end) {} // constructor for a valid iterator
 
         bool is_valid() const {
             return m_isValid;
         }
 
         ValueType& get_value() const {
-            return *m_valueIt; // dereference the value iterator
+            return *m_valueIt; // dereference the value pointer
         }
 
         void advance() {
@@ -28,123 +39,116 @@ public:
                 return; // iterator is invalid, return without advancing
             }
 
-            ++m_valueIt; // advance the value iterator
+            ++m_valueIt; // advance the value pointer
 
-            if (m_valueIt == m_end) { // reached the end of the value vector
+            if (m_valueIt == m_end) { // reached the end of the values for this key
                 m_isValid = false; // invalidate the iterator
             }
         }
 
     private:
         bool m_isValid;
-        typename std::vector<ValueType>::iterator m_valueIt; // iterator for the vector of values
-        typename std::vector<ValueType>::const_iterator m_end; // marks the end of the value vector
+        ValueType* m_valueIt; // current value in the flat value array
+        const ValueType* m_end; // marks the end of the values for this key
     };
 
     // constructor
-    TreeMultimap() : m_root(nullptr) {}
+    TreeMultimap() {}
 
-    // destructor
-    ~TreeMultimap()
-    {
-        m_root = deleteNodes(m_root); // recursively delete nodes starting from the root
+    // insert a new key-value pair into the multimap
+    // the pair is staged and will not be returned by find() until freeze() is called
+    void insert(const KeyType& key, const ValueType& value) {
+        m_pending.emplace_back(key, value);
     }
 
-    // insert a new key-value pair into the multimap
-    void insert(const std::string& key, const ValueType& value) {
-        if (m_root == nullptr) { // tree is empty, create a new root node
-            m_root = new Node(key, value);
-            return;
+    void insert(KeyType&& key, const ValueType& value) {
+        m_pending.emplace_back(std::move(key), value);
+    }
+
+    // merge all staged pairs into the sorted flat arrays
+    // values for the same key keep the order they were inserted in
+    void freeze() {
+        if (m_pending.empty()) {
+            return; // nothing staged since the last freeze
         }
 
-        Node* nodePtr = m_root;
+        // keys usually arrive sorted (IDs, emails), so only sort when we have to
+        auto keyLess = [](const Entry& a, const Entry& b) { return a.first < b.first; };
+        if (!std::is_sorted(m_pending.begin(), m_pending.end(), keyLess)) {
+            std::stable_sort(m_pending.begin(), m_pending.end(), keyLess);
+        }
 
-        while (true) {
-            if (key == nodePtr->m_key) { // found an existing key, append the value to its vector
-                nodePtr->m_values.push_back(value);
-                return;
-            }
-            if (key < nodePtr->m_key) { // go to the left child
-                if (nodePtr->left == nullptr) {
-                    nodePtr->left = new Node(key, value);
-                    return;
-                }
-                nodePtr = nodePtr->left;
-                /*if (nodePtr->left != nullptr) {
-                    nodePtr = nodePtr->left;
-                }
-                else {
-                    nodePtr->left = new Node(key, value);
-                    return;
-                }*/
+        // expand the frozen arrays back into entries and merge the staged ones after them
+        std::vector<Entry> merged;
+        merged.reserve(m_values.size() + m_pending.size());
+        for (std::size_t k = 0; k < m_keys.size(); k++) {
+            for (std::size_t v = m_offsets[k]; v < m_offsets[k + 1]; v++) {
+                merged.emplace_back(m_keys[k], std::move(m_values[v]));
             }
-            else if (key > nodePtr->m_key) { // go to the right child
-                if (nodePtr->right == nullptr) {
-                    nodePtr->right = new Node(key, value);
-                    return;
-                }
-                nodePtr = nodePtr->right;
-                /*if (nodePtr->right != nullptr) {
-                    nodePtr = nodePtr->right;
-                }
-                else
-                {
-                    nodePtr->right = new Node(key, value);
-                    return;
-                }*/
+        }
+        std::size_t frozenCount = merged.size();
+        for (Entry& entry : m_pending) {
+            merged.push_back(std::move(entry));
+        }
+        std::inplace_merge(merged.begin(), merged.begin() + frozenCount, merged.end(), keyLess);
+
+        // rebuild the flat key, offset and value arrays
+        m_keys.clear();
+        m_offsets.clear();
+        m_values.clear();
+        m_values.reserve(merged.size());
+        for (std::size_t i = 0; i < merged.size(); i++) {
+            if (m_keys.empty() || m_keys.back() != merged[i].first) { // first value of a new key
+                m_offsets.push_back(m_values.size());
+                m_keys.push_back(std::move(merged[i].first));
             }
+            m_values.push_back(std::move(merged[i].second));
         }
+        m_offsets.push_back(m_values.size());
+
+        std::vector<Entry>().swap(m_pending); // release the staging memory
+    }
+
+    // replace the contents with already sorted, unique keys and the values that go with them,
+    // where the values of keys[k] are values[offsets[k], offsets[k + 1]) and offsets has one
+    // more entry than keys; skips all of the sorting that freeze() would do
+    void assign_sorted(std::vector<KeyType>&& keys, std::vector<std::size_t>&& offsets, std::vector<ValueType>&& values) {
+        m_keys = std::move(keys);
+        m_offsets = std::move(offsets);
+        m_values = std::move(values);
+        m_pending.clear();
     }
 
     // return an iterator pointing to the first value associated with the given key
     // if the key is not found, return an invalid iterator
-    Iterator find(const KeyType& key) const {
-        Node* find_nodePtr = this->m_root;
+    // the key may be any type that compares with KeyType (e.g. std::string_view for std::string keys)
+    template <typename LookupKey>
+    Iterator find(const LookupKey& key) const {
+        std::span<ValueType> values = find_all(key);
+        return Iterator(values.data(), values.data() + values.size());
+    }
 
-        while (find_nodePtr != nullptr) {
-            if (key == find_nodePtr->m_key) { // found the key
-                return Iterator(find_nodePtr->m_values.begin(), find_nodePtr->m_values.end());
-            }
-            
-            if (key < find_nodePtr->m_key) { // go to the left child
-                find_nodePtr = find_nodePtr->left;
-            }
-            else if (key > find_nodePtr->m_key) { // go to the right child
-                find_nodePtr = find_nodePtr->right;
-            }
+    // return all values associated with the given key as a range over the stored values
+    // if the key is not found, return an empty range
+    template <typename LookupKey>
+    std::span<ValueType> find_all(const LookupKey& key) const {
+        typename std::vector<KeyType>::const_iterator it = std::lower_bound(m_keys.begin(), m_keys.end(), key);
+
+        if (it == m_keys.end() || key < *it) { // key is not in the multimap
+            return std::span<ValueType>();
         }
 
-        return Iterator(); // return an invalid iterator
+        std::size_t k = it - m_keys.begin();
+        return std::span<ValueType>(m_values.data() + m_offsets[k], m_offsets[k + 1] - m_offsets[k]);
     }
 
 private:
-    // a node in the multimap's binary search tree
-    struct Node
-    {
-        KeyType m_key;
-        std::vector<ValueType> m_values; // vector of values associated with the key
-        Node* left;
-        Node* right;
-
-        // constructor for a node
-        Node(const KeyType& key, ValueType value) : m_key(key), left(nullptr), right(nullptr)
-        {
-            m_values.push_back(value);
-        }
-    };
-
-    // deletes all nodes in the BST
-    Node* deleteNodes(Node* toBeDeleted) {
-        if (toBeDeleted == nullptr) {
-            return nullptr;
-        }
-        deleteNodes(toBeDeleted->left);
-        deleteNodes(toBeDeleted->right);
-        delete toBeDeleted;
-        return nullptr;
-    }
+    typedef std::pair<KeyType, ValueType> Entry;
 
-    Node* m_root;
+    std::vector<Entry> m_pending; // pairs inserted since the last freeze()
+    std::vector<KeyType> m_keys; // sorted, unique keys
+    std::vector<std::size_t> m_offsets; // values of m_keys[k] are m_values[m_offsets[k], m_offsets[k + 1])
+    mutable std::vector<ValueType> m_values; // values of every key, stored contiguously in key order
 };
 
 #endif // TREEMULTIMAP_INCLUDED
\ No newline at end of file